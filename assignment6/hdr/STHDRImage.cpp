@@ -2,10 +2,43 @@
 #include "st.h"
 #include "STHDRImage.h"
 
+#include <math.h>
+#include <vector>
+#ifndef _WIN32
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#endif
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+#ifdef __F16C__
+#include <immintrin.h>
+#endif
+
+#ifdef __SSE2__
+/* Interleave four r, g and b values into four pixels. */
+static inline void
+store_rgb(float* dst, __m128 r, __m128 g, __m128 b) {
+  __m128 rg = _mm_unpacklo_ps(r, g);                           // r0 g0 r1 g1
+  __m128 br = _mm_shuffle_ps(b, r, _MM_SHUFFLE(1,1,0,0));      // b0 b0 r1 r1
+  __m128 gb = _mm_shuffle_ps(g, b, _MM_SHUFFLE(1,1,1,1));      // g1 g1 b1 b1
+  __m128 rg2 = _mm_shuffle_ps(r, g, _MM_SHUFFLE(2,2,2,2));     // r2 r2 g2 g2
+  __m128 br3 = _mm_shuffle_ps(b, r, _MM_SHUFFLE(3,3,2,2));     // b2 b2 r3 r3
+  __m128 gb3 = _mm_shuffle_ps(g, b, _MM_SHUFFLE(3,3,3,3));     // g3 g3 b3 b3
+  _mm_storeu_ps(dst,     _mm_shuffle_ps(rg, br, _MM_SHUFFLE(2,0,1,0)));
+  _mm_storeu_ps(dst + 4, _mm_shuffle_ps(gb, rg2, _MM_SHUFFLE(2,0,2,0)));
+  _mm_storeu_ps(dst + 8, _mm_shuffle_ps(br3, gb3, _MM_SHUFFLE(2,0,2,0)));
+}
+#endif
+
 /* Create an HDR image w x h in dimension and clear all values to 0. */
 STHDRImage::STHDRImage(int w, int h, STHDRImage::Pixel color) {
   mWidth = w;
   mHeight = h;
+  mMapping = NULL;
+  mMapSize = 0;
   int numPixels = mWidth * mHeight;
   mPixels = new STHDRImage::Pixel[numPixels];
   for (int ii = 0; ii < numPixels; ++ii) {
@@ -20,19 +53,34 @@ STHDRImage::STHDRImage(int w, int h, STHDRImage::Pixel color) {
 */ 
 STHDRImage::STHDRImage(const std::string& filename) {
   // Determine how to load the file from the file's extension
-  // The ST library currently only supports hdr images of type PFM
+  // Supported are PFM, Radiance RGBE (HDR or PIC) and half-float PFH
+
+  mWidth = mHeight = 0;
+  mPixels = NULL;
+  mMapping = NULL;
+  mMapSize = 0;
 
   std::string ext = STGetExtension( filename );
 
   if (ext.compare("PFM") == 0)
     LoadPFM(filename.c_str());
+  else if (ext.compare("HDR") == 0 || ext.compare("PIC") == 0)
+    LoadRGBE(filename.c_str());
+  else if (ext.compare("PFH") == 0)
+    LoadPFH(filename.c_str());
   else {
-    throw new std::runtime_error("HDR image file extension must be PFM.");
+    throw new std::runtime_error("HDR image file extension must be PFM, HDR, PIC or PFH.");
   } 
 }
 
 /* Destroy the HDR image. */
 STHDRImage::~STHDRImage() {
+#ifndef _WIN32
+  if (mMapping) {
+    munmap(mMapping, mMapSize);
+    return;
+  }
+#endif
   if (mPixels)
     delete[] mPixels;
 }
@@ -56,71 +104,183 @@ void STHDRImage::SetPixel(int x, int y, Pixel value)
 
   mPixels[y*mWidth + x] = value;
 }
-/* Load image data from file in PFM format */
-STStatus
-STHDRImage::LoadPFM(const char* filename) {
+/* Read a whole file into memory. */
+static bool
+read_file(const char* filename, std::vector<unsigned char>& data) {
   FILE* fin = fopen(filename, "rb");
-  char buffer[128];
-
   if (fin == NULL) {
     printf("Error opening file: %s\n", filename);
-    return ST_ERROR;
+    return false;
+  }
+  fseek(fin, 0, SEEK_END);
+  long size = ftell(fin);
+  fseek(fin, 0, SEEK_SET);
+  data.resize(size > 0 ? size : 0);
+  bool ok = size > 0 && fread(&data[0], 1, size, fin) == (size_t)size;
+  fclose(fin);
+  if (!ok)
+    printf("Error reading file: %s\n", filename);
+  return ok;
+}
+
+/* Load a float from possibly unaligned memory, reversing its byte
+ * order if swap is set.
+ */
+static inline float
+load_float(const unsigned char* p, bool swap) {
+  unsigned int bits;
+  memcpy(&bits, p, sizeof(bits));
+  if (swap)
+    bits = (bits >> 24) | ((bits >> 8) & 0xff00) | ((bits << 8) & 0xff0000) | (bits << 24);
+  float f;
+  memcpy(&f, &bits, sizeof(f));
+  return f;
+}
+
+#ifdef __SSE2__
+/* Same as load_float for four floats. */
+static inline __m128
+load_floats(const unsigned char* p, bool swap) {
+  __m128i v = _mm_loadu_si128((const __m128i*)p);
+  if (swap) {
+    v = _mm_shufflehi_epi16(_mm_shufflelo_epi16(v, _MM_SHUFFLE(2,3,0,1)), _MM_SHUFFLE(2,3,0,1));
+    v = _mm_or_si128(_mm_slli_epi16(v, 8), _mm_srli_epi16(v, 8));
   }
+  return _mm_castsi128_ps(v);
+}
+#endif
 
-  // Check the format
-  char format;
-  fgets(buffer, 80, fin);
-  if ( sscanf(buffer, "P%c", &format) != 1 || (format != 'f' && format != 'F') ) {
-    printf("Invalid PFM file\n");
-    fclose(fin);
+/* Copy n floats from src to dst, swapping their byte order if needed. */
+static void
+copy_floats(const unsigned char* src, int n, bool swap, float* dst) {
+  if (!swap) {
+    memcpy(dst, src, n * sizeof(float));
+    return;
+  }
+  int i = 0;
+#ifdef __SSE2__
+  for (; i + 4 <= n; i += 4)
+    _mm_storeu_ps(dst + i, load_floats(src + i*sizeof(float), true));
+#endif
+  for (; i < n; i++)
+    dst[i] = load_float(src + i*sizeof(float), true);
+}
+
+/* Expand n grayscale floats at src into gray pixels. */
+static void
+expand_gray(const unsigned char* src, int n, bool swap, STHDRImage::Pixel* dst) {
+  int i = 0;
+#ifdef __SSE2__
+  for (; i + 4 <= n; i += 4) {
+    __m128 g = load_floats(src + i*sizeof(float), swap);
+    store_rgb(&dst[i].r, g, g, g);
+  }
+#endif
+  for (; i < n; i++) {
+    float g = load_float(src + i*sizeof(float), swap);
+    dst[i] = STHDRImage::Pixel(g, g, g);
+  }
+}
+
+/* Load image data from file in PFM format. The file is memory mapped:
+ * color data in the host's byte order is used in place, anything else
+ * is byte swapped or expanded from grayscale in a single pass.
+ */
+STStatus
+STHDRImage::LoadPFM(const char* filename) {
+  // Map the whole file, or read it where mmap isn't available
+  const unsigned char* data;
+  size_t size;
+  void* mapping = NULL;
+  std::vector<unsigned char> contents;
+#ifndef _WIN32
+  int fd = open(filename, O_RDONLY);
+  if (fd < 0) {
+    printf("Error opening file: %s\n", filename);
     return ST_ERROR;
   }
-  // Get the dimensions
-  int w, h;
-  fgets(buffer, 80, fin);
-  if ( sscanf(buffer, "%i %i", &w, &h) != 2 || w <= 0 || h <= 0 ) {
+  struct stat st;
+  if (fstat(fd, &st) != 0 || st.st_size <= 0) {
     printf("Invalid PFM file\n");
-    fclose(fin);
+    close(fd);
+    return ST_ERROR;
+  }
+  size = (size_t)st.st_size;
+  // private, so that writes to pixels used in place don't reach the file
+  mapping = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+  close(fd);
+  if (mapping == MAP_FAILED) {
+    printf("Error mapping file: %s\n", filename);
     return ST_ERROR;
   }
-  // Get the scale factor, we just discard this
-  // FIXME endianness
-  float scale;
-  fgets(buffer, 80, fin);
-  if ( sscanf(buffer, "%f", &scale) != 1 ) {
+  data = (const unsigned char*)mapping;
+#else
+  if (!read_file(filename, contents))
+    return ST_ERROR;
+  data = &contents[0];
+  size = contents.size();
+#endif
+
+  // Parse the header, three lines: format, dimensions and scale
+  int w = 0, h = 0;
+  float scale = 0.f;
+  char format = 0;
+  size_t offset = 0;
+  for (int line = 0; line < 3; line++) {
+    const unsigned char* nl = (const unsigned char*)memchr(data + offset, '\n', STMin(size - offset, (size_t)80));
+    if (nl == NULL)
+      break;
+    std::string text((const char*)data + offset, nl - (data + offset));
+    offset = nl + 1 - data;
+    if ((line == 0 && sscanf(text.c_str(), "P%c", &format) != 1) ||
+        (line == 1 && sscanf(text.c_str(), "%i %i", &w, &h) != 2) ||
+        (line == 2 && sscanf(text.c_str(), "%f", &scale) != 1))
+      break;
+  }
+  int channels = (format == 'F') ? 3 : 1;
+  if ((format != 'f' && format != 'F') || w <= 0 || h <= 0 || scale == 0.f ||
+      (size - offset) / (channels * sizeof(float)) / w < (size_t)h) {
     printf("Invalid PFM file\n");
-    fclose(fin);
+#ifndef _WIN32
+    munmap(mapping, size);
+#endif
     return ST_ERROR;
   }
 
+  // A negative scale means little endian data, a positive one big endian
+  const unsigned int one = 1;
+  bool host_little = *(const unsigned char*)&one == 1;
+  bool swap = (scale < 0.f) != host_little;
+
   mWidth = w;
   mHeight = h;
-  mPixels = new STHDRImage::Pixel[w*h];
+  const unsigned char* src = data + offset;
 
-  // Now we can read the data
-  if (format == 'f') { // grayscale
-    float gval;
-    for(int j = 0; j < h; j++) {
-      for(int i = 0; i < w; i++) {
-        if ( fread(&gval, sizeof(float), 1, fin) != 1 ) {
-          printf("Invalid PFM file\n");
-          fclose(fin);
-          return ST_ERROR;
-        }
-        SetPixel(i,j, STHDRImage::Pixel(gval, gval, gval));
-      }
-    }
-  }
-  else { // if (format == 'F') color
-    if ( fread(mPixels, sizeof(STHDRImage::Pixel), w*h, fin) != w*h ) {
-      printf("Invalid PFM file\n");
-      fclose(fin);
-      return ST_ERROR;
-    }
+#ifndef _WIN32
+  // Color data in our byte order can be used where it is, as long as
+  // it is aligned (SavePFM pads its header for that)
+  if (channels == 3 && !swap && offset % sizeof(float) == 0) {
+    mPixels = (STHDRImage::Pixel*)src;
+    mMapping = mapping;
+    mMapSize = size;
+    return ST_OK;
   }
+#endif
 
-  fclose(fin);
+  // Otherwise swap and/or expand into our own pixels in one pass
+  mPixels = new STHDRImage::Pixel[(size_t)w*h];
+  size_t row_bytes = (size_t)w * channels * sizeof(float);
+  #pragma omp parallel for schedule(static)
+  for (int y = 0; y < h; y++) {
+    if (channels == 3)
+      copy_floats(src + y*row_bytes, 3*w, swap, &mPixels[(size_t)y * w].r);
+    else
+      expand_gray(src + y*row_bytes, w, swap, mPixels + (size_t)y * w);
+  }
 
+#ifndef _WIN32
+  munmap(mapping, size);
+#endif
   return ST_OK;
 }
 
@@ -138,12 +298,33 @@ STHDRImage::Save(const std::string& filename) const {
 
   if (ext.compare("PFM") == 0)
     return SavePFM(filename.c_str());
+  else if (ext.compare("HDR") == 0 || ext.compare("PIC") == 0)
+    return SaveRGBE(filename.c_str());
+  else if (ext.compare("PFH") == 0)
+    return SavePFH(filename.c_str());
   else {
     fprintf(stderr, "Unknown image file type.\n");
     return ST_ERROR;
   } 
 }
 
+/* Writes the header of a color PFM file in the host's byte order.
+ * The scale is padded ("-1", "-1.0", ...) so that the pixels start at
+ * a multiple of 4 bytes and LoadPFM can use them in place. Returns the
+ * offset of the pixels.
+ */
+long
+STHDRImage::WritePFMHeader(FILE* fout, int width, int height) {
+  // indexed by the number of bytes short of a multiple of 4
+  static const char* scales[4] = { "1.0\n", "1.00\n", "1\n", "1.0000\n" };
+  const unsigned int one = 1;
+  bool little = *(const unsigned char*)&one == 1;
+  char dims[64];
+  int len = sprintf(dims, "PF\n%i %i\n%s", width, height, little ? "-" : "");
+  fprintf(fout, "%s%s", dims, scales[-len & 3]);
+  return ftell(fout);
+}
+
 /* Writes image information in PFM format. */
 STStatus 
 STHDRImage::SavePFM(const char* filename) const {
@@ -152,12 +333,503 @@ STHDRImage::SavePFM(const char* filename) const {
     printf("Error opening file: %s\n", filename);
     return ST_ERROR;
   }
-  fprintf(fout, "PF\n");
-  fprintf(fout, "%i %i\n", mWidth, mHeight);
-  fprintf(fout, "-1\n"); // FIXME endianness
-  fwrite(mPixels, sizeof(STHDRImage::Pixel), mWidth*mHeight, fout);
+  WritePFMHeader(fout, mWidth, mHeight);
+  size_t count = (size_t)mWidth * mHeight;
+  if (fwrite(mPixels, sizeof(STHDRImage::Pixel), count, fout) != count) {
+    printf("Error writing file: %s\n", filename);
+    fclose(fout);
+    return ST_ERROR;
+  }
   fclose(fout);
 
   return ST_OK;
 }
 
+
+//
+// Radiance RGBE
+//
+// Each pixel is stored as three 8-bit mantissas sharing an 8-bit
+// exponent, 4 bytes instead of PFM's 12. Scanlines are usually run
+// length encoded one component at a time (the "new" RLE of Radiance),
+// which we read and write; flat and old-style RLE scanlines are read
+// as well.
+//
+
+/* Convert a scanline stored as separate r, g, b, e planes to floats. */
+static void
+rgbe_to_float(const unsigned char* planes, int width, STHDRImage::Pixel* dst) {
+  const unsigned char* r = planes;
+  const unsigned char* g = planes + width;
+  const unsigned char* b = planes + 2*width;
+  const unsigned char* e = planes + 3*width;
+  int x = 0;
+#ifdef __SSE2__
+  // scale = 2^(e - 128 - 8), built straight from the exponent bits;
+  // e == 0 means black and tiny exponents flush to zero
+  const __m128i zero = _mm_setzero_si128();
+  const __m128i bias = _mm_set1_epi32(9);
+  const __m128 half = _mm_set1_ps(.5f);
+  for (; x + 4 <= width; x += 4) {
+    int rv, gv, bv, ev;
+    memcpy(&rv, r + x, 4);
+    memcpy(&gv, g + x, 4);
+    memcpy(&bv, b + x, 4);
+    memcpy(&ev, e + x, 4);
+    __m128i ri = _mm_unpacklo_epi16(_mm_unpacklo_epi8(_mm_cvtsi32_si128(rv), zero), zero);
+    __m128i gi = _mm_unpacklo_epi16(_mm_unpacklo_epi8(_mm_cvtsi32_si128(gv), zero), zero);
+    __m128i bi = _mm_unpacklo_epi16(_mm_unpacklo_epi8(_mm_cvtsi32_si128(bv), zero), zero);
+    __m128i ei = _mm_unpacklo_epi16(_mm_unpacklo_epi8(_mm_cvtsi32_si128(ev), zero), zero);
+    __m128i exp = _mm_sub_epi32(ei, bias);
+    exp = _mm_and_si128(exp, _mm_cmpgt_epi32(exp, zero));
+    __m128 scale = _mm_castsi128_ps(_mm_slli_epi32(exp, 23));
+    store_rgb(&dst[x].r,
+              _mm_mul_ps(_mm_add_ps(_mm_cvtepi32_ps(ri), half), scale),
+              _mm_mul_ps(_mm_add_ps(_mm_cvtepi32_ps(gi), half), scale),
+              _mm_mul_ps(_mm_add_ps(_mm_cvtepi32_ps(bi), half), scale));
+  }
+#endif
+  for (; x < width; x++) {
+    if (e[x] > 9) {
+      float f = ldexpf(1.f, (int)e[x] - (128 + 8));
+      dst[x] = STHDRImage::Pixel((r[x] + .5f) * f, (g[x] + .5f) * f, (b[x] + .5f) * f);
+    }
+    else
+      dst[x] = STHDRImage::Pixel(0.f, 0.f, 0.f);
+  }
+}
+
+/* Decode one scanline starting at p into r, g, b, e planes. Returns
+ * the position after the scanline, or NULL if the data is corrupt.
+ */
+static const unsigned char*
+read_rgbe_scanline(const unsigned char* p, const unsigned char* end,
+                   int width, unsigned char* planes) {
+  if (end - p >= 4 && p[0] == 2 && p[1] == 2 && !(p[2] & 0x80) &&
+      width >= 8 && width < 0x8000) {
+    // new RLE: each component is coded separately
+    if (((p[2] << 8) | p[3]) != width)
+      return NULL;
+    p += 4;
+    for (int c = 0; c < 4; c++) {
+      unsigned char* dst = planes + c*width;
+      int x = 0;
+      while (x < width) {
+        if (p >= end)
+          return NULL;
+        int count = *p++;
+        if (count > 128) {
+          // a run of one value
+          count -= 128;
+          if (count > width - x || p >= end)
+            return NULL;
+          memset(dst + x, *p++, count);
+        }
+        else {
+          // count literal values
+          if (count == 0 || count > width - x || end - p < count)
+            return NULL;
+          memcpy(dst + x, p, count);
+          p += count;
+        }
+        x += count;
+      }
+    }
+    return p;
+  }
+
+  // flat pixels, where (1,1,1,n) repeats the previous pixel n << shift times
+  int shift = 0;
+  for (int x = 0; x < width; ) {
+    if (end - p < 4)
+      return NULL;
+    if (p[0] == 1 && p[1] == 1 && p[2] == 1) {
+      int count = p[3] << shift;
+      if (x == 0 || count > width - x)
+        return NULL;
+      for (int c = 0; c < 4; c++)
+        memset(planes + c*width + x, planes[c*width + x - 1], count);
+      x += count;
+      shift += 8;
+    }
+    else {
+      for (int c = 0; c < 4; c++)
+        planes[c*width + x] = p[c];
+      x++;
+      shift = 0;
+    }
+    p += 4;
+  }
+  return p;
+}
+
+/* Load image data from a Radiance RGBE file. */
+STStatus
+STHDRImage::LoadRGBE(const char* filename) {
+  std::vector<unsigned char> data;
+  if (!read_file(filename, data))
+    return ST_ERROR;
+  const unsigned char* p = &data[0];
+  const unsigned char* end = p + data.size();
+
+  // header: "#?" magic, variable lines, a blank line, then the resolution
+  std::string line;
+  bool magic = false, rgbe = true;
+  while (true) {
+    const unsigned char* nl = (const unsigned char*)memchr(p, '\n', end - p);
+    if (nl == NULL) {
+      printf("Invalid HDR file\n");
+      return ST_ERROR;
+    }
+    line.assign((const char*)p, nl - p);
+    p = nl + 1;
+    if (!magic) {
+      magic = (line.compare(0, 2, "#?") == 0);
+      if (!magic) {
+        printf("Invalid HDR file\n");
+        return ST_ERROR;
+      }
+    }
+    else if (line.empty())
+      break;
+    else if (line.compare(0, 7, "FORMAT=") == 0)
+      rgbe = (line == "FORMAT=32-bit_rle_rgbe");
+  }
+  if (!rgbe) {
+    printf("Unsupported HDR format, only RGBE is read\n");
+    return ST_ERROR;
+  }
+
+  const unsigned char* nl = (const unsigned char*)memchr(p, '\n', end - p);
+  char ysign, xsign;
+  int w, h;
+  if (nl == NULL) {
+    printf("Invalid HDR file\n");
+    return ST_ERROR;
+  }
+  line.assign((const char*)p, nl - p);
+  p = nl + 1;
+  if (sscanf(line.c_str(), "%cY %d %cX %d", &ysign, &h, &xsign, &w) != 4 ||
+      (ysign != '-' && ysign != '+') || xsign != '+' || w <= 0 || h <= 0) {
+    printf("Unsupported HDR resolution line: %s\n", line.c_str());
+    return ST_ERROR;
+  }
+
+  mWidth = w;
+  mHeight = h;
+  mPixels = new STHDRImage::Pixel[w*h];
+
+  // -Y stores the top row first, our row 0 is the bottom
+  std::vector<unsigned char> planes(4*w);
+  for (int i = 0; i < h; i++) {
+    p = read_rgbe_scanline(p, end, w, &planes[0]);
+    if (p == NULL) {
+      printf("Invalid HDR file\n");
+      return ST_ERROR;
+    }
+    int y = (ysign == '-') ? h - 1 - i : i;
+    rgbe_to_float(&planes[0], w, mPixels + (size_t)y * w);
+  }
+
+  return ST_OK;
+}
+
+/* Run length encode one component of a scanline: runs of at least 4
+ * equal bytes become (128 + n, value), everything else is copied as
+ * literal blocks of up to 128 bytes.
+ */
+static void
+write_rle(const unsigned char* src, int width, std::vector<unsigned char>& out) {
+  const int MIN_RUN = 4;
+  int x = 0;
+  while (x < width) {
+    // find the next run long enough to be worth coding
+    int run_start = x, run = 0;
+    while (run_start < width) {
+      run = 1;
+      while (run < 127 && run_start + run < width && src[run_start + run] == src[run_start])
+        run++;
+      if (run >= MIN_RUN)
+        break;
+      run_start += run;
+      run = 0;
+    }
+    // literals up to the run
+    while (x < run_start) {
+      int n = STMin(128, run_start - x);
+      out.push_back((unsigned char)n);
+      out.insert(out.end(), src + x, src + x + n);
+      x += n;
+    }
+    if (run >= MIN_RUN) {
+      out.push_back((unsigned char)(128 + run));
+      out.push_back(src[run_start]);
+      x = run_start + run;
+    }
+  }
+}
+
+/* Writes image information in Radiance RGBE format. */
+STStatus
+STHDRImage::SaveRGBE(const char* filename) const {
+  FILE* fout = fopen(filename, "wb");
+  if (fout == NULL) {
+    printf("Error opening file: %s\n", filename);
+    return ST_ERROR;
+  }
+  fprintf(fout, "#?RADIANCE\n");
+  fprintf(fout, "FORMAT=32-bit_rle_rgbe\n\n");
+  fprintf(fout, "-Y %i +X %i\n", mHeight, mWidth);
+
+  bool rle = mWidth >= 8 && mWidth < 0x8000;
+  std::vector<unsigned char> planes(4*mWidth);
+  std::vector<unsigned char> out;
+  for (int i = 0; i < mHeight; i++) {
+    const Pixel* row = mPixels + (size_t)(mHeight - 1 - i) * mWidth;
+    for (int x = 0; x < mWidth; x++) {
+      float v = STMax(row[x].r, STMax(row[x].g, row[x].b));
+      unsigned char rgbe[4] = { 0, 0, 0, 0 };
+      if (v > 1e-32f) {
+        int e;
+        float m = frexpf(v, &e) * 256.f / v;
+        rgbe[0] = (unsigned char)STMax(row[x].r * m, 0.f);
+        rgbe[1] = (unsigned char)STMax(row[x].g * m, 0.f);
+        rgbe[2] = (unsigned char)STMax(row[x].b * m, 0.f);
+        rgbe[3] = (unsigned char)(e + 128);
+      }
+      for (int c = 0; c < 4; c++)
+        planes[c*mWidth + x] = rgbe[c];
+    }
+
+    out.clear();
+    if (rle) {
+      out.push_back(2);
+      out.push_back(2);
+      out.push_back((unsigned char)(mWidth >> 8));
+      out.push_back((unsigned char)(mWidth & 0xff));
+      for (int c = 0; c < 4; c++)
+        write_rle(&planes[c*mWidth], mWidth, out);
+    }
+    else {
+      for (int x = 0; x < mWidth; x++)
+        for (int c = 0; c < 4; c++)
+          out.push_back(planes[c*mWidth + x]);
+    }
+    if (fwrite(&out[0], 1, out.size(), fout) != out.size()) {
+      printf("Error writing file: %s\n", filename);
+      fclose(fout);
+      return ST_ERROR;
+    }
+  }
+  fclose(fout);
+
+  return ST_OK;
+}
+
+//
+// PFH: planar half floats
+//
+// A PFM-like header ("PH", width and height, -1 for little endian
+// data and 1 for big endian) followed by the red, green and blue
+// planes as IEEE 754 half floats, bottom row first. 6 bytes per pixel, with about 3 significant
+// digits over a range of 6e-8 to 65504.
+//
+
+/* Convert n half floats to floats. */
+static void
+half_to_float(const unsigned short* src, int n, float* dst) {
+  int i = 0;
+#if defined(__F16C__)
+  for (; i + 8 <= n; i += 8)
+    _mm256_storeu_ps(dst + i, _mm256_cvtph_ps(_mm_loadu_si128((const __m128i*)(src + i))));
+#elif defined(__SSE2__)
+  // move the exponent and mantissa into place and rebias; denormals
+  // are renormalized by a float subtraction, infinities and NaNs get
+  // the maximum exponent
+  const __m128i zero = _mm_setzero_si128();
+  const __m128i expmant_mask = _mm_set1_epi32(0x7fff);
+  const __m128i exp_mask = _mm_set1_epi32(0x7c00 << 13);
+  const __m128i rebias = _mm_set1_epi32((127 - 15) << 23);
+  const __m128i inf_rebias = _mm_set1_epi32((128 - 16) << 23);
+  const __m128i one_exp = _mm_set1_epi32(1 << 23);
+  const __m128 magic = _mm_castsi128_ps(_mm_set1_epi32(113 << 23));
+  for (; i + 8 <= n; i += 8) {
+    __m128i h8 = _mm_loadu_si128((const __m128i*)(src + i));
+    __m128i hs[2] = { _mm_unpacklo_epi16(h8, zero), _mm_unpackhi_epi16(h8, zero) };
+    for (int k = 0; k < 2; k++) {
+      __m128i h = hs[k];
+      __m128i expmant = _mm_and_si128(h, expmant_mask);
+      __m128i sign = _mm_slli_epi32(_mm_xor_si128(h, expmant), 16);
+      __m128i o = _mm_slli_epi32(expmant, 13);
+      __m128i exp = _mm_and_si128(o, exp_mask);
+      o = _mm_add_epi32(o, rebias);
+      o = _mm_add_epi32(o, _mm_and_si128(_mm_cmpeq_epi32(exp, exp_mask), inf_rebias));
+      __m128i denorm = _mm_cmpeq_epi32(exp, zero);
+      __m128i d = _mm_castps_si128(_mm_sub_ps(_mm_castsi128_ps(_mm_add_epi32(o, one_exp)), magic));
+      o = _mm_or_si128(_mm_and_si128(denorm, d), _mm_andnot_si128(denorm, o));
+      _mm_storeu_ps(dst + i + 4*k, _mm_castsi128_ps(_mm_or_si128(o, sign)));
+    }
+  }
+#endif
+  for (; i < n; i++) {
+    unsigned int h = src[i];
+    unsigned int o = (h & 0x7fff) << 13;
+    unsigned int exp = o & (0x7c00 << 13);
+    o += (127 - 15) << 23;
+    float f;
+    if (exp == (0x7c00u << 13))
+      o += (128 - 16) << 23;
+    else if (exp == 0) {
+      o += 1 << 23;
+      memcpy(&f, &o, sizeof(f));
+      f -= 6.10351562e-05f;   // 2^-14, i.e. the float with bits 113 << 23
+      memcpy(&o, &f, sizeof(o));
+    }
+    o |= (h & 0x8000) << 16;
+    memcpy(&dst[i], &o, sizeof(float));
+  }
+}
+
+/* Convert a float to a half float, rounding to nearest even. Values
+ * too large for a half become infinity.
+ */
+static unsigned short
+float_to_half(float f) {
+  unsigned int bits;
+  memcpy(&bits, &f, sizeof(bits));
+  unsigned int sign = (bits >> 16) & 0x8000;
+  bits &= 0x7fffffff;
+
+  unsigned int h;
+  if (bits >= 0x47800000) {
+    // too large, or inf/NaN
+    h = (bits > 0x7f800000) ? 0x7e00 : 0x7c00;
+  }
+  else if (bits < 0x38800000) {
+    // denormal half: let the float adder do the rounding
+    float v;
+    memcpy(&v, &bits, sizeof(v));
+    v += .5f;
+    memcpy(&h, &v, sizeof(h));
+    h -= 0x3f000000;
+  }
+  else {
+    unsigned int odd = (bits >> 13) & 1;
+    bits += ((unsigned int)(15 - 127) << 23) + 0xfff + odd;
+    h = bits >> 13;
+  }
+  return (unsigned short)(h | sign);
+}
+
+/* Load image data from a planar half float file. */
+STStatus
+STHDRImage::LoadPFH(const char* filename) {
+  FILE* fin = fopen(filename, "rb");
+  char buffer[128];
+  if (fin == NULL) {
+    printf("Error opening file: %s\n", filename);
+    return ST_ERROR;
+  }
+
+  int w, h;
+  float endian;
+  if (fgets(buffer, 80, fin) == NULL || strncmp(buffer, "PH", 2) != 0 ||
+      fgets(buffer, 80, fin) == NULL || sscanf(buffer, "%i %i", &w, &h) != 2 ||
+      w <= 0 || h <= 0 ||
+      fgets(buffer, 80, fin) == NULL || sscanf(buffer, "%f", &endian) != 1 ||
+      endian == 0.f) {
+    printf("Invalid PFH file\n");
+    fclose(fin);
+    return ST_ERROR;
+  }
+
+  // check that the file holds the planes before allocating them
+  long header = ftell(fin);
+  fseek(fin, 0, SEEK_END);
+  long end = ftell(fin);
+  fseek(fin, header, SEEK_SET);
+  if (header < 0 || end < header ||
+      (size_t)(end - header) / (3 * sizeof(unsigned short)) / w < (size_t)h) {
+    printf("Invalid PFH file\n");
+    fclose(fin);
+    return ST_ERROR;
+  }
+
+  // read the planes, then convert a row of all three at a time
+  size_t n = (size_t)w * h;
+  std::vector<unsigned short> half(3*n);
+  if (fread(&half[0], sizeof(unsigned short), 3*n, fin) != 3*n) {
+    printf("Invalid PFH file\n");
+    fclose(fin);
+    return ST_ERROR;
+  }
+  fclose(fin);
+
+  // a negative endian means little endian data, a positive one big
+  // endian, as in PFM
+  const unsigned int one = 1;
+  bool host_little = *(const unsigned char*)&one == 1;
+  if ((endian < 0.f) != host_little) {
+    for (size_t i = 0; i < 3*n; i++)
+      half[i] = (unsigned short)((half[i] >> 8) | (half[i] << 8));
+  }
+
+  mWidth = w;
+  mHeight = h;
+  mPixels = new STHDRImage::Pixel[n];
+
+  std::vector<float> rows(3*w);
+  float* r = &rows[0];
+  float* g = r + w;
+  float* b = g + w;
+  for (int y = 0; y < h; y++) {
+    size_t offset = (size_t)y * w;
+    half_to_float(&half[offset], w, r);
+    half_to_float(&half[n + offset], w, g);
+    half_to_float(&half[2*n + offset], w, b);
+    STHDRImage::Pixel* dst = mPixels + offset;
+    int x = 0;
+#ifdef __SSE2__
+    for (; x + 4 <= w; x += 4)
+      store_rgb(&dst[x].r, _mm_loadu_ps(r + x), _mm_loadu_ps(g + x), _mm_loadu_ps(b + x));
+#endif
+    for (; x < w; x++)
+      dst[x] = STHDRImage::Pixel(r[x], g[x], b[x]);
+  }
+
+  return ST_OK;
+}
+
+/* Writes image information as planar half floats. */
+STStatus
+STHDRImage::SavePFH(const char* filename) const {
+  FILE* fout = fopen(filename, "wb");
+  if (fout == NULL) {
+    printf("Error opening file: %s\n", filename);
+    return ST_ERROR;
+  }
+  // the halves are written in the host's byte order, which the
+  // header records as PFM does
+  const unsigned int one = 1;
+  bool little = *(const unsigned char*)&one == 1;
+  fprintf(fout, "PH\n");
+  fprintf(fout, "%i %i\n", mWidth, mHeight);
+  fprintf(fout, "%s1\n", little ? "-" : "");
+
+  std::vector<unsigned short> half(mWidth);
+  for (int c = 0; c < 3; c++) {
+    const float* src = &mPixels[0].r + c;
+    for (int y = 0; y < mHeight; y++) {
+      for (int x = 0; x < mWidth; x++)
+        half[x] = float_to_half(src[3*((size_t)y * mWidth + x)]);
+      if (fwrite(&half[0], sizeof(unsigned short), mWidth, fout) != (size_t)mWidth) {
+        printf("Error writing file: %s\n", filename);
+        fclose(fout);
+        return ST_ERROR;
+      }
+    }
+  }
+  fclose(fout);
+
+  return ST_OK;
+}
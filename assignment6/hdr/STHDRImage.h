@@ -11,7 +11,8 @@
 /**
  * This class is similar to the STHDRImage class except that pixels
  * are represented as floats rather than unsigned chars.
- * Also, it it only loads from and saves as PFM files.
+ * Also, it only loads from and saves as HDR formats: PFM, Radiance
+ * RGBE (.hdr/.pic) and planar half floats (.pfh).
 */
 
 class STHDRImage
@@ -43,14 +44,22 @@ public:
 
     Pixel* GetPixels() { return mPixels; }
 
+    static long WritePFMHeader(FILE* fout, int width, int height);
+
 private:
     int mHeight;
     int mWidth;
 
     Pixel* mPixels;
+    void* mMapping;   // file mapping holding mPixels, if loaded in place
+    size_t mMapSize;
 
 	  STStatus LoadPFM(const char* filename);
 	  STStatus SavePFM(const char* filename) const;
+	  STStatus LoadRGBE(const char* filename);
+	  STStatus SaveRGBE(const char* filename) const;
+	  STStatus LoadPFH(const char* filename);
+	  STStatus SavePFH(const char* filename) const;
 };
 
 #endif // __STHDRIMAGE_H__
@@ -0,0 +1,287 @@
+#include "align.h"
+#include "scanline.h"
+#include "stdio.h"
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+// pixels within this many gray levels of the median are ignored
+#define ALIGN_NOISE 4
+// the coarsest level keeps at least this many pixels on its short side
+#define ALIGN_MIN_SIZE 16
+// rows decoded at a time while loading a photo
+#define ALIGN_BAND_ROWS 64
+
+typedef unsigned long long Word;
+
+/* Bitmap - one bit per pixel, pixel x of a row is bit x%64 of word
+ * x/64. Rows are padded to whole words with zeros.
+ */
+struct Bitmap {
+	int width, height, words;
+	vector<Word> bits;
+
+	void Init(int w, int h) {
+		width = w;
+		height = h;
+		words = (w + 63) / 64;
+		bits.assign((size_t)words * h, 0);
+	}
+	Word* Row(int y) { return &bits[(size_t)y * words]; }
+	const Word* Row(int y) const { return &bits[(size_t)y * words]; }
+};
+
+/* One level of the pyramid: the threshold bitmap, and the exclusion
+ * bitmap which is set where a pixel is far enough from the median to
+ * count.
+ */
+struct MTBLevel {
+	Bitmap threshold;
+	Bitmap exclusion;
+};
+
+static inline int
+popcount64(Word x) {
+#if defined(__GNUC__) && defined(__POPCNT__)
+	return __builtin_popcountll(x);
+#else
+	x = x - ((x >> 1) & 0x5555555555555555ULL);
+	x = (x & 0x3333333333333333ULL) + ((x >> 2) & 0x3333333333333333ULL);
+	x = (x + (x >> 4)) & 0x0f0f0f0f0f0f0f0fULL;
+	return (int)((x * 0x0101010101010101ULL) >> 56);
+#endif
+}
+
+/* Word i of a row moved left by s pixels, i.e. bit b is pixel
+ * 64*i + b + s of the row. Pixels outside the row are 0.
+ */
+static inline Word
+shifted_word(const Word* row, int words, int i, int s) {
+	int p = 64*i + s;
+	int r = p & 63;
+	int q = (p - r) / 64;
+	Word lo = (q >= 0 && q < words) ? row[q] : 0;
+	if (r == 0)
+		return lo;
+	Word hi = (q + 1 >= 0 && q + 1 < words) ? row[q + 1] : 0;
+	return (lo >> r) | (hi << (64 - r));
+}
+
+/* Number of pixels that differ between ref and img moved by (dx, dy),
+ * counting only pixels that are not excluded in either.
+ */
+static long
+bitmap_error(const MTBLevel& ref, const MTBLevel& img, int dx, int dy) {
+	int words = ref.threshold.words;
+	int height = ref.threshold.height;
+	long error = 0;
+	for (int y = STMax(0, -dy); y < STMin(height, height - dy); y++) {
+		const Word* t0 = ref.threshold.Row(y);
+		const Word* e0 = ref.exclusion.Row(y);
+		const Word* t1 = img.threshold.Row(y + dy);
+		const Word* e1 = img.exclusion.Row(y + dy);
+		if (dx == 0) {
+			for (int i = 0; i < words; i++)
+				error += popcount64((t0[i] ^ t1[i]) & e0[i] & e1[i]);
+		}
+		else {
+			for (int i = 0; i < words; i++) {
+				Word diff = t0[i] ^ shifted_word(t1, words, i, dx);
+				error += popcount64(diff & e0[i] & shifted_word(e1, words, i, dx));
+			}
+		}
+	}
+	return error;
+}
+
+/* Threshold a row of gray values at median into packed bits. */
+static void
+threshold_row(const unsigned char* gray, int width, int median,
+              Word* threshold, Word* exclusion) {
+	int x = 0;
+#ifdef __SSE2__
+	// unsigned compares via the sign bit, and |g - m| with saturation
+	const __m128i sign = _mm_set1_epi8((char)0x80);
+	const __m128i m = _mm_set1_epi8((char)median);
+	const __m128i ms = _mm_xor_si128(m, sign);
+	const __m128i noise = _mm_set1_epi8(ALIGN_NOISE);
+	const __m128i zero = _mm_setzero_si128();
+	for (; x + 64 <= width; x += 64) {
+		Word t = 0, e = 0;
+		for (int k = 0; k < 4; k++) {
+			__m128i g = _mm_loadu_si128((const __m128i*)(gray + x + 16*k));
+			__m128i above = _mm_cmpgt_epi8(_mm_xor_si128(g, sign), ms);
+			__m128i dist = _mm_or_si128(_mm_subs_epu8(g, m), _mm_subs_epu8(m, g));
+			__m128i near = _mm_cmpeq_epi8(_mm_subs_epu8(dist, noise), zero);
+			t |= (Word)(unsigned)_mm_movemask_epi8(above) << (16*k);
+			e |= (Word)(~(unsigned)_mm_movemask_epi8(near) & 0xffff) << (16*k);
+		}
+		threshold[x / 64] = t;
+		exclusion[x / 64] = e;
+	}
+#endif
+	for (; x < width; x++) {
+		int g = gray[x];
+		Word bit = (Word)1 << (x & 63);
+		if (g > median)
+			threshold[x / 64] |= bit;
+		if (g > median + ALIGN_NOISE || g < median - ALIGN_NOISE)
+			exclusion[x / 64] |= bit;
+	}
+}
+
+/* Build the bitmap pyramid of a gray image, halving it in place for
+ * every level after the first.
+ */
+static void
+build_levels(vector<unsigned char>& gray, int width, int height,
+             int nlevels, vector<MTBLevel>& levels) {
+	levels.resize(nlevels);
+	for (int l = 0; l < nlevels; l++) {
+		if (l > 0) {
+			// average 2x2 blocks
+			int w = width / 2, h = height / 2;
+			for (int y = 0; y < h; y++) {
+				const unsigned char* r0 = &gray[(size_t)(2*y) * width];
+				const unsigned char* r1 = r0 + width;
+				unsigned char* dst = &gray[(size_t)y * w];
+				for (int x = 0; x < w; x++)
+					dst[x] = (unsigned char)((r0[2*x] + r0[2*x+1] + r1[2*x] + r1[2*x+1] + 2) >> 2);
+			}
+			width = w;
+			height = h;
+		}
+
+		// the median from a histogram
+		size_t histogram[256] = { 0 };
+		size_t npixels = (size_t)width * height;
+		for (size_t i = 0; i < npixels; i++)
+			histogram[gray[i]]++;
+		int median = 0;
+		for (size_t count = 0; median < 255; median++) {
+			count += histogram[median];
+			if (2*count >= npixels)
+				break;
+		}
+
+		MTBLevel& level = levels[l];
+		level.threshold.Init(width, height);
+		level.exclusion.Init(width, height);
+		for (int y = 0; y < height; y++)
+			threshold_row(&gray[(size_t)y * width], width, median,
+			              level.threshold.Row(y), level.exclusion.Row(y));
+	}
+}
+
+/* Load a photo as gray values, rows from the top. */
+static int
+load_gray(const string& fname, vector<unsigned char>& gray, int& width, int& height) {
+	ScanlineReader reader;
+	if (reader.Open(fname) != ST_OK)
+		return ST_ERROR;
+	width = reader.GetWidth();
+	height = reader.GetHeight();
+	gray.resize((size_t)width * height);
+
+	vector<STColor4ub> band((size_t)ALIGN_BAND_ROWS * width);
+	for (int top = 0; top < height; top += ALIGN_BAND_ROWS) {
+		int nrows = STMin(ALIGN_BAND_ROWS, height - top);
+		if (reader.ReadRows(&band[0], nrows) != ST_OK)
+			return ST_ERROR;
+		unsigned char* dst = &gray[(size_t)top * width];
+		size_t n = (size_t)nrows * width;
+		// the weights Ward uses, (54 r + 183 g + 19 b) / 256
+		for (size_t i = 0; i < n; i++)
+			dst[i] = (unsigned char)((54*band[i].r + 183*band[i].g + 19*band[i].b) >> 8);
+	}
+	return ST_OK;
+}
+
+int
+AlignStack(vector<Photo>& photos, int shift_bits) {
+	int i, j, k;
+	int nimages = (int)photos.size();
+	for (k = 0; k < nimages; k++)
+		photos[k].dx = photos[k].dy = 0;
+	if (nimages < 2 || shift_bits < 1)
+		return ST_OK;
+
+	// align to the middle exposure, as the response samples are taken there
+	vector<int> order(nimages);
+	for (i = 0; i < nimages; i++)
+		order[i] = i;
+	for (i = 1; i < nimages; i++)
+		for (j = i; j > 0 && photos[order[j]].shutter < photos[order[j-1]].shutter; j--)
+			swap(order[j], order[j-1]);
+	int reference = order[nimages/2];
+
+	// the size of the first photo decides the number of levels
+	int width, height;
+	{
+		ScanlineReader reader;
+		if (reader.Open(photos[0].filename) != ST_OK)
+			return ST_ERROR;
+		width = reader.GetWidth();
+		height = reader.GetHeight();
+	}
+	int nlevels = shift_bits;
+	while (nlevels > 1 && (STMin(width, height) >> (nlevels - 1)) < ALIGN_MIN_SIZE)
+		nlevels--;
+
+	// the gray image of each photo only lives while its pyramid is built
+	vector< vector<MTBLevel> > pyramids(nimages);
+	int status = ST_OK;
+	#pragma omp parallel for schedule(dynamic)
+	for (k = 0; k < nimages; k++) {
+		vector<unsigned char> gray;
+		int w, h;
+		if (load_gray(photos[k].filename, gray, w, h) != ST_OK || w != width || h != height) {
+			#pragma omp critical
+			{
+				printf("Can't align %s\n", photos[k].filename.c_str());
+				status = ST_ERROR;
+			}
+			continue;
+		}
+		build_levels(gray, w, h, nlevels, pyramids[k]);
+	}
+	if (status != ST_OK)
+		return ST_ERROR;
+
+	// coarse to fine, doubling the offset at every level
+	#pragma omp parallel for schedule(dynamic)
+	for (k = 0; k < nimages; k++) {
+		if (k == reference)
+			continue;
+		int dx = 0, dy = 0;
+		for (int l = nlevels - 1; l >= 0; l--) {
+			const MTBLevel& ref = pyramids[reference][l];
+			const MTBLevel& img = pyramids[k][l];
+			dx *= 2;
+			dy *= 2;
+			long best = bitmap_error(ref, img, dx, dy);
+			int best_x = dx, best_y = dy;
+			for (int y = -1; y <= 1; y++) {
+				for (int x = -1; x <= 1; x++) {
+					if (x == 0 && y == 0)
+						continue;
+					long error = bitmap_error(ref, img, dx + x, dy + y);
+					if (error < best) {
+						best = error;
+						best_x = dx + x;
+						best_y = dy + y;
+					}
+				}
+			}
+			dx = best_x;
+			dy = best_y;
+		}
+		photos[k].dx = dx;
+		photos[k].dy = dy;
+	}
+
+	for (k = 0; k < nimages; k++)
+		printf("%s: offset %i, %i\n", photos[k].filename.c_str(), photos[k].dx, photos[k].dy);
+	return ST_OK;
+}
@@ -0,0 +1,29 @@
+#ifndef __ALIGN_H__
+#define __ALIGN_H__
+
+#include "response.h"
+
+/* Number of pyramid levels searched, the largest offset found is
+ * +-(2^ALIGN_SHIFT_BITS - 1) pixels in x and y.
+ */
+#define ALIGN_SHIFT_BITS 6
+
+/* Find the translation of every photo in a hand-held stack relative to
+ * the middle exposure, using median threshold bitmaps (Ward, "Fast,
+ * Robust Image Registration for Compositing High Dynamic Range
+ * Photographs from Hand-Held Exposures", 2003).
+ *
+ * Each photo is thresholded at its median gray value, which gives
+ * nearly the same bitmap at every exposure, and pixels close to the
+ * median are excluded as noise. The offset is refined from the coarsest
+ * level of a pyramid of these bitmaps to the finest, trying the 9
+ * neighbours of the doubled offset at every level. Bitmaps are packed
+ * 64 pixels to a word, so comparing a shift is XOR, AND and popcount.
+ * The photos are loaded and searched in parallel.
+ *
+ * Sets dx and dy of every photo: pixel (x, y) of the middle exposure,
+ * counted from the top left, is pixel (x + dx, y + dy) of the photo.
+ */
+int AlignStack(vector<Photo>& photos, int shift_bits = ALIGN_SHIFT_BITS);
+
+#endif //__ALIGN_H__
@@ -0,0 +1,242 @@
+#include "batch.h"
+#include "align.h"
+#include "merge.h"
+#include "scanline.h"
+#include "tonemap.h"
+#include "stdio.h"
+#include "stdlib.h"
+#include "string.h"
+#include "math.h"
+#include <stdexcept>
+
+#ifdef _OPENMP
+#include <omp.h>
+#endif
+
+/* One line of the manifest. */
+typedef struct {
+	string stack;
+	string response;
+	string output;
+	float key;
+	bool local;
+	bool align;
+	float shutter;      // > 0 for a virtual photo
+	vector<Photo> photos;
+	double memory;      // estimated peak memory in bytes
+} BatchJob;
+
+/* Parse a number, or a fraction like 1/8. */
+static bool
+parse_value(const char* text, float& value) {
+	float num, den;
+	char extra;
+	if (sscanf(text, "%f/%f%c", &num, &den, &extra) == 2 && den != 0.f) {
+		value = num / den;
+		return true;
+	}
+	return sscanf(text, "%f%c", &value, &extra) == 1;
+}
+
+static int
+load_manifest(const char* fname, vector<BatchJob>& jobs) {
+	FILE* fin = fopen(fname, "r");
+	if (fin == NULL) {
+		printf("Error reading manifest %s\n", fname);
+		return ST_ERROR;
+	}
+
+	char line[4096];
+	int lineno = 0;
+	int status = ST_OK;
+	while (fgets(line, sizeof(line), fin) != NULL) {
+		lineno++;
+		vector<char*> words;
+		for (char* word = strtok(line, " \t\r\n"); word != NULL; word = strtok(NULL, " \t\r\n"))
+			words.push_back(word);
+		if (words.empty() || words[0][0] == '#')
+			continue;
+		if (words.size() < 3) {
+			printf("%s:%i: expected photos.list response.cr output\n", fname, lineno);
+			status = ST_ERROR;
+			continue;
+		}
+
+		BatchJob job;
+		job.stack = words[0];
+		job.response = words[1];
+		job.output = words[2];
+		job.key = .45f;
+		job.local = false;
+		job.align = true;
+		job.shutter = 0.f;
+		job.memory = 0.;
+		for (size_t i = 3; i < words.size(); i++) {
+			bool ok = true;
+			if (strcmp(words[i], "local") == 0)
+				job.local = true;
+			else if (strcmp(words[i], "noalign") == 0)
+				job.align = false;
+			else if (strncmp(words[i], "key=", 4) == 0)
+				ok = parse_value(words[i] + 4, job.key) && job.key > 0.f;
+			else if (strncmp(words[i], "shutter=", 8) == 0)
+				ok = parse_value(words[i] + 8, job.shutter) && job.shutter > 0.f;
+			else
+				ok = false;
+			if (!ok) {
+				printf("%s:%i: bad option %s\n", fname, lineno, words[i]);
+				status = ST_ERROR;
+			}
+		}
+		jobs.push_back(job);
+	}
+
+	fclose(fin);
+	return status;
+}
+
+static bool
+is_hdr_format(const string& ext) {
+	return ext == "PFM" || ext == "HDR" || ext == "PIC" || ext == "PFH";
+}
+
+/* Rough peak memory of a job: the bitmap pyramids and one gray image
+ * while aligning, then the merge bands plus whatever the output needs
+ * in full (the HDR image, the 8-bit result and the local operator's
+ * planes).
+ */
+static int
+estimate_memory(BatchJob& job) {
+	if (LoadHDRStack(job.stack.c_str(), job.photos) != ST_OK || job.photos.empty()) {
+		printf("%s: no photos\n", job.stack.c_str());
+		return ST_ERROR;
+	}
+	// relative photo names are relative to the list
+	string dir = job.stack.substr(0, job.stack.find_last_of("/\\") + 1);
+	for (size_t i = 0; i < job.photos.size(); i++) {
+		string& name = job.photos[i].filename;
+		if (name[0] != '/' && name[0] != '\\' && name.find(':') == string::npos)
+			name = dir + name;
+	}
+	ScanlineReader reader;
+	if (reader.Open(job.photos[0].filename) != ST_OK)
+		return ST_ERROR;
+	double pixels = (double)reader.GetWidth() * reader.GetHeight();
+	double nimages = (double)job.photos.size();
+
+	double align = pixels * (1. + nimages / 3.);
+	double merge = nimages * MERGE_BAND_ROWS * reader.GetWidth() * (sizeof(STColor4ub) + sizeof(STColor3f));
+	string ext = STGetExtension(job.output);
+	if (ext != "PFM")
+		merge += pixels * sizeof(STColor3f);
+	if (!is_hdr_format(ext)) {
+		merge += pixels * sizeof(STColor4ub);
+		if (job.local && job.shutter == 0.f)
+			merge += pixels * 3. * sizeof(float);
+	}
+	job.memory = STMax(align, merge);
+	return ST_OK;
+}
+
+static int
+run_job(BatchJob& job) {
+	vector<Photo>& photos = job.photos;
+	if (job.align && AlignStack(photos) != ST_OK)
+		return ST_ERROR;
+
+	CameraResponse response;
+	if (job.response == "-") {
+		if (response.SolveForResponse(photos, RESPONSE_LAMBDA, RESPONSE_SAMPLES) != ST_OK)
+			return ST_ERROR;
+	}
+	else if (response.Load((char*)job.response.c_str()) != ST_OK)
+		return ST_ERROR;
+
+	string ext = STGetExtension(job.output);
+	if (ext == "PFM")
+		return MergeHDRToPFM(photos, response, job.output.c_str());
+
+	STHDRImage* hdr = MergeHDR(photos, response);
+	if (hdr == NULL)
+		return ST_ERROR;
+	int status;
+	if (is_hdr_format(ext))
+		status = hdr->Save(job.output);
+	else {
+		int width = hdr->GetWidth();
+		int height = hdr->GetHeight();
+		STImage result(width, height);
+		if (job.shutter > 0.f) {
+			#pragma omp parallel for schedule(static)
+			for (int y = 0; y < height; y++)
+				response.GetResponses(hdr->GetPixels() + y*width, width, job.shutter,
+				                      result.GetPixels() + y*width);
+		}
+		else {
+			ToneMapper mapper(hdr);
+			if (job.local)
+				mapper.Local(job.key, &result);
+			else
+				mapper.Global(job.key, &result);
+		}
+		status = result.Save(job.output);
+	}
+	delete hdr;
+	return status;
+}
+
+int
+RunBatch(const char* manifest, int jobs, int memory_mb) {
+	vector<BatchJob> batch;
+	if (load_manifest(manifest, batch) != ST_OK)
+		return ST_ERROR;
+	int njobs = (int)batch.size();
+
+	vector<int> status(njobs, ST_OK);
+	double largest = 0.;
+	for (int i = 0; i < njobs; i++) {
+		status[i] = estimate_memory(batch[i]);
+		largest = STMax(largest, batch[i].memory);
+	}
+
+	// as many stacks at a time as there are threads and memory for
+	if (jobs <= 0) {
+#ifdef _OPENMP
+		jobs = omp_get_max_threads();
+#else
+		jobs = 1;
+#endif
+	}
+	double budget = memory_mb * 1048576.;
+	if (largest > 0.)
+		jobs = (int)STMin((double)jobs, STMax(1., floor(budget / largest)));
+	jobs = STMax(1, STMin(jobs, njobs));
+	printf("batch: %i stacks, %i at a time, up to %.0f MB each\n",
+	       njobs, jobs, largest / 1048576.);
+
+	// a single job keeps the threads for its own parallel loops
+	int failed = 0;
+	#pragma omp parallel for schedule(dynamic) num_threads(jobs) if(jobs > 1) reduction(+:failed)
+	for (int i = 0; i < njobs; i++) {
+		if (status[i] == ST_OK) {
+			try {
+				status[i] = run_job(batch[i]);
+			}
+			catch (std::runtime_error* e) {
+				printf("%s: %s\n", batch[i].stack.c_str(), e->what());
+				delete e;
+				status[i] = ST_ERROR;
+			}
+		}
+		if (status[i] == ST_OK)
+			printf("%s: wrote %s\n", batch[i].stack.c_str(), batch[i].output.c_str());
+		else {
+			printf("%s: failed\n", batch[i].stack.c_str());
+			failed++;
+		}
+	}
+
+	if (failed > 0)
+		printf("batch: %i of %i stacks failed\n", failed, njobs);
+	return failed > 0 ? ST_ERROR : ST_OK;
+}
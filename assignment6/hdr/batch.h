@@ -0,0 +1,32 @@
+#ifndef __BATCH_H__
+#define __BATCH_H__
+
+/* Default memory budget for the stacks processed at once, in MB. */
+#define BATCH_MEMORY_MB 2048
+
+/* Run the whole create pipeline (align, response, merge, and tonemap or
+ * virtual photo) on every stack listed in a manifest, without any
+ * window or GL context. (The hdr binary is still linked against GL and
+ * GLUT, so their libraries have to be installed even on a headless
+ * machine.) Each line of the manifest is
+ *
+ *   photos.list response.cr output [key=K] [local] [shutter=T] [noalign]
+ *
+ * where response.cr is "-" to solve the response from the stack itself
+ * (with RESPONSE_LAMBDA and RESPONSE_SAMPLES) instead of loading it, and photos in the list are found relative to
+ * the list. The output's extension picks what is written:
+ * .pfm, .hdr, .pic and .pfh save the HDR image (a PFM is streamed to
+ * disk band by band), anything else is an 8-bit image tonemapped with
+ * the given key (.45 by default), using the local operator if "local"
+ * is given, or a virtual photo with shutter time T (e.g. 1/8) if
+ * "shutter" is given. The photos are aligned first unless "noalign" is
+ * given, for stacks shot from a tripod. Empty lines and lines starting with # are
+ * skipped.
+ *
+ * Stacks are processed concurrently, up to jobs at a time (0 for one
+ * per thread), but no more than fit in memory_mb at the estimated peak
+ * memory of the largest stack. Returns ST_ERROR if any stack failed.
+ */
+int RunBatch(const char* manifest, int jobs = 0, int memory_mb = BATCH_MEMORY_MB);
+
+#endif //__BATCH_H__
@@ -17,6 +17,10 @@
 #include <stdlib.h>
 #include <math.h>
 #include "response.h"
+#include "merge.h"
+#include "align.h"
+#include "batch.h"
+#include "tonemap.h"
 
 enum MODE {
   MODE_RESPONSE,
@@ -49,6 +53,17 @@ static int mode;             // The type of operation we're doing
 static float shutter_time = .125f; // Shutter time for virtual photograph
 static float key_lum      = .45f;  // The key value for tonemapping
 static float hdr_view_max = 1.f;   // Value to map to max color
+static bool  local_tm     = false; // Use the local (dodge-and-burn) tonemap operator
+
+// While keys are being pressed the viewer shows a quick preview made from
+// a shrunken copy of the HDR, and renders the full image once it is idle.
+// The tonemappers cache everything that doesn't depend on the key.
+#define PREVIEW_SIZE 256
+static STHDRImage * preview_hdr = NULL;
+static STImage * preview = NULL;
+static ToneMapper * full_mapper = NULL;
+static ToneMapper * preview_mapper = NULL;
+static bool preview_shown = false;
 
 /* Recover an HDR image from a set of photos and the response curve for the camera used to
  * take the photos. To work efficiently you should only have one image open at a time.
@@ -62,69 +77,10 @@ static float hdr_view_max = 1.f;   // Value to map to max color
  */
 STHDRImage* recover_hdr(vector<Photo>& photos, CameraResponse& response)
 {
-    
     /* CS148 TODO */
-    int width = 0, height = 0;
-    STColor3f * numerator = NULL;
-    STColor3f * denominator = NULL;
-    int i = 0;
-    
-    for(vector<Photo>::iterator j = photos.begin(); j != photos.end(); j++)
-    {
-        fprintf(stdout, "processing image %i (%s)\n", i, j->filename.c_str());
-        
-        STImage image(j->filename);
-        
-        if(denominator == NULL)
-        {
-            width = image.GetWidth();
-            height = image.GetHeight();
-            denominator = new STColor3f[width*height];
-            memset(denominator, 0, sizeof(STColor3f)*width*height);
-            numerator = new STColor3f[width*height];
-            memset(numerator, 0, sizeof(STColor3f)*width*height);
-        }
-        
-        STColor3f ln_dt = STColor3f(logf(j->shutter));
-        
-        for(int y = 0; y < height; y++)
-        {
-            for(int x = 0; x < width; x++)
-            {
-                STColor4ub c = image.GetPixel(x, y);
-                numerator[x+y*width] += response.Weight(c) * (response.GetExposure(c) - ln_dt);
-                denominator[x+y*width] += response.Weight(c);
-            }
-        }
-        
-        i++;
-    }
-    
-    STHDRImage * hdrImage = new STHDRImage(width, height);
-    
-    for(int y = 0; y < height; y++)
-    {
-        for(int x = 0; x < width; x++)
-        {
-            float r = expf(numerator[x+y*width].r/denominator[x+y*width].r);
-            float g = expf(numerator[x+y*width].g/denominator[x+y*width].g);
-            float b = expf(numerator[x+y*width].b/denominator[x+y*width].b);
-            hdrImage->SetPixel(x, y, STColor3f(r, g, b));
-        }
-    }
     
-    if(numerator)
-    {
-        delete[] numerator;
-        numerator = NULL;
-    }
-    if(denominator)
-    {
-        delete[] denominator;
-        denominator = NULL;
-    }
-    
-    return hdrImage;
+    // the merge engine walks the stack in bands, see merge.h
+    return MergeHDR(photos, response);
 }
 
 /* Scale an HDR image for viewing, this is just a linear map
@@ -134,19 +90,18 @@ void scale_hdr(STHDRImage* hdr, float max_val, STImage* result)
 {
     /* CS148 TODO */
     
-    int width = hdr->GetWidth();
-    int height = hdr->GetHeight();
+    int n = hdr->GetWidth() * hdr->GetHeight();
+    const STColor3f* src = hdr->GetPixels();
+    STColor4ub* dst = result->GetPixels();
+    float scale = 255.f / max_val;
     
-    for(int y = 0; y < height; y++)
+    #pragma omp parallel for schedule(static)
+    for(int i = 0; i < n; i++)
     {
-        for(int x = 0; x < width; x++)
-        {
-            STColor3f c = hdr->GetPixel(x, y);
-            float r = min(c.r/max_val * 255, 255.0f);
-            float g = min(c.g/max_val * 255, 255.0f);
-            float b = min(c.b/max_val * 255, 255.0f);
-            result->SetPixel(x, y, STColor4ub(r, g, b, 1));
-        }
+        float r = min(src[i].r * scale, 255.0f);
+        float g = min(src[i].g * scale, 255.0f);
+        float b = min(src[i].b * scale, 255.0f);
+        dst[i] = STColor4ub(r, g, b, 1);
     }
 }
 
@@ -162,13 +117,13 @@ void virtual_photo(STHDRImage* hdr, CameraResponse& response, float shutter, STI
     int width = hdr->GetWidth();
     int height = hdr->GetHeight();
     
+    // both images are stored row by row from the bottom, so a row of
+    // the HDR maps straight onto the same row of the photo
+    #pragma omp parallel for schedule(static)
     for(int y = 0; y < height; y++)
     {
-        for(int x = 0; x < width; x++)
-        {
-            STColor3f c = hdr->GetPixel(x, y);
-            result->SetPixel(x, y, response.GetResponse(c, shutter));
-        }
+        response.GetResponses(hdr->GetPixels() + y*width, width, shutter,
+                              result->GetPixels() + y*width);
     }
 }
 
@@ -186,47 +141,55 @@ void tonemap(STHDRImage* hdr, float key, STImage* result)\
 {
     /* CS148 TODO */
     
-    int width = hdr->GetWidth();
-    int height = hdr->GetHeight();
-    
-    // calculate average luminance
-    float Y_sum = 0;
-    for(int y = 0; y < height; y++)
-    {
-        for(int x = 0; x < width; x++)
-        {
-            STColor3f c = hdr->GetPixel(x, y);
-            float Y = 0.299f*c.r + 0.587*c.g + 0.114f*c.b;
-            Y_sum += log10f(0.0001 + Y);
-        }
-    }
-    
-    float Y_avg = expf(Y_sum/(width*height));
-    
-    for(int y = 0; y < height; y++)
-    {
-        for(int x = 0; x < width; x++)
-        {
-            STColor3f c = hdr->GetPixel(x, y);
-            float r = c.r;
-            float g = c.g;
-            float b = c.b;
-            
-            r *= (key/Y_avg);
-            r = r/(1+r);
-            r = min(255.0f, r*255);
-            
-            g *= (key/Y_avg);
-            g = g/(1+g);
-            g = min(255.0f, g*255);
-            
-            b *= (key/Y_avg);
-            b = b/(1+b);
-            b = min(255.0f, b*255);
-            
-            result->SetPixel(x, y, STColor4ub(r, g, b, 1));
-        }
-    }
+    // the log-average and the other per-image work are done by
+    // ToneMapper, see tonemap.h
+    ToneMapper mapper(hdr);
+    if (local_tm)
+        mapper.Local(key, result);
+    else
+        mapper.Global(key, result);
+}
+
+/* Render the current mode into the full image, or into the preview. */
+static void render(bool full)
+{
+  STHDRImage* src = full ? hdr : preview_hdr;
+  STImage* dst = full ? image : preview;
+  ToneMapper* mapper = full ? full_mapper : preview_mapper;
+
+  if (mode == MODE_VIEW)
+    scale_hdr(src, hdr_view_max, dst);
+  else if (mode == MODE_VP)
+    virtual_photo(src, cr, shutter_time, dst);
+  else if (mode == MODE_TONEMAP) {
+    if (local_tm)
+      mapper->Local(key_lum, dst);
+    else
+      mapper->Global(key_lum, dst);
+  }
+}
+
+/* GLUT idle callback: replace the preview with the full image. */
+static void refine()
+{
+  glutIdleFunc(NULL);
+  render(true);
+  preview_shown = false;
+  glutPostRedisplay();
+}
+
+/* The view parameters changed: show a preview right away and refine it
+ * when no more events are pending.
+ */
+static void update()
+{
+  if (preview == NULL) {
+    render(true);
+    return;
+  }
+  render(false);
+  preview_shown = true;
+  glutIdleFunc(refine);
 }
 
 //
@@ -237,7 +200,15 @@ void display()
   glClearColor(.3f, .3f, .3f, 1.0f);
   glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
 
-  image->Draw();
+  if (preview_shown) {
+    // stretch the preview over the window until the full image is done
+    glPixelZoom(float(image->GetWidth()) / preview->GetWidth(),
+                float(image->GetHeight()) / preview->GetHeight());
+    preview->Draw();
+    glPixelZoom(1.f, 1.f);
+  }
+  else
+    image->Draw();
 
   glutSwapBuffers();
 }
@@ -267,37 +238,28 @@ static void keyboard(unsigned char key, int x, int y) {
     // quit
     case '+':
     case '=':
-      if (mode == MODE_VIEW) {
+      if (mode == MODE_VIEW)
         hdr_view_max /= 2.f;
-        scale_hdr(hdr, hdr_view_max, image);
-      }
-      else if (mode == MODE_VP) {
+      else if (mode == MODE_VP)
         shutter_time *= powf(2.f, 1.f/3.f); // 1/3 stop
-        virtual_photo(hdr, cr, shutter_time, image);
-      }
-      else if (mode == MODE_TONEMAP) {
+      else if (mode == MODE_TONEMAP)
         key_lum += .05f;
-        tonemap(hdr, key_lum, image);
-      }
+      update();
       break;
     case '-':
     case '_':
-      if (mode == MODE_VIEW) {
+      if (mode == MODE_VIEW)
         hdr_view_max *= 2.f;
-        scale_hdr(hdr, hdr_view_max, image);
-      }
-      else if (mode == MODE_VP) {
+      else if (mode == MODE_VP)
         shutter_time /= powf(2.f, 1.f/3.f); // 1/3 stop
-        virtual_photo(hdr, cr, shutter_time, image);
-      }
-      else if (mode == MODE_TONEMAP) {
+      else if (mode == MODE_TONEMAP)
         key_lum -= .05f;
-        tonemap(hdr, key_lum, image);
-      }
-
+      update();
       break;
     case 's':
     case 'S':
+      if (preview_shown)
+        refine();
       if (mode == MODE_VIEW)
         image->Save("view.jpg");
       else if (mode == MODE_VP)
@@ -305,6 +267,13 @@ static void keyboard(unsigned char key, int x, int y) {
       else if (mode == MODE_TONEMAP)
         image->Save("tonemap.jpg");
       break;
+    case 'l':
+    case 'L':
+      if (mode == MODE_TONEMAP) {
+        local_tm = !local_tm;
+        update();
+      }
+      break;
     case char(27):
     case 'q':
     case 'Q':
@@ -316,56 +285,73 @@ static void keyboard(unsigned char key, int x, int y) {
 
 static void usage() {
   printf("Usage:\n");
-  printf("hdr -response photos.list response_out.cr\n");
-  printf("hdr -create photos.list response.cr photo_out.pfm\n");
+  printf("hdr -response [-noalign] photos.list response_out.cr\n");
+  printf("hdr -create [-noalign] photos.list response.cr photo_out.pfm\n");
   printf("hdr -view photo.pfm\n");
   printf("hdr -vp photo.pfm response.cr\n");
   printf("hdr -tonemap photo.pfm\n");
+  printf("hdr -tonemap-local photo.pfm\n");
+  printf("hdr -batch manifest.txt [jobs [memory_mb]]\n");
+  printf("-response, -create and -batch need no display, but hdr still links\n");
+  printf("against GL and GLUT, so their libraries must be installed\n");
+  printf("HDR images can be .pfm, .hdr (Radiance RGBE) or .pfh (half float)\n");
   exit(-1);
 }
 
 int main(int argc, char** argv)
 {
-  //
-  // Initialize GLUT.
-  //
-  glutInit(&argc, argv);
-  glutInitDisplayMode( GLUT_DOUBLE | GLUT_RGBA | GLUT_DEPTH);
-  glutInitWindowPosition(20, 20);
-  glutInitWindowSize(
-      WIN_WIDTH, WIN_HEIGHT);
-  glutCreateWindow("CS148 Assignment 5");
-
-
   if (argc < 2) {
     usage();
   }
 
-  if ( strcmp(argv[1], "-response") == 0) {
-    if (argc != 4)
+  // -noalign skips aligning the photos, for stacks shot from a tripod;
+  // args then points past it
+  bool align = !(argc > 2 && strcmp(argv[2], "-noalign") == 0);
+  char** args = align ? argv : argv + 1;
+  int nargs = align ? argc : argc - 1;
+
+  // -response, -create and -batch never open a window, so they don't
+  // touch GLUT and run without a display
+  if ( strcmp(argv[1], "-batch") == 0) {
+    if (argc < 3 || argc > 5)
+      usage();
+    int jobs = (argc > 3) ? atoi(argv[3]) : 0;
+    int memory_mb = (argc > 4) ? atoi(argv[4]) : BATCH_MEMORY_MB;
+    exit(RunBatch(argv[2], jobs, memory_mb) == ST_OK ? 0 : -1);
+  }
+  else if ( strcmp(argv[1], "-response") == 0) {
+    if (nargs != 4)
       usage();
     mode = MODE_RESPONSE;
-
-    // Defaults
-    float lambda = 50.f;
-    int nsamples = 100;
-
     vector<Photo> photos;
-    LoadHDRStack(argv[2], photos);
-    cr.SolveForResponse(photos, lambda, nsamples);
+    LoadHDRStack(args[2], photos);
+    if (align && AlignStack(photos) != ST_OK)
+      exit(-1);
+    if (cr.SolveForResponse(photos, RESPONSE_LAMBDA, RESPONSE_SAMPLES) != ST_OK)
+      exit(-1);
 
-    cr.Save(argv[3]);
+    cr.Save(args[3]);
     exit(0);
   }
   else if ( strcmp(argv[1], "-create") == 0) {
-    if (argc != 5)
+    if (nargs != 5)
       usage();
     mode = MODE_CREATE;
     vector<Photo> photos;
-    LoadHDRStack(argv[2], photos);
-    cr.Load(argv[3]);
-    hdr = recover_hdr(photos, cr);
-    hdr->Save(argv[4]);
+    LoadHDRStack(args[2], photos);
+    if (align && AlignStack(photos) != ST_OK)
+      exit(-1);
+    cr.Load(args[3]);
+    if (STGetExtension(args[4]) == "PFM") {
+      // stream bands straight to disk rather than building the image
+      if (MergeHDRToPFM(photos, cr, args[4]) != ST_OK)
+        exit(-1);
+    }
+    else {
+      hdr = recover_hdr(photos, cr);
+      if (hdr == NULL || hdr->Save(args[4]) != ST_OK)
+        exit(-1);
+    }
     exit(0);
   }
   else {
@@ -379,24 +365,41 @@ int main(int argc, char** argv)
       if (argc != 3)
         usage();
       mode = MODE_VIEW;
-      scale_hdr(hdr, hdr_view_max, image);
     }
     else if ( strcmp(argv[1], "-vp") == 0) {
       if (argc != 4)
         usage();
       mode = MODE_VP;
       cr.Load(argv[3]);
-      virtual_photo(hdr, cr, shutter_time, image);
     }
-    else if ( strcmp(argv[1], "-tonemap") == 0) {
+    else if ( strcmp(argv[1], "-tonemap") == 0 ||
+              strcmp(argv[1], "-tonemap-local") == 0) {
       if (argc != 3)
         usage();
       mode = MODE_TONEMAP;
-      tonemap(hdr, key_lum, image);
+      local_tm = (strcmp(argv[1], "-tonemap-local") == 0);
     }
     else {
       usage();
     }
+
+    //
+    // Initialize GLUT.
+    //
+    glutInit(&argc, argv);
+    glutInitDisplayMode( GLUT_DOUBLE | GLUT_RGBA | GLUT_DEPTH);
+    glutInitWindowPosition(20, 20);
+    glutInitWindowSize(
+        WIN_WIDTH, WIN_HEIGHT);
+    glutCreateWindow("CS148 Assignment 5");
+
+    full_mapper = new ToneMapper(hdr);
+    if (hdr->GetWidth() > PREVIEW_SIZE || hdr->GetHeight() > PREVIEW_SIZE) {
+      preview_hdr = ShrinkHDR(hdr, PREVIEW_SIZE);
+      preview = new STImage(preview_hdr->GetWidth(), preview_hdr->GetHeight());
+      preview_mapper = new ToneMapper(preview_hdr);
+    }
+    render(true);
   }
 
   glutReshapeWindow(image->GetWidth(), image->GetHeight());
@@ -0,0 +1,288 @@
+#include "merge.h"
+#include "scanline.h"
+#include "stdio.h"
+#include "math.h"
+
+#include <algorithm>
+
+/* The AVX2 merge is compiled for AVX2 whatever the build flags, and
+ * only used if the CPU has it (see merge_row).
+ */
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define MERGE_AVX2
+#include <immintrin.h>
+#endif
+
+/* BandSink - receives merged bands of HDR rows. y is the STHDRImage
+ * row of the bottom row of the band, and the rows are stored bottom
+ * to top like in STHDRImage.
+ */
+class BandSink {
+public:
+	virtual ~BandSink() {}
+	virtual int Begin(int width, int height) = 0;
+	virtual int Write(int y, int nrows, const STColor3f* rows) = 0;
+};
+
+/* Collects the bands into an in-memory STHDRImage. */
+class ImageSink : public BandSink {
+public:
+	ImageSink() : image(NULL) {}
+
+	int Begin(int width, int height) {
+		image = new STHDRImage(width, height);
+		return ST_OK;
+	}
+
+	int Write(int y, int nrows, const STColor3f* rows) {
+		int width = image->GetWidth();
+		std::copy(rows, rows + (size_t)nrows*width, image->GetPixels() + (size_t)y*width);
+		return ST_OK;
+	}
+
+	STHDRImage* image;
+};
+
+/* Writes the bands into a PFM file. PFM stores the bottom row first,
+ * the same as STHDRImage, so each band is a contiguous run of the
+ * file and can be written wherever it belongs.
+ */
+class PFMSink : public BandSink {
+public:
+	PFMSink(const char* _fname) : fname(_fname), fout(NULL), width(0), offset(0) {}
+	~PFMSink() {
+		if (fout)
+			fclose(fout);
+	}
+
+	int Begin(int _width, int height) {
+		fout = fopen(fname, "wb");
+		if (fout == NULL) {
+			printf("Error opening file: %s\n", fname);
+			return ST_ERROR;
+		}
+		width = _width;
+		offset = STHDRImage::WritePFMHeader(fout, width, height);
+		return ST_OK;
+	}
+
+	int Write(int y, int nrows, const STColor3f* rows) {
+		size_t count = (size_t)nrows * width;
+		if (fseek(fout, offset + (long)y * width * (long)sizeof(STColor3f), SEEK_SET) != 0 ||
+		    fwrite(rows, sizeof(STColor3f), count, fout) != count) {
+			printf("Error writing file: %s\n", fname);
+			return ST_ERROR;
+		}
+		return ST_OK;
+	}
+
+private:
+	const char* fname;
+	FILE* fout;
+	int width;
+	long offset;
+};
+
+#ifdef MERGE_AVX2
+/* Merge the first multiple of eight pixels of a row, eight at a time
+ * using gathers from the response tables. Returns the number merged.
+ */
+__attribute__((target("avx2"))) static int
+merge_row_avx2(const STColor4ub* const* rows, const float* ln_dt, int nimages,
+               int width, const float* const* wt, const float* const* wgt,
+               STColor3f* out) {
+	const __m256i mask = _mm256_set1_epi32(0xff);
+	int x = 0;
+	for (; x + 8 <= width; x += 8) {
+		__m256 num[3], den[3];
+		for (int c = 0; c < 3; c++)
+			num[c] = den[c] = _mm256_setzero_ps();
+
+		for (int k = 0; k < nimages; k++) {
+			__m256i pix = _mm256_loadu_si256((const __m256i*)(rows[k] + x));
+			__m256i z[3];
+			z[0] = _mm256_and_si256(pix, mask);
+			z[1] = _mm256_and_si256(_mm256_srli_epi32(pix, 8), mask);
+			z[2] = _mm256_and_si256(_mm256_srli_epi32(pix, 16), mask);
+			__m256 dt = _mm256_set1_ps(ln_dt[k]);
+			for (int c = 0; c < 3; c++) {
+				__m256 w = _mm256_i32gather_ps(wt[c], z[c], 4);
+				__m256 wg = _mm256_i32gather_ps(wgt[c], z[c], 4);
+				num[c] = _mm256_add_ps(num[c], _mm256_sub_ps(wg, _mm256_mul_ps(w, dt)));
+				den[c] = _mm256_add_ps(den[c], w);
+			}
+		}
+
+		float ratio[3][8];
+		for (int c = 0; c < 3; c++)
+			_mm256_storeu_ps(ratio[c], _mm256_div_ps(num[c], den[c]));
+		for (int i = 0; i < 8; i++)
+			out[x+i] = STColor3f(expf(ratio[0][i]), expf(ratio[1][i]), expf(ratio[2][i]));
+	}
+	return x;
+}
+
+static bool
+has_avx2() {
+	static const bool avx2 = __builtin_cpu_supports("avx2");
+	return avx2;
+}
+#endif
+
+/* Merge one row of a band. rows[k] points at the row of exposure k.
+ * Each sample costs two table lookups and a multiply-add:
+ *
+ *   numerator   += w(z)*g(z) - w(z)*ln(dt)
+ *   denominator += w(z)
+ *
+ * On CPUs with AVX2 eight pixels are merged at once by merge_row_avx2.
+ */
+static void
+merge_row(const STColor4ub* const* rows, const float* ln_dt, int nimages,
+          int width, CameraResponse& response, STColor3f* out) {
+	const float* wt[3];
+	const float* wgt[3];
+	for (int c = 0; c < 3; c++) {
+		wt[c] = response.GetWeightTable(c);
+		wgt[c] = response.GetWeightedExposureTable(c);
+	}
+
+	int x = 0;
+#ifdef MERGE_AVX2
+	if (has_avx2())
+		x = merge_row_avx2(rows, ln_dt, nimages, width, wt, wgt, out);
+#endif
+
+	for (; x < width; x++) {
+		float num[3] = { 0.f, 0.f, 0.f };
+		float den[3] = { 0.f, 0.f, 0.f };
+		for (int k = 0; k < nimages; k++) {
+			const STColor4ub& p = rows[k][x];
+			unsigned char z[3] = { p.r, p.g, p.b };
+			for (int c = 0; c < 3; c++) {
+				float w = wt[c][z[c]];
+				num[c] += wgt[c][z[c]] - w * ln_dt[k];
+				den[c] += w;
+			}
+		}
+		out[x] = STColor3f(expf(num[0]/den[0]), expf(num[1]/den[1]), expf(num[2]/den[2]));
+	}
+}
+
+/* Run the banded merge, handing every finished band to sink. */
+static int
+merge_bands(vector<Photo>& photos, CameraResponse& response,
+            int band_rows, BandSink& sink) {
+	int nimages = (int)photos.size();
+	if (nimages < 1 || band_rows < 1)
+		return ST_ERROR;
+
+	ScanlineReader* readers = new ScanlineReader[nimages];
+	vector<float> ln_dt(nimages);
+	int width = 0, height = 0;
+	int k;
+
+	for (k = 0; k < nimages; k++) {
+		if (readers[k].Open(photos[k].filename) != ST_OK) {
+			delete[] readers;
+			return ST_ERROR;
+		}
+		if (k == 0) {
+			width = readers[k].GetWidth();
+			height = readers[k].GetHeight();
+		}
+		else if (readers[k].GetWidth() != width || readers[k].GetHeight() != height) {
+			printf("Image %s is not %ix%i\n", photos[k].filename.c_str(), width, height);
+			delete[] readers;
+			return ST_ERROR;
+		}
+		ln_dt[k] = logf(photos[k].shutter);
+	}
+
+	// crop to the part of the scene every photo covers, see AlignStack
+	int x0 = 0, y0 = 0, x1 = width, y1 = height;
+	for (k = 0; k < nimages; k++) {
+		x0 = STMax(x0, -photos[k].dx);
+		y0 = STMax(y0, -photos[k].dy);
+		x1 = STMin(x1, width - photos[k].dx);
+		y1 = STMin(y1, height - photos[k].dy);
+	}
+	int out_width = x1 - x0;
+	int out_height = y1 - y0;
+	if (out_width <= 0 || out_height <= 0) {
+		printf("The photos don't overlap\n");
+		delete[] readers;
+		return ST_ERROR;
+	}
+	vector<int> column(nimages);
+	for (k = 0; k < nimages; k++) {
+		column[k] = x0 + photos[k].dx;
+		if (readers[k].SkipRows(y0 + photos[k].dy) != ST_OK) {
+			delete[] readers;
+			return ST_ERROR;
+		}
+	}
+
+	if (sink.Begin(out_width, out_height) != ST_OK) {
+		delete[] readers;
+		return ST_ERROR;
+	}
+
+	fprintf(stdout, "merging %i images (%ix%i) in bands of %i rows\n",
+	        nimages, out_width, out_height, band_rows);
+
+	// one band of every exposure, rows in file (top to bottom) order
+	int band_size = band_rows * width;
+	vector<STColor4ub> band((size_t)nimages * band_size);
+	vector<STColor3f> merged(band_rows * out_width);
+	int status = ST_OK;
+
+	for (int top = 0; top < out_height && status == ST_OK; top += band_rows) {
+		int nrows = STMin(band_rows, out_height - top);
+
+		// decode the band of each exposure concurrently
+		#pragma omp parallel for schedule(dynamic)
+		for (k = 0; k < nimages; k++) {
+			if (readers[k].ReadRows(&band[(size_t)k * band_size], nrows) != ST_OK) {
+				#pragma omp critical
+				status = ST_ERROR;
+			}
+		}
+		if (status != ST_OK)
+			break;
+
+		#pragma omp parallel for schedule(static)
+		for (int i = 0; i < nrows; i++) {
+			vector<const STColor4ub*> rows(nimages);
+			for (int j = 0; j < nimages; j++)
+				rows[j] = &band[(size_t)j * band_size + i * width + column[j]];
+			// flip so the band is stored bottom to top
+			merge_row(&rows[0], &ln_dt[0], nimages, out_width, response,
+			          &merged[(nrows - 1 - i) * out_width]);
+		}
+
+		status = sink.Write(out_height - top - nrows, nrows, &merged[0]);
+	}
+
+	delete[] readers;
+	return status;
+}
+
+/* Merge a stack of photos into an in-memory HDR image. */
+STHDRImage*
+MergeHDR(vector<Photo>& photos, CameraResponse& response, int band_rows) {
+	ImageSink sink;
+	if (merge_bands(photos, response, band_rows, sink) != ST_OK) {
+		delete sink.image;
+		return NULL;
+	}
+	return sink.image;
+}
+
+/* Merge a stack of photos straight into a PFM file. */
+int
+MergeHDRToPFM(vector<Photo>& photos, CameraResponse& response,
+              const char* fname, int band_rows) {
+	PFMSink sink(fname);
+	return merge_bands(photos, response, band_rows, sink);
+}
@@ -0,0 +1,31 @@
+#ifndef __MERGE_H__
+#define __MERGE_H__
+
+#include "response.h"
+#include "STHDRImage.h"
+
+/* Default number of image rows merged together as one band. */
+#define MERGE_BAND_ROWS 32
+
+/* Merge a stack of photos into an HDR image using the camera response.
+ * The stack is processed in horizontal bands: each exposure is decoded
+ * only band_rows rows at a time (the exposures concurrently), and the
+ * rows of a band are merged in parallel. Working memory is
+ * O(band_rows * width * photos.size()) on top of the result.
+ *
+ * Photos are moved by their alignment offsets (see AlignStack) and the
+ * result is cropped to the area all of them cover.
+ *
+ * Returns NULL if the photos can't be read or differ in size.
+ */
+STHDRImage* MergeHDR(vector<Photo>& photos, CameraResponse& response,
+                     int band_rows = MERGE_BAND_ROWS);
+
+/* Same as MergeHDR, but each band is written straight into a PFM file
+ * as soon as it is merged, so the full-resolution image is never held
+ * in memory.
+ */
+int MergeHDRToPFM(vector<Photo>& photos, CameraResponse& response,
+                  const char* fname, int band_rows = MERGE_BAND_ROWS);
+
+#endif //__MERGE_H__
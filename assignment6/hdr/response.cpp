@@ -1,9 +1,13 @@
 #include "response.h"
+#include "scanline.h"
 #include "stdio.h"
 #include "math.h"
+#include "float.h"
 
-#include "tnt/tnt.h"
-#include "tnt/jama_qr.h"
+#include <algorithm>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
 
 /* Load an HDR stack (list of photos + shutter times) 
  * Each line of the file indicates a single photo and
@@ -33,6 +37,7 @@ LoadHDRStack(const char* fname, vector<Photo>& stack) {
 		}
 		p.shutter = float(shutter_num) / float(shutter_den);
 		p.filename = namebuf;
+		p.dx = p.dy = 0;
 		stack.push_back(p);
 	}
 
@@ -45,11 +50,13 @@ CameraResponse::CameraResponse() {
 	memset(response_r, 0, NUM_RESPONSES*sizeof(float));
 	memset(response_g, 0, NUM_RESPONSES*sizeof(float));
 	memset(response_b, 0, NUM_RESPONSES*sizeof(float));
+	BuildTables();
 }
 CameraResponse::CameraResponse(float* _r, float* _g, float* _b) {
 	memcpy(response_r, _r, NUM_RESPONSES*sizeof(float));
 	memcpy(response_g, _g, NUM_RESPONSES*sizeof(float));
 	memcpy(response_b, _b, NUM_RESPONSES*sizeof(float));
+	BuildTables();
 }
 
 /* Load response curves from file. */
@@ -62,11 +69,13 @@ CameraResponse::Load(char* fname) {
 	for(int i = 0; i < NUM_RESPONSES; i++) {
 		if (fscanf(fin, "%f %f %f", &response_r[i], &response_g[i], &response_b[i]) != 3){
 			fclose(fin);
+			BuildTables();
 			return ST_ERROR;
 		}
 	}
 
 	fclose(fin);
+	BuildTables();
 
 	return ST_OK;
 }
@@ -89,21 +98,77 @@ CameraResponse::Save(char* fname) {
 
 /* Get the camera response (i.e. resulting pixel value) given
  * and irradiance value and exposure time. We store the inverse
- * function, but its monotonic, so we can just use binary search
- * and linear interpolation. 
+ * function, but its monotonic, so we can invert it with a lookup
+ * table (see BuildInverseTables).
  */
 STColor4ub 
 CameraResponse::GetResponse(STColor3f& irr, float dt) {
-	STColor3f exposure = (irr * dt).Log();
 	STColor4ub result;
 
-	result.r = binary_search(response_r, exposure.r);
-	result.g = binary_search(response_g, exposure.g);
-	result.b = binary_search(response_b, exposure.b);
+	result.r = inverse_lookup(0, irr.r * dt);
+	result.g = inverse_lookup(1, irr.g * dt);
+	result.b = inverse_lookup(2, irr.b * dt);
 	result.a = 255;
 
 	return result;
 }
+
+/* Get the camera response of n irradiance values at once. The table
+ * indices of four pixels (twelve channels) are computed together with
+ * SSE2, the lookups themselves are scalar.
+ */
+void
+CameraResponse::GetResponses(const STColor3f* irr, int n, float dt, STColor4ub* out) const {
+	int i = 0;
+#ifdef __SSE2__
+	// the channels of four pixels repeat with a period of three vectors
+	const float* src = (const float*)irr;
+	__m128i base[3], last[3];
+	for(int v = 0; v < 3; v++) {
+		int b[4], l[4];
+		for(int k = 0; k < 4; k++) {
+			int c = (4*v + k) % 3;
+			b[k] = inverse_base[c];
+			l[k] = inverse_size[c] - 1;
+		}
+		base[v] = _mm_setr_epi32(b[0], b[1], b[2], b[3]);
+		last[v] = _mm_setr_epi32(l[0], l[1], l[2], l[3]);
+	}
+	__m128 vdt = _mm_set1_ps(dt);
+	__m128i zero = _mm_setzero_si128();
+
+	for(; i + 4 <= n; i += 4) {
+		float x[12];
+		int idx[12];
+		for(int v = 0; v < 3; v++) {
+			__m128 e = _mm_mul_ps(_mm_loadu_ps(src + 3*i + 4*v), vdt);
+			_mm_storeu_ps(x + 4*v, e);
+			__m128i t = _mm_sub_epi32(_mm_srli_epi32(_mm_castps_si128(e), INVERSE_SHIFT), base[v]);
+			// clamp to [0, size-1]; negative exposures land past the top of
+			// the table since the sign bit is shifted in, those are fixed
+			// up by the threshold test below
+			t = _mm_andnot_si128(_mm_cmplt_epi32(t, zero), t);
+			__m128i over = _mm_cmpgt_epi32(t, last[v]);
+			t = _mm_or_si128(_mm_and_si128(over, last[v]), _mm_andnot_si128(over, t));
+			_mm_storeu_si128((__m128i*)(idx + 4*v), t);
+		}
+		for(int k = 0; k < 4; k++) {
+			STColor4ub& p = out[i + k];
+			p.r = inverse_fixup(0, inverse_table[0][idx[3*k]], x[3*k]);
+			p.g = inverse_fixup(1, inverse_table[1][idx[3*k+1]], x[3*k+1]);
+			p.b = inverse_fixup(2, inverse_table[2][idx[3*k+2]], x[3*k+2]);
+			p.a = 255;
+		}
+	}
+#endif
+	for(; i < n; i++) {
+		out[i].r = inverse_lookup(0, irr[i].r * dt);
+		out[i].g = inverse_lookup(1, irr[i].g * dt);
+		out[i].b = inverse_lookup(2, irr[i].b * dt);
+		out[i].a = 255;
+	}
+}
+
 /* Get the exposure value (i.e. irradiance * dt) given the camera
  * response.  This is just a lookup since this is the function
  * we store directly.  Note that the curve stored is log (exposure)
@@ -139,150 +204,464 @@ CameraResponse::Weight(STColor4ub& pval) {
 	return result;
 }
 
-/* Binary search to find the index of the value in the array.
- * We use linear interpolation and round since some values
- * will fall between indices.
+/* Pixel value for a (linear) exposure: start from the table entry of
+ * the exposure's cell and step to the exact threshold.
+ */
+unsigned char
+CameraResponse::inverse_lookup(int c, float exposure) const {
+	int idx = (int)(float_bits(exposure) >> INVERSE_SHIFT) - inverse_base[c];
+	idx = STMin(STMax(idx, 0), inverse_size[c] - 1);
+	return inverse_fixup(c, inverse_table[c][idx], exposure);
+}
+
+/* Small deterministic random number generator, so that the same seed
+ * always picks the same samples regardless of the platform's rand().
+ */
+static unsigned int
+next_random(unsigned int& state) {
+	state = state * 1664525u + 1013904223u;
+	return state >> 8;
+}
+
+/* Statistics of one cell of the low resolution sampling grid. */
+typedef struct {
+	unsigned char mean[3];
+	unsigned char range;   // largest max-min of any channel in the cell
+	unsigned int jitter;   // random tie breaker
+	bool used;
+} SampleCell;
+
+/* Orders cell indices flattest first, ties broken by jitter. */
+struct FlatterCell {
+	const vector<SampleCell>& cells;
+	FlatterCell(const vector<SampleCell>& _cells) : cells(_cells) {}
+	bool operator()(int a, int b) const {
+		return cells[a].range < cells[b].range ||
+		       (cells[a].range == cells[b].range && cells[a].jitter < cells[b].jitter);
+	}
+};
+
+/* Choose pixel samples for recovering the response curve. Rather than
+ * picking pixels at random (which clusters them in the most common
+ * intensities) we:
+ *
+ * 1) stream the middle exposure into a grid of small cells and record
+ *    each cell's mean color and how much it varies,
+ * 2) split each channel's 0-255 range into strata and, round-robin over
+ *    the channels, take the flattest unused cell whose mean falls in
+ *    each stratum, keeping the cells a round takes apart from each other,
+ * 3) repeat such rounds until there are nsamples samples or no cells
+ *    are left, each from a different first stratum so that a last,
+ *    partial round doesn't favour dark values.
+ *
+ * Flat cells keep the samples away from edges, where blur and small
+ * misalignments between exposures would corrupt the equations. The
+ * centers of the chosen cells are returned sorted by row (counted from
+ * the top of the image).
  */
-unsigned char 
-CameraResponse::binary_search(float *rsp, float val) {
-	int min_idx, mid_idx, max_idx;
-	float mid_val;
-	// special cases
-	if (val < rsp[0]) return 0; 
-	else if (val > rsp[255]) return 255;
-	// binary search
-	min_idx = 0; max_idx = 255;
-	while(max_idx - min_idx > 1) {
-		mid_idx = (min_idx + max_idx) / 2;
-		mid_val = rsp[mid_idx];
-		if (mid_val < val)
-			min_idx = mid_idx;
-		else
-			max_idx = mid_idx;
+static int
+choose_samples(vector<Photo>& photos, int nsamples, unsigned int seed,
+               vector<int>& samples_x, vector<int>& samples_y) {
+	int i, j, c;
+	int nimages = (int)photos.size();
+
+	// the middle exposure has the most well exposed pixels
+	vector<int> order(nimages);
+	for(i = 0; i < nimages; i++)
+		order[i] = i;
+	for(i = 1; i < nimages; i++)
+		for(j = i; j > 0 && photos[order[j]].shutter < photos[order[j-1]].shutter; j--)
+			swap(order[j], order[j-1]);
+	const Photo& middle = photos[order[nimages/2]];
+
+	ScanlineReader reader;
+	if (reader.Open(middle.filename) != ST_OK)
+		return ST_ERROR;
+	int width = reader.GetWidth();
+	int height = reader.GetHeight();
+
+	// about 16 cells per sample, each at least 2x2 pixels
+	int size = (int)sqrtf((float)width * height / (16.f * nsamples));
+	size = STMax(size, 2);
+	int gw = STMax(width / size, 1);
+	int gh = STMax(height / size, 1);
+	size = STMin(size, STMin(width, height));
+
+	vector<SampleCell> cells(gw*gh);
+	vector<unsigned int> sum(gw*3);
+	vector<unsigned char> lo(gw*3), hi(gw*3);
+	vector<STColor4ub> rows(width*size);
+	unsigned int state = seed;
+
+	for(int cy = 0; cy < gh; cy++) {
+		if (reader.ReadRows(&rows[0], size) != ST_OK)
+			return ST_ERROR;
+		fill(sum.begin(), sum.end(), 0);
+		fill(lo.begin(), lo.end(), 255);
+		fill(hi.begin(), hi.end(), 0);
+		for(int y = 0; y < size; y++) {
+			for(int x = 0; x < gw*size; x++) {
+				const STColor4ub& p = rows[y*width + x];
+				unsigned char v[3] = { p.r, p.g, p.b };
+				int cx = x / size;
+				for(c = 0; c < 3; c++) {
+					sum[cx*3+c] += v[c];
+					lo[cx*3+c] = STMin(lo[cx*3+c], v[c]);
+					hi[cx*3+c] = STMax(hi[cx*3+c], v[c]);
+				}
+			}
+		}
+		for(int cx = 0; cx < gw; cx++) {
+			SampleCell& cell = cells[cy*gw + cx];
+			cell.range = 0;
+			for(c = 0; c < 3; c++) {
+				cell.mean[c] = (unsigned char)(sum[cx*3+c] / (size*size));
+				cell.range = STMax(cell.range, (unsigned char)(hi[cx*3+c] - lo[cx*3+c]));
+			}
+			cell.jitter = next_random(state);
+			cell.used = false;
+		}
+	}
+	reader.Close();
+
+	// cells of each channel bucketed by mean value, flattest first
+	FlatterCell flatter(cells);
+	vector<int> buckets[3][NUM_RESPONSES];
+	for(c = 0; c < 3; c++) {
+		for(i = 0; i < gw*gh; i++)
+			buckets[c][cells[i].mean[c]].push_back(i);
+		for(i = 0; i < NUM_RESPONSES; i++)
+			sort(buckets[c][i].begin(), buckets[c][i].end(), flatter);
+	}
+
+	int nstrata = STMin(NUM_RESPONSES, STMax(1, (nsamples + 2) / 3));
+	vector<int> chosen;
+	vector<bool> blocked(gw*gh);
+
+	while((int)chosen.size() < nsamples) {
+		// a round takes at most one cell per stratum and channel
+		fill(blocked.begin(), blocked.end(), false);
+		int first = next_random(state) % nstrata;
+		int picked = 0;
+		for(int t = 0; t < nstrata && (int)chosen.size() < nsamples; t++) {
+			int s = (first + t) % nstrata;
+			for(c = 0; c < 3 && (int)chosen.size() < nsamples; c++) {
+				// the flattest free cell of each bucket, and the flattest of those
+				int best = -1;
+				for(int v = s*NUM_RESPONSES/nstrata; v < (s+1)*NUM_RESPONSES/nstrata; v++) {
+					for(j = 0; j < (int)buckets[c][v].size(); j++) {
+						int k = buckets[c][v][j];
+						if (cells[k].used || blocked[k])
+							continue;
+						if (best < 0 || flatter(k, best))
+							best = k;
+						break;
+					}
+				}
+				if (best < 0)
+					continue;
+				cells[best].used = true;
+				chosen.push_back(best);
+				picked++;
+				// keep the neighbours free so samples spread out
+				int bx = best % gw, by = best / gw;
+				for(int ny = STMax(by-1, 0); ny <= STMin(by+1, gh-1); ny++)
+					for(int nx = STMax(bx-1, 0); nx <= STMin(bx+1, gw-1); nx++)
+						blocked[ny*gw + nx] = true;
+			}
+		}
+		// nothing is blocked at the start of a round, so only running
+		// out of cells ends one empty-handed
+		if (picked == 0)
+			break;
+
+		// drop the cells this round took
+		for(c = 0; c < 3; c++) {
+			for(i = 0; i < NUM_RESPONSES; i++) {
+				vector<int>& bucket = buckets[c][i];
+				j = 0;
+				for(int k = 0; k < (int)bucket.size(); k++)
+					if (!cells[bucket[k]].used)
+						bucket[j++] = bucket[k];
+				bucket.resize(j);
+			}
+		}
+	}
+
+	// cell centers, in row order
+	sort(chosen.begin(), chosen.end());
+	samples_x.clear();
+	samples_y.clear();
+	for(i = 0; i < (int)chosen.size(); i++) {
+		samples_x.push_back((chosen[i] % gw) * size + size/2);
+		samples_y.push_back((chosen[i] / gw) * size + size/2);
+	}
+	return ST_OK;
+}
+
+/* Solve the normal equations of the response system for one channel.
+ * z holds the pixel values of the samples, nsamples per image, and
+ * the unknowns are the curve g(0..255) followed by one log irradiance
+ * ln(E_i) per sample.
+ *
+ * Every data row only touches g(z) and ln(E_i), so the ln(E_i) block
+ * of A^T A is diagonal and can be eliminated exactly (Schur complement).
+ * That leaves a dense 256x256 symmetric positive definite system for
+ * the curve, whatever the number of samples and images, which is
+ * solved with a Cholesky factorization.
+ */
+static int
+solve_channel(const unsigned char* z, const float* ln_shutter, int nimages,
+              int nsamples, float lambda, CameraResponse& cr, float* curve) {
+	const int n = NUM_RESPONSES;
+	int i, j, k, l;
+
+	// normal equations for the curve block: M g = r
+	vector<double> M(n*n, 0.0);
+	vector<double> r(n, 0.0);
+
+	// per sample: the diagonal of the ln(E) block, its right hand side,
+	// and the coupling to the curve, which is -w^2 at each g(z)
+	vector<double> e_diag(nsamples, 0.0);
+	vector<double> e_rhs(nsamples, 0.0);
+
+	for(j = 0; j < nimages; j++) {
+		for(i = 0; i < nsamples; i++) {
+			int zij = z[j*nsamples + i];
+			double w = cr.Weight((unsigned char)zij);
+			double w2 = w*w;
+			// row: w g(z) - w ln(E_i) = w ln(dt_j)
+			M[zij*n + zij] += w2;
+			r[zij] += w2 * ln_shutter[j];
+			e_diag[i] += w2;
+			e_rhs[i] -= w2 * ln_shutter[j];
+		}
+	}
+
+	// eliminate the ln(E_i) unknowns; each sample only couples the
+	// handful of curve entries its pixel values hit
+	vector<int> zs(nimages);
+	vector<double> ws(nimages);
+	for(i = 0; i < nsamples; i++) {
+		for(j = 0; j < nimages; j++) {
+			zs[j] = z[j*nsamples + i];
+			double w = cr.Weight((unsigned char)zs[j]);
+			ws[j] = -w*w;
+		}
+		double inv = 1.0 / e_diag[i];
+		for(j = 0; j < nimages; j++) {
+			for(k = 0; k < nimages; k++)
+				M[zs[j]*n + zs[k]] -= ws[j] * ws[k] * inv;
+			r[zs[j]] -= ws[j] * e_rhs[i] * inv;
+		}
+	}
+
+	// smoothness rows: lambda w(i) (g(i) - 2 g(i+1) + g(i+2)) = 0
+	for(i = 0; i < n-2; i++) {
+		double w = lambda * cr.Weight((unsigned char)i);
+		double v[3] = { w, -2*w, w };
+		for(k = 0; k < 3; k++)
+			for(l = 0; l < 3; l++)
+				M[(i+k)*n + (i+l)] += v[k] * v[l];
+	}
+
+	// fix the curve such that g(128) = 0
+	M[128*n + 128] += 1.0;
+
+	// Cholesky factorization M = L L^T, L stored in the lower triangle
+	for(j = 0; j < n; j++) {
+		double d = M[j*n + j];
+		for(k = 0; k < j; k++)
+			d -= M[j*n + k] * M[j*n + k];
+		if (d <= 0.0)
+			return ST_ERROR;
+		d = sqrt(d);
+		M[j*n + j] = d;
+		for(i = j+1; i < n; i++) {
+			double s = M[i*n + j];
+			for(k = 0; k < j; k++)
+				s -= M[i*n + k] * M[j*n + k];
+			M[i*n + j] = s / d;
+		}
+	}
+
+	// forward and back substitution
+	for(i = 0; i < n; i++) {
+		double s = r[i];
+		for(k = 0; k < i; k++)
+			s -= M[i*n + k] * r[k];
+		r[i] = s / M[i*n + i];
 	}
-	// linear interpolation
-	float rsp_alpha = (rsp[max_idx] - val) / (rsp[max_idx] - rsp[min_idx]);
-	float result_idx = rsp_alpha * min_idx + (1.f - rsp_alpha) * max_idx;
-	// round and return
-	return (unsigned char) floorf(result_idx + .5f);
+	for(i = n-1; i >= 0; i--) {
+		double s = r[i];
+		for(k = i+1; k < n; k++)
+			s -= M[k*n + i] * r[k];
+		r[i] = s / M[i*n + i];
+	}
+
+	for(i = 0; i < n; i++)
+		curve[i] = (float)r[i];
+	return ST_OK;
 }
 
 /* Solve for the camera response curve.  This follows the code in Debevec's paper
- * very closely.  It uses a random set of pixels, which is not optimal, but works.
+ * very closely.  The pixels are chosen by choose_samples to cover the whole range
+ * of values in flat parts of the image.
  * An large, overconstrained system of equations is setup, including smoothing
  * constraints (controlled by lambda).  The solution is optimized in the least 
  * squares sense.  We use a slightly different weighting scheme in order to ensure
  * the matrix for the system of equations is full rank to avoid additional
  * work.  This should be fixed, but in practice doesn't really matter.
+ *
+ * Rather than building the dense (nsamples*nimages+255) x (256+nsamples)
+ * system and factoring it with QR, we accumulate its normal equations
+ * directly (see solve_channel), which takes O(nsamples*nimages^2) time and
+ * O(256^2 + nsamples) memory. The three channels are solved concurrently.
  */
 int
-CameraResponse::SolveForResponse(vector<Photo>& photos, float lambda, int nsamples) {
-	int i, j, k;
+CameraResponse::SolveForResponse(vector<Photo>& photos, float lambda, int nsamples,
+                                 unsigned int seed) {
+	int i, j;
 
 	// Get number of images
 	int nimages = (int)photos.size();
 	if (nimages < 2) return ST_ERROR;
 
-	// The number of pixel values
-	int n = NUM_RESPONSES;
-
-	// Get the image size from the first file
-	STImage* tmpimage = new STImage(photos[0].filename.c_str());
-	int width = tmpimage->GetWidth();
-	int height = tmpimage->GetHeight();
-  delete tmpimage;
-
-	// Choose sample points
+	// Choose sample points, as rows from the top of the image
 	vector<int> samples_x;
 	vector<int> samples_y;
-	for(i = 0; i < nsamples; i++) {
-		samples_x.push_back( rand() % width );
-		samples_y.push_back( rand() % height );
-	}
+	if (choose_samples(photos, nsamples, seed, samples_x, samples_y) != ST_OK)
+		return ST_ERROR;
+	nsamples = (int)samples_x.size();
+
+	// Gather the pixel values of every sample in every image, per channel.
+	// The samples are sorted by row, so each image is streamed once.
+	// Samples are moved by each photo's alignment offset.
+	vector<unsigned char> z[3];
+	vector<float> ln_shutter(nimages);
+	for(int c = 0; c < 3; c++)
+		z[c].resize(nimages*nsamples);
 
-	// Create and zero out equation matrices
-	TNT::Array2D<float> Ar(nsamples*nimages+n-1, n+nsamples, 0.f);
-	TNT::Array2D<float> Ag(nsamples*nimages+n-1, n+nsamples, 0.f);
-	TNT::Array2D<float> Ab(nsamples*nimages+n-1, n+nsamples, 0.f);
-	TNT::Array1D<float> br(nsamples*nimages+n-1, 0.f);
-	TNT::Array1D<float> bg(nsamples*nimages+n-1, 0.f);
-	TNT::Array1D<float> bb(nsamples*nimages+n-1, 0.f);
-
-	k = 0; // k will hold the index of the current equation (constraint)
-	// first we setup constraints from the image pixels, weighted appropriately
-	// these equations include the shutter times
 	for(j = 0; j < nimages; j++) {
-		STImage curimage(photos[j].filename.c_str());
+		ScanlineReader reader;
+		if (reader.Open(photos[j].filename) != ST_OK)
+			return ST_ERROR;
 		printf("Image %i...\n", j+1);
-		float ln_shutter = log(photos[j].shutter);
+		ln_shutter[j] = log(photos[j].shutter);
+		int width = reader.GetWidth();
+		int height = reader.GetHeight();
+		vector<STColor4ub> row(width);
 		for(i = 0; i < nsamples; i++) {
-			STColor4ub pixval = curimage.GetPixel(samples_x[i], samples_y[i]);
-
-			float wij_r = Weight(pixval.r);
-			Ar[k][pixval.r] = wij_r;
-			Ar[k][n+i] = -wij_r;
-			br[k] = wij_r * ln_shutter;
-
-			float wij_g = Weight(pixval.g);
-			Ag[k][pixval.g] = wij_g;
-			Ag[k][n+i] = -wij_g;
-			bg[k] = wij_g * ln_shutter;
-
-			float wij_b = Weight(pixval.b);
-			Ab[k][pixval.b] = wij_b;
-			Ab[k][n+i] = -wij_b;
-			bb[k] = wij_b * ln_shutter;
-
-			k++;
+			int x = STMin(STMax(samples_x[i] + photos[j].dx, 0), width - 1);
+			int y = STMin(STMax(samples_y[i] + photos[j].dy, 0), height - 1);
+			if (reader.GetRow() <= y) {
+				reader.SkipRows(y - reader.GetRow());
+				if (reader.ReadRows(&row[0], 1) != ST_OK)
+					return ST_ERROR;
+			}
+			STColor4ub pixval = row[x];
+			z[0][j*nsamples + i] = pixval.r;
+			z[1][j*nsamples + i] = pixval.g;
+			z[2][j*nsamples + i] = pixval.b;
 		}
 	}
 
-	// next we include the smoothness equations, these are the same for all colors
-	for(i = 0; i < n-2; i++) {
-		float w = Weight(i);
-
-		Ar[k][i] = lambda * w;
-		Ar[k][i+1] = -2 * lambda * w;
-		Ar[k][i+2] = lambda * w;
-
-		Ag[k][i] = lambda * w;
-		Ag[k][i+1] = -2 * lambda * w;
-		Ag[k][i+2] = lambda * w;
-
-		Ab[k][i] = lambda * w;
-		Ab[k][i+1] = -2 * lambda * w;
-		Ab[k][i+2] = lambda * w;
-
-		k++;
+	// report how much of each curve the samples pin down
+	int covered[3] = { 0, 0, 0 };
+	for(int c = 0; c < 3; c++) {
+		bool seen[NUM_RESPONSES] = { false };
+		for(i = 0; i < nimages*nsamples; i++)
+			seen[z[c][i]] = true;
+		for(i = 0; i < NUM_RESPONSES; i++)
+			covered[c] += seen[i];
 	}
-
-	// finally, fix the curve such that g(0) = 128, same for all curves
-	Ar[k][128] = 1;
-	Ag[k][128] = 1;
-	Ab[k][128] = 1;
-	k++;
+	printf("%i samples cover %i/%i/%i response values\n",
+	       nsamples, covered[0], covered[1], covered[2]);
 
 	// now solve the system of equations in the least squares sense
 	printf("Solving equations...\n");
-	JAMA::QR<float> solver_r(Ar);
-	JAMA::QR<float> solver_g(Ag);
-	JAMA::QR<float> solver_b(Ab);
-	if (!solver_r.isFullRank() || !solver_g.isFullRank() || !solver_b.isFullRank()) {
+	float* curves[3] = { response_r, response_g, response_b };
+	float solved[3][NUM_RESPONSES];
+	int status[3];
+
+	#pragma omp parallel for
+	for(int c = 0; c < 3; c++)
+		status[c] = solve_channel(&z[c][0], &ln_shutter[0], nimages, nsamples,
+		                          lambda, *this, solved[c]);
+
+	if (status[0] != ST_OK || status[1] != ST_OK || status[2] != ST_OK) {
 		printf("An A matrix is not full rank...\n");
-		exit(-1);
+		return ST_ERROR;
 	}
 
-	TNT::Array1D<float> g_curve_r = solver_r.solve(br);
-	TNT::Array1D<float> g_curve_g = solver_g.solve(bg);
-	TNT::Array1D<float> g_curve_b = solver_b.solve(bb);
+	// the solution holds the curve, record it into this response's arrays
+	for(int c = 0; c < 3; c++)
+		memcpy(curves[c], solved[c], NUM_RESPONSES*sizeof(float));
+	BuildTables();
 
-	// g_curve now holds the curve + the log(E) values for the samples,
-	// record the first piece into this response's arrays
-	for(i = 0; i < n; i++) {
-		response_r[i] = g_curve_r[i];
-		response_g[i] = g_curve_g[i];
-		response_b[i] = g_curve_b[i];
+	return ST_OK;
+}
+
+/* Recompute the merge and inverse lookup tables from the response curves. */
+void
+CameraResponse::BuildTables() {
+	const float* curves[3] = { response_r, response_g, response_b };
+	for(int c = 0; c < 3; c++) {
+		for(int z = 0; z < NUM_RESPONSES; z++) {
+			float w = Weight((unsigned char)z);
+			weight_table[c][z] = w;
+			wexposure_table[c][z] = w * curves[c][z];
+		}
 	}
+	BuildInverseTables();
+}
 
-	return ST_OK;
+/* Build the tables that invert the response curves. Finding the pixel
+ * value of a log exposure by linearly interpolating the curve and
+ * rounding gives z exactly when the exposure lies between the midpoints
+ *
+ *   t(z) = (g(z-1) + g(z)) / 2   and   t(z+1)
+ *
+ * so we store exp(t(z)) for every z and the pixel value is the number
+ * of thresholds at or below the exposure.
+ *
+ * To avoid a search the exposures between the first and last threshold
+ * are split into cells by the top bits of their float representation,
+ * which for positive floats is a piecewise linear log2. Each cell holds
+ * the pixel value at its lower edge, so a lookup is one shift, one table
+ * read and usually a single comparison against the next threshold. Since
+ * the exposure (irradiance * dt) is what gets looked up, the same tables
+ * serve every shutter time.
+ */
+void
+CameraResponse::BuildInverseTables() {
+	const float* curves[3] = { response_r, response_g, response_b };
+	for(int c = 0; c < 3; c++) {
+		const float* g = curves[c];
+		float* thresh = inverse_threshold[c];
+
+		// keep the thresholds increasing even if the curve is not
+		float t = -FLT_MAX;
+		thresh[0] = 0.f;
+		for(int z = 1; z < NUM_RESPONSES; z++) {
+			t = STMax(t, .5f * (g[z-1] + g[z]));
+			thresh[z] = expf(t);
+		}
+
+		int base = (int)(float_bits(thresh[1]) >> INVERSE_SHIFT);
+		int top = (int)(float_bits(thresh[NUM_RESPONSES-1]) >> INVERSE_SHIFT);
+		inverse_base[c] = base;
+		inverse_size[c] = top - base + 1;
+		inverse_table[c].resize(inverse_size[c]);
+
+		int z = 0;
+		for(int i = 0; i < inverse_size[c]; i++) {
+			unsigned int bits = (unsigned int)(base + i) << INVERSE_SHIFT;
+			float edge;
+			memcpy(&edge, &bits, sizeof(float));
+			while (z < RESPONSE_MAX && thresh[z+1] <= edge)
+				z++;
+			inverse_table[c][i] = (unsigned char)z;
+		}
+	}
 }
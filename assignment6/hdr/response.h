@@ -10,9 +10,22 @@ using namespace std;
 #define MIN_RESPONSE  0
 #define RESPONSE_MAX  255
 
+/* Number of float bits below the inverse response table index; the
+ * remaining 10 mantissa bits split every octave of exposure into 1024
+ * cells.
+ */
+#define INVERSE_SHIFT 13
+
+/* Smoothing factor and number of pixel samples used when hdr solves for
+ * a response, from -response or a batch job.
+ */
+#define RESPONSE_LAMBDA  50.f
+#define RESPONSE_SAMPLES 100
+
 typedef struct {
 	string filename;
 	float shutter;
+	int dx, dy;     // offset from the middle exposure, see AlignStack
 } Photo;
 
 int LoadHDRStack(const char* fname, vector<Photo>& stack);
@@ -37,10 +50,14 @@ public:
 
 	/* Get the camera response (i.e. resulting pixel value) given
 	 * and irradiance value and exposure time. We store the inverse
-	 * function, but its monotonic, so we can just use binary search
-	 * and linear interpolation. 
+	 * function, but its monotonic, so we can invert it with a lookup
+	 * table and linear interpolation.
 	 */
 	STColor4ub GetResponse(STColor3f& irr, float dt);
+	/* GetResponse for n irradiance values at once, e.g. a whole HDR
+	 * image, writing the pixel values to out.
+	 */
+	void GetResponses(const STColor3f* irr, int n, float dt, STColor4ub* out) const;
 
 	/* Get the exposure value (i.e. irradiance * dt) given the camera
 	 * response.  This is just a lookup since this is the function
@@ -55,19 +72,65 @@ public:
 	STColor3f Weight(STColor4ub& pval);
 
 	/* Given a stack of images, a smoothing factor, and a number of pixel samples
-	 * to use, solve for the camera response curve.
+	 * to use, solve for the camera response curve. The samples are spread
+	 * over the whole range of pixel values; the same seed always picks the
+	 * same samples. Returns ST_ERROR if the curve can't be solved for, as
+	 * when every photo has the same shutter time.
+	 */
+	int SolveForResponse(vector<Photo>& photos, float lambda, int nsamples,
+	                     unsigned int seed = 1);
+
+	/* Per-channel lookup tables for merging exposures: for every 8-bit
+	 * value z, the weight w(z) and the weighted log exposure w(z)*g(z).
+	 * They are rebuilt whenever the curve changes, so merging a pixel
+	 * takes only table lookups. Channels are 0 (r), 1 (g) and 2 (b).
 	 */
-	int SolveForResponse(vector<Photo>& photos, float lambda, int nsamples);
+	const float* GetWeightTable(int channel) const { return weight_table[channel]; }
+	const float* GetWeightedExposureTable(int channel) const { return wexposure_table[channel]; }
 private:
-	/* Binary search to find the index of the value in the array.
-	 * We use linear interpolation and round since some values
-	 * will fall between indices.
+	/* Recompute the merge lookup tables from the response curves. */
+	void BuildTables();
+
+	/* Recompute the inverse response tables from the response curves. */
+	void BuildInverseTables();
+
+	/* Find the pixel value of a linear exposure (irradiance * dt) in
+	 * channel c. Equivalent to linearly interpolating the inverse curve
+	 * and rounding.
+	 */
+	unsigned char inverse_lookup(int c, float exposure) const;
+	/* Step a table guess z to the pixel value whose threshold range
+	 * holds exposure.
 	 */
-	unsigned char binary_search(float* rsp, float val);
+	unsigned char inverse_fixup(int c, int z, float exposure) const {
+		const float* thresh = inverse_threshold[c];
+		while (z < RESPONSE_MAX && exposure >= thresh[z+1])
+			z++;
+		while (z > MIN_RESPONSE && exposure < thresh[z])
+			z--;
+		return (unsigned char)z;
+	}
+	static unsigned int float_bits(float f) {
+		unsigned int bits;
+		memcpy(&bits, &f, sizeof(bits));
+		return bits;
+	}
 
 	float response_r[NUM_RESPONSES];
 	float response_g[NUM_RESPONSES];
 	float response_b[NUM_RESPONSES];
+
+	float weight_table[3][NUM_RESPONSES];
+	float wexposure_table[3][NUM_RESPONSES];
+
+	/* Inverse response: per channel, the exposure at which each pixel
+	 * value starts, and a table of pixel values indexed by the top bits
+	 * of the exposure's float representation (minus inverse_base).
+	 */
+	float inverse_threshold[3][NUM_RESPONSES];
+	vector<unsigned char> inverse_table[3];
+	int inverse_base[3];
+	int inverse_size[3];
 };
 
 #endif //__CAMERARESPONSE_H__
@@ -0,0 +1,235 @@
+#include "scanline.h"
+#include "stdio.h"
+
+extern "C" {
+#include <jpeglib.h>
+}
+#include <png.h>
+#include <setjmp.h>   // must follow png.h
+#include <vector>
+#include <algorithm>
+
+enum {
+	DECODER_JPEG,
+	DECODER_PNG
+};
+
+/* Per-file decoder state. libjpeg and libpng report errors by
+ * longjmp'ing out, so every call into them is guarded by a setjmp
+ * on the jump buffer stored here.
+ */
+struct ScanlineDecoder {
+	int type;
+	FILE* fin;
+
+	jpeg_decompress_struct cinfo;
+	jpeg_error_mgr jerr;
+	jmp_buf jmpbuf;
+
+	png_structp png;
+	png_infop info;
+
+	int components;
+	vector<unsigned char> buffer;
+};
+
+static void
+jpeg_error_exit(j_common_ptr cinfo) {
+	(*cinfo->err->output_message)(cinfo);
+	ScanlineDecoder* d = (ScanlineDecoder*)cinfo->client_data;
+	longjmp(d->jmpbuf, 1);
+}
+
+static void
+destroy_decoder(ScanlineDecoder* d) {
+	if (d->type == DECODER_JPEG)
+		jpeg_destroy_decompress(&d->cinfo);
+	else
+		png_destroy_read_struct(&d->png, &d->info, NULL);
+	fclose(d->fin);
+	delete d;
+}
+
+/* Set up libjpeg to decode scanlines of fin. */
+static ScanlineDecoder*
+open_jpeg(FILE* fin, int& width, int& height) {
+	ScanlineDecoder* d = new ScanlineDecoder;
+	d->type = DECODER_JPEG;
+	d->fin = fin;
+	d->cinfo.err = jpeg_std_error(&d->jerr);
+	d->jerr.error_exit = jpeg_error_exit;
+	jpeg_create_decompress(&d->cinfo);
+	d->cinfo.client_data = d;
+	if (setjmp(d->jmpbuf)) {
+		destroy_decoder(d);
+		return NULL;
+	}
+
+	jpeg_stdio_src(&d->cinfo, fin);
+	jpeg_read_header(&d->cinfo, TRUE);
+	jpeg_start_decompress(&d->cinfo);
+
+	width = d->cinfo.output_width;
+	height = d->cinfo.output_height;
+	d->components = d->cinfo.output_components;
+	d->buffer.resize(width * d->components);
+	return d;
+}
+
+/* Set up libpng to decode rows of fin as 8-bit RGBA. Interlaced
+ * files can't be streamed a row at a time, so those return NULL
+ * and are loaded whole instead.
+ */
+static ScanlineDecoder*
+open_png(FILE* fin, int& width, int& height) {
+	ScanlineDecoder* d = new ScanlineDecoder;
+	d->type = DECODER_PNG;
+	d->fin = fin;
+	d->png = png_create_read_struct(PNG_LIBPNG_VER_STRING, NULL, NULL, NULL);
+	d->info = d->png ? png_create_info_struct(d->png) : NULL;
+	if (d->info == NULL || setjmp(png_jmpbuf(d->png))) {
+		destroy_decoder(d);
+		return NULL;
+	}
+
+	png_init_io(d->png, fin);
+	png_read_info(d->png, d->info);
+	if (png_get_interlace_type(d->png, d->info) != PNG_INTERLACE_NONE) {
+		destroy_decoder(d);
+		return NULL;
+	}
+
+	png_set_expand(d->png);
+	png_set_strip_16(d->png);
+	png_set_packing(d->png);
+	png_set_gray_to_rgb(d->png);
+	png_set_filler(d->png, 0xff, PNG_FILLER_AFTER);
+	png_read_update_info(d->png, d->info);
+
+	width = png_get_image_width(d->png, d->info);
+	height = png_get_image_height(d->png, d->info);
+	d->components = 4;
+	return d;
+}
+
+ScanlineReader::ScanlineReader()
+	: decoder(NULL), image(NULL), width(0), height(0), row(0) {
+}
+
+ScanlineReader::~ScanlineReader() {
+	Close();
+}
+
+/* Open an image file and read its header. */
+int
+ScanlineReader::Open(const string& fname) {
+	Close();
+
+	string ext = STGetExtension(fname);
+	if (ext == "JPG" || ext == "JPEG" || ext == "PNG") {
+		FILE* fin = fopen(fname.c_str(), "rb");
+		if (fin == NULL) {
+			printf("Error opening file: %s\n", fname.c_str());
+			return ST_ERROR;
+		}
+		if (ext == "PNG")
+			decoder = open_png(fin, width, height);
+		else
+			decoder = open_jpeg(fin, width, height);
+		if (decoder == NULL && ext != "PNG") {
+			printf("Error reading file: %s\n", fname.c_str());
+			return ST_ERROR;
+		}
+	}
+
+	if (decoder == NULL) {
+		try {
+			image = new STImage(fname);
+		}
+		catch (...) {
+			printf("Error reading file: %s\n", fname.c_str());
+			return ST_ERROR;
+		}
+		width = image->GetWidth();
+		height = image->GetHeight();
+	}
+
+	row = 0;
+	return ST_OK;
+}
+
+/* Release the decoder and close the file. */
+void
+ScanlineReader::Close() {
+	if (decoder) {
+		destroy_decoder(decoder);
+		decoder = NULL;
+	}
+	if (image) {
+		delete image;
+		image = NULL;
+	}
+	width = height = row = 0;
+}
+
+/* Decode the next nrows rows into rows. */
+int
+ScanlineReader::ReadRows(STColor4ub* rows, int nrows) {
+	if (row + nrows > height)
+		return ST_ERROR;
+
+	if (image) {
+		for (int i = 0; i < nrows; i++, row++) {
+			const STColor4ub* src = image->GetPixels() + (size_t)(height-row-1)*width;
+			std::copy(src, src + width, rows + (size_t)i*width);
+		}
+		return ST_OK;
+	}
+
+	if (decoder->type == DECODER_JPEG) {
+		unsigned char* buf = &decoder->buffer[0];
+		if (setjmp(decoder->jmpbuf))
+			return ST_ERROR;
+		for (int i = 0; i < nrows; i++, row++) {
+			JSAMPROW scanline = buf;
+			jpeg_read_scanlines(&decoder->cinfo, &scanline, 1);
+			STColor4ub* dst = rows + i*width;
+			if (decoder->components == 3) {
+				for (int x = 0; x < width; x++)
+					dst[x] = STColor4ub(buf[3*x], buf[3*x+1], buf[3*x+2], 255);
+			}
+			else {
+				for (int x = 0; x < width; x++)
+					dst[x] = STColor4ub(buf[x], buf[x], buf[x], 255);
+			}
+		}
+	}
+	else {
+		if (setjmp(png_jmpbuf(decoder->png)))
+			return ST_ERROR;
+		for (int i = 0; i < nrows; i++, row++) {
+			// rows are already expanded to RGBA, decode in place
+			png_read_row(decoder->png, (png_bytep)(rows + i*width), NULL);
+		}
+	}
+
+	return ST_OK;
+}
+
+/* Decode and throw away the next nrows rows. */
+int
+ScanlineReader::SkipRows(int nrows) {
+	if (image) {
+		if (row + nrows > height)
+			return ST_ERROR;
+		row += nrows;
+		return ST_OK;
+	}
+
+	vector<STColor4ub> tmp(width);
+	for (int i = 0; i < nrows; i++) {
+		if (ReadRows(&tmp[0], 1) != ST_OK)
+			return ST_ERROR;
+	}
+	return ST_OK;
+}
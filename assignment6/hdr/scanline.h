@@ -0,0 +1,50 @@
+#ifndef __SCANLINE_H__
+#define __SCANLINE_H__
+
+#include "st.h"
+#include <string>
+using namespace std;
+
+struct ScanlineDecoder;
+
+/* ScanlineReader - streams the rows of an 8-bit image file from the top
+ * of the image to the bottom without holding the whole image in memory.
+ * JPEG and non-interlaced PNG files are decoded incrementally, anything
+ * else is loaded with STImage and handed out a row at a time.
+ *
+ * Rows are returned as RGBA pixels in file order, so the first row read
+ * is the row STImage would store at y = height-1.
+ */
+class ScanlineReader {
+public:
+	ScanlineReader();
+	~ScanlineReader();
+
+	/* Open an image file and read its header. */
+	int Open(const string& fname);
+	/* Release the decoder and close the file. */
+	void Close();
+
+	int GetWidth() const { return width; }
+	int GetHeight() const { return height; }
+	/* Index of the next row ReadRows will return (0 is the top row). */
+	int GetRow() const { return row; }
+
+	/* Decode the next nrows rows into rows, which must hold
+	 * nrows*GetWidth() pixels.
+	 */
+	int ReadRows(STColor4ub* rows, int nrows);
+	/* Decode and throw away the next nrows rows. */
+	int SkipRows(int nrows);
+
+private:
+	ScanlineReader(const ScanlineReader&);
+	ScanlineReader& operator=(const ScanlineReader&);
+
+	ScanlineDecoder* decoder;
+	STImage* image;   // fallback for formats without a streaming decoder
+	int width, height;
+	int row;
+};
+
+#endif //__SCANLINE_H__
@@ -4,6 +4,16 @@
 #include "tnt_array1d.h"
 #include "tnt_array2d.h"
 #include "tnt_math_utils.h"
+#include "tnt_kernels.h"
+
+/* Columns factored together and applied as one block reflector. */
+#ifndef JAMA_QR_BLOCK
+#define JAMA_QR_BLOCK 32
+#endif
+/* Columns of the trailing matrix updated together by one thread. */
+#ifndef JAMA_QR_STRIP
+#define JAMA_QR_STRIP 128
+#endif
 
 namespace JAMA
 {
@@ -52,28 +62,38 @@ class QR {
    */
    TNT::Array1D<Real> Rdiag;
 
+   /** Triangular factors of the blocked reflectors: for the block of
+   columns k0..k0+kb-1, H(k0)...H(k0+kb-1) = I - V T V', with V the
+   Householder vectors of the block and T stored in columns k0..k0+kb-1
+   of T_.
+   */
+   TNT::Array2D<Real> T_;
 
-public:
-	
-/**
-	Create a QR factorization object for A.
 
-	@param A rectangular (m>=n) matrix.
-*/
-	QR(const TNT::Array2D<Real> &A)		/* constructor */
-	{
-      QR_ = A.copy();
-      m = A.dim1();
-      n = A.dim2();
-      Rdiag = TNT::Array1D<Real>(n);
-	  int i=0, j=0, k=0;
-
-      // Main loop.
-      for (k = 0; k < n; k++) {
-         // Compute 2-norm of k-th column without under/overflow.
+   /* Factor the columns k0..k0+kb-1 (the panel) the classical way,
+      updating only the rest of the panel. Rows are contiguous, so the
+      updates of all remaining panel columns are done a row at a time.
+   */
+   void factor_panel(int k0, int kb)
+   {
+      TNT::Array1D<Real> s(kb);
+      for (int k = k0; k < k0+kb; k++) {
+         // 2-norm of the k-th column, scaled by its largest entry
+         // to avoid under/overflow
+         Real scale = 0;
+         for (int i = k; i < m; i++) {
+            Real a = QR_[i][k] < 0 ? -QR_[i][k] : QR_[i][k];
+            if (a > scale)
+               scale = a;
+         }
          Real nrm = 0;
-         for (i = k; i < m; i++) {
-            nrm = TNT::hypot(nrm,QR_[i][k]);
+         if (scale != 0) {
+            Real inv = 1 / scale, sum = 0;
+            for (int i = k; i < m; i++) {
+               Real a = QR_[i][k] * inv;
+               sum += a*a;
+            }
+            nrm = scale * sqrt(sum);
          }
 
          if (nrm != 0.0) {
@@ -81,27 +101,133 @@ public:
             if (QR_[k][k] < 0) {
                nrm = -nrm;
             }
-            for (i = k; i < m; i++) {
-               QR_[i][k] /= nrm;
+            Real inv = 1 / nrm;
+            for (int i = k; i < m; i++) {
+               QR_[i][k] *= inv;
             }
             QR_[k][k] += 1.0;
 
-            // Apply transformation to remaining columns.
-            for (j = k+1; j < n; j++) {
-               Real s = 0.0; 
-               for (i = k; i < m; i++) {
-                  s += QR_[i][k]*QR_[i][j];
-               }
-               s = -s/QR_[k][k];
-               for (i = k; i < m; i++) {
-                  QR_[i][j] += s*QR_[i][k];
-               }
+            // Apply transformation to remaining columns of the panel.
+            int rest = k0+kb - (k+1);
+            if (rest > 0) {
+               s = Real(0);
+               for (int i = k; i < m; i++)
+                  TNT::axpy(rest, QR_[i][k], QR_[i]+k+1, &s[0]);
+               TNT::scal(rest, -1/QR_[k][k], &s[0]);
+               for (int i = k; i < m; i++)
+                  TNT::axpy(rest, QR_[i][k], &s[0], QR_[i]+k+1);
             }
          }
          Rdiag[k] = -nrm;
       }
    }
 
+   /* Build T for the block at k0 (LAPACK's dlarft): each reflector is
+      I - tau v v' with tau = 1/v_k, and
+      T(0:j,j) = -tau_j T(0:j,0:j) V(:,0:j)' v_j.
+   */
+   void build_T(int k0, int kb)
+   {
+      TNT::Array1D<Real> z(kb);
+      for (int j = 0; j < kb; j++) {
+         int k = k0 + j;
+         Real tau = (Rdiag[k] != 0) ? 1/QR_[k][k] : 0;
+         T_[j][k] = tau;
+         if (j == 0)
+            continue;
+         z = Real(0);
+         for (int i = k; i < m; i++)
+            TNT::axpy(j, QR_[i][k], QR_[i]+k0, &z[0]);
+         for (int i = 0; i < j; i++) {
+            Real t = 0;
+            for (int l = i; l < j; l++)
+               t += T_[i][k0+l] * z[l];
+            T_[i][k] = -tau * t;
+         }
+      }
+   }
+
+   /* Apply (H(k0)...H(k0+kb-1))' = I - V T' V' to columns j0..j0+w-1
+      of the rows k0..m-1 of X, a row-major array with row stride ldx
+      starting at row 0. W must hold kb*w values.
+   */
+   void apply_block(int k0, int kb, Real *X, int ldx, int j0, int w, Real *W) const
+   {
+      int p, i;
+      for (p = 0; p < kb*w; p++)
+         W[p] = 0;
+      // W = V' X; row i of V is nonzero in its first i-k0+1 entries
+      for (i = k0; i < m; i++) {
+         const Real *v = QR_[i] + k0;
+         const Real *x = X + i*ldx + j0;
+         int np = (i-k0+1 < kb) ? i-k0+1 : kb;
+         for (p = 0; p < np; p++)
+            TNT::axpy(w, v[p], x, W + p*w);
+      }
+      // W = T' W, bottom up since T' is lower triangular
+      for (p = kb-1; p >= 0; p--) {
+         TNT::scal(w, T_[p][k0+p], W + p*w);
+         for (int l = 0; l < p; l++)
+            TNT::axpy(w, T_[l][k0+p], W + l*w, W + p*w);
+      }
+      // X -= V W
+      for (i = k0; i < m; i++) {
+         const Real *v = QR_[i] + k0;
+         Real *x = X + i*ldx + j0;
+         int np = (i-k0+1 < kb) ? i-k0+1 : kb;
+         for (p = 0; p < np; p++)
+            TNT::axpy(w, -v[p], W + p*w, x);
+      }
+   }
+
+   /* Apply the block at k0 to columns c0..c0+nc-1 of X, split into
+      strips of columns that are updated in parallel.
+   */
+   void apply_block_parallel(int k0, int kb, Real *X, int ldx, int c0, int nc) const
+   {
+      int nstrips = (nc + JAMA_QR_STRIP - 1) / JAMA_QR_STRIP;
+      #pragma omp parallel
+      {
+         TNT::Array1D<Real> W(kb * JAMA_QR_STRIP);
+         #pragma omp for schedule(dynamic)
+         for (int s = 0; s < nstrips; s++) {
+            int j0 = c0 + s*JAMA_QR_STRIP;
+            int w = (c0+nc - j0 < JAMA_QR_STRIP) ? c0+nc - j0 : JAMA_QR_STRIP;
+            apply_block(k0, kb, X, ldx, j0, w, &W[0]);
+         }
+      }
+   }
+
+
+public:
+	
+/**
+	Create a QR factorization object for A.
+
+	The factorization is blocked: JAMA_QR_BLOCK columns at a time are
+	factored as a panel, and their reflectors are then applied to the
+	rest of the matrix at once as I - V T V' (the compact WY form),
+	with the columns split across threads.
+
+	@param A rectangular (m>=n) matrix.
+*/
+	QR(const TNT::Array2D<Real> &A)		/* constructor */
+	{
+      QR_ = A.copy();
+      m = A.dim1();
+      n = A.dim2();
+      Rdiag = TNT::Array1D<Real>(n);
+      T_ = TNT::Array2D<Real>(JAMA_QR_BLOCK, n, Real(0));
+
+      for (int k0 = 0; k0 < n; k0 += JAMA_QR_BLOCK) {
+         int kb = (n - k0 < JAMA_QR_BLOCK) ? n - k0 : JAMA_QR_BLOCK;
+         factor_panel(k0, kb);
+         build_T(k0, kb);
+         if (k0 + kb < n)
+            apply_block_parallel(k0, kb, QR_[0], QR_.stride(), k0+kb, n - (k0+kb));
+      }
+   }
+
 
 /**
 	Flag to denote the matrix is of full rank.
@@ -226,27 +352,16 @@ public:
 
 	  TNT::Array1D<Real> x = b.copy();
 
-      // Compute Y = transpose(Q)*b
-      for (int k = 0; k < n; k++) 
-	  {
-            Real s = 0.0; 
-            for (int i = k; i < m; i++) 
-			{
-               s += QR_[i][k]*x[i];
-            }
-            s = -s/QR_[k][k];
-            for (int i = k; i < m; i++) 
-			{
-               x[i] += s*QR_[i][k];
-            }
+      // Compute Y = transpose(Q)*b, a block of reflectors at a time
+      TNT::Array1D<Real> w(JAMA_QR_BLOCK);
+      for (int k0 = 0; k0 < n; k0 += JAMA_QR_BLOCK) {
+         int kb = (n - k0 < JAMA_QR_BLOCK) ? n - k0 : JAMA_QR_BLOCK;
+         apply_block(k0, kb, &x[0], 1, 0, 1, &w[0]);
       }
-      // Solve R*X = Y;
+      // Solve R*X = Y by rows, R is stored above the diagonal of QR_
       for (int k = n-1; k >= 0; k--) 
 	  {
-         x[k] /= Rdiag[k];
-         for (int i = 0; i < k; i++) {
-               x[i] -= x[k]*QR_[i][k];
-         }
+         x[k] = (x[k] - TNT::dot(n-1-k, QR_[k]+k+1, &x[k+1])) / Rdiag[k];
       }
 
 
@@ -280,27 +395,21 @@ public:
 	  int i=0, j=0, k=0;
 
       // Compute Y = transpose(Q)*B
-      for (k = 0; k < n; k++) {
-         for (j = 0; j < nx; j++) {
-            Real s = 0.0; 
-            for (i = k; i < m; i++) {
-               s += QR_[i][k]*X[i][j];
-            }
-            s = -s/QR_[k][k];
-            for (i = k; i < m; i++) {
-               X[i][j] += s*QR_[i][k];
-            }
-         }
+      for (k = 0; k < n; k += JAMA_QR_BLOCK) {
+         int kb = (n - k < JAMA_QR_BLOCK) ? n - k : JAMA_QR_BLOCK;
+         apply_block_parallel(k, kb, X[0], X.stride(), 0, nx);
       }
-      // Solve R*X = Y;
-      for (k = n-1; k >= 0; k--) {
-         for (j = 0; j < nx; j++) {
-            X[k][j] /= Rdiag[k];
-         }
-         for (i = 0; i < k; i++) {
-            for (j = 0; j < nx; j++) {
-               X[i][j] -= X[k][j]*QR_[i][k];
-            }
+      // Solve R*X = Y, a strip of columns per thread
+      int nstrips = (nx + JAMA_QR_STRIP - 1) / JAMA_QR_STRIP;
+      #pragma omp parallel for schedule(dynamic)
+      for (int s = 0; s < nstrips; s++) {
+         int j0 = s*JAMA_QR_STRIP;
+         int w = (nx - j0 < JAMA_QR_STRIP) ? nx - j0 : JAMA_QR_STRIP;
+         for (int r = n-1; r >= 0; r--) {
+            Real *xr = X[r] + j0;
+            for (int c = r+1; c < n; c++)
+               TNT::axpy(w, -QR_[r][c], X[c] + j0, xr);
+            TNT::scal(w, 1/Rdiag[r], xr);
          }
       }
 
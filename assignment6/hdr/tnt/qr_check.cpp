@@ -0,0 +1,125 @@
+/* Least-squares checks for the blocked JAMA::QR, run by "make check".
+ *
+ * Nothing in hdr uses TNT at the moment, so this is what keeps the
+ * blocked factorization and its kernels honest. Every system has a
+ * known solution: a textbook line fit, and consistent overdetermined
+ * systems A x = A x0, whose least-squares solution is x0, with enough
+ * columns to take several panels (JAMA_QR_BLOCK) and strips
+ * (JAMA_QR_STRIP), and sizes that don't divide evenly into either.
+ */
+#include "jama_qr.h"
+#include <stdio.h>
+#include <math.h>
+
+using namespace TNT;
+
+static int failures = 0;
+
+static void
+check(bool ok, const char* what) {
+	printf("%s: %s\n", ok ? "ok" : "FAILED", what);
+	if (!ok)
+		failures++;
+}
+
+/* Deterministic values in [-1, 1). */
+static double
+next_random(unsigned int& state) {
+	state = state * 1664525u + 1013904223u;
+	return (state >> 8) / (double)(1 << 23) - 1.0;
+}
+
+/* Fit b = c + d t to (0, 6), (1, 0), (2, 0): the best line is 5 - 3t. */
+static void
+check_line_fit() {
+	Array2D<double> A(3, 2);
+	Array1D<double> b(3);
+	for (int i = 0; i < 3; i++) {
+		A[i][0] = 1.0;
+		A[i][1] = i;
+		b[i] = (i == 0) ? 6.0 : 0.0;
+	}
+	Array1D<double> x = JAMA::QR<double>(A).solve(b);
+	check(x.dim() == 2 && fabs(x[0] - 5.0) < 1e-12 && fabs(x[1] + 3.0) < 1e-12,
+	      "3x2 line fit");
+}
+
+/* Solve A X = A X0 for a random m x n A and n x k X0, and compare the
+ * solution to X0, relative to its largest value.
+ */
+template <class Real>
+static void
+check_consistent(int m, int n, int k, double tolerance) {
+	unsigned int state = m * 7919u + n * 31u + k;
+	Array2D<Real> A(m, n);
+	Array2D<Real> X0(n, k);
+	for (int i = 0; i < m; i++)
+		for (int j = 0; j < n; j++)
+			A[i][j] = (Real)next_random(state);
+	for (int i = 0; i < n; i++)
+		for (int j = 0; j < k; j++)
+			X0[i][j] = (Real)next_random(state);
+
+	Array2D<Real> B(m, k, (Real)0);
+	for (int i = 0; i < m; i++)
+		for (int l = 0; l < n; l++)
+			for (int j = 0; j < k; j++)
+				B[i][j] += A[i][l] * X0[l][j];
+
+	JAMA::QR<Real> qr(A);
+	Array2D<Real> X = qr.solve(B);
+	double error = (X.dim1() == n && X.dim2() == k) ? 0.0 : HUGE_VAL;
+	for (int i = 0; i < X.dim1() && i < n; i++)
+		for (int j = 0; j < X.dim2() && j < k; j++)
+			error = fmax(error, fabs((double)X[i][j] - (double)X0[i][j]));
+
+	// the vector solve goes through its own path
+	Array1D<Real> b(m);
+	for (int i = 0; i < m; i++)
+		b[i] = B[i][0];
+	Array1D<Real> x = qr.solve(b);
+	if (x.dim() != n)
+		error = HUGE_VAL;
+	for (int i = 0; i < x.dim() && i < n; i++)
+		error = fmax(error, fabs((double)x[i] - (double)X0[i][0]));
+
+	char what[128];
+	snprintf(what, sizeof(what), "%dx%d %s, %d right-hand sides (error %g)",
+	         m, n, sizeof(Real) == sizeof(float) ? "float" : "double", k, error);
+	check(error < tolerance, what);
+}
+
+/* isFullRank() looks for an exactly zero diagonal of R, which a zero
+ * column gives; such a matrix has no solution to return.
+ */
+static void
+check_rank_deficient() {
+	Array2D<double> A(40, 3);
+	Array1D<double> b(40, 1.0);
+	unsigned int state = 1;
+	for (int i = 0; i < 40; i++) {
+		A[i][0] = next_random(state);
+		A[i][1] = next_random(state);
+		A[i][2] = 0.0;
+	}
+	JAMA::QR<double> qr(A);
+	check(!qr.isFullRank() && qr.solve(b).dim() == 0, "rank-deficient 40x3");
+}
+
+int
+main() {
+	check_line_fit();
+	check_consistent<double>(10, 3, 1, 1e-12);
+	check_consistent<double>(200, JAMA_QR_BLOCK, 2, 1e-10);
+	check_consistent<double>(300, 3*JAMA_QR_BLOCK + 5, 3, 1e-9);
+	check_consistent<double>(700, JAMA_QR_STRIP + JAMA_QR_BLOCK + 7, 2, 1e-9);
+	check_consistent<float>(300, 2*JAMA_QR_BLOCK + 3, 2, 1e-2);
+	check_rank_deficient();
+
+	if (failures > 0) {
+		printf("%d check(s) failed\n", failures);
+		return 1;
+	}
+	printf("all checks passed\n");
+	return 0;
+}
@@ -33,6 +33,13 @@
 namespace TNT
 {
 
+/*
+	Elements are stored row by row in one contiguous, aligned block
+	(see TNT_ALIGNMENT), and row i starts i*stride() elements after
+	row 0. The stride is the row length, except in a subarray where it
+	is the row length of the parent. operator T**() builds a table of
+	row pointers the first time it is needed.
+*/
 template <class T>
 class Array2D 
 {
@@ -43,9 +50,13 @@ class Array2D
 
 
   	Array1D<T> data_;
-	Array1D<T*> v_;
+	T* base_;
 	int m_;
     int n_;
+	int stride_;
+	Array1D<T*> v_;		/* row pointers for operator T**, built on demand */
+
+	inline T** row_pointers_();
 
   public:
 
@@ -74,66 +85,49 @@ class Array2D
 	inline int ref_count();
 	inline int ref_count_data();
 	inline int ref_count_dim1();
+	inline int stride() const;
 	Array2D subarray(int i0, int i1, int j0, int j1);
 
 };
 
 
 template <class T>
-Array2D<T>::Array2D() : data_(), v_(), m_(0), n_(0) {} 
+Array2D<T>::Array2D() : data_(), base_(0), m_(0), n_(0), stride_(0), v_() {} 
 
 template <class T>
-Array2D<T>::Array2D(const Array2D<T> &A) : data_(A.data_), v_(A.v_), 
-	m_(A.m_), n_(A.n_) {}
+Array2D<T>::Array2D(const Array2D<T> &A) : data_(A.data_), base_(A.base_), 
+	m_(A.m_), n_(A.n_), stride_(A.stride_), v_() {}
 
 
 
 
 template <class T>
-Array2D<T>::Array2D(int m, int n) : data_(m*n), v_(m), m_(m), n_(n)
+Array2D<T>::Array2D(int m, int n) : data_(m*n), base_(0), m_(m), n_(n),
+	stride_(n), v_()
 {
 	if (m>0 && n>0)
-	{
-		T* p = &(data_[0]);
-		for (int i=0; i<m; i++)
-		{
-			v_[i] = p;
-			p += n;
-		}
-	}
+		base_ = &(data_[0]);
 }
 
 
 
 template <class T>
-Array2D<T>::Array2D(int m, int n, const T &val) : data_(m*n), v_(m), 
-													m_(m), n_(n) 
+Array2D<T>::Array2D(int m, int n, const T &val) : data_(m*n), base_(0),
+													m_(m), n_(n), stride_(n), v_()
 {
   if (m>0 && n>0)
   {
 	data_ = val;
-	T* p  = &(data_[0]);
-	for (int i=0; i<m; i++)
-	{
-			v_[i] = p;
-			p += n;
-	}
+	base_ = &(data_[0]);
   }
 }
 
 template <class T>
-Array2D<T>::Array2D(int m, int n, T *a) : data_(m*n, a), v_(m), m_(m), n_(n)
+Array2D<T>::Array2D(int m, int n, T *a) : data_(m*n, a), base_(0), m_(m), n_(n),
+	stride_(n), v_()
 {
   if (m>0 && n>0)
-  {
-	T* p = &(data_[0]);
-	
-	for (int i=0; i<m; i++)
-	{
-			v_[i] = p;
-			p += n;
-	}
-  }
+	base_ = &(data_[0]);
 }
 
 
@@ -145,7 +139,7 @@ inline T* Array2D<T>::operator[](int i)
 	assert(i < m_);
 #endif
 
-return v_[i]; 
+return base_ + i*stride_; 
 
 }
 
@@ -158,7 +152,7 @@ inline const T* Array2D<T>::operator[](int i) const
 	assert(i < m_);
 #endif
 
-return v_[i]; 
+return base_ + i*stride_; 
 
 }
 
@@ -168,8 +162,11 @@ Array2D<T> & Array2D<T>::operator=(const T &a)
 	/* non-optimzied, but will work with subarrays in future verions */
 
 	for (int i=0; i<m_; i++)
+	{
+		T* row = (*this)[i];
 		for (int j=0; j<n_; j++)
-		v_[i][j] = a;
+			row[j] = a;
+	}
 	return *this;
 }
 
@@ -182,8 +179,12 @@ Array2D<T> Array2D<T>::copy() const
 	Array2D A(m_, n_);
 
 	for (int i=0; i<m_; i++)
+	{
+		const T* row = (*this)[i];
+		T* dst = A[i];
 		for (int j=0; j<n_; j++)
-			A[i][j] = v_[i][j];
+			dst[j] = row[j];
+	}
 
 
 	return A;
@@ -196,8 +197,12 @@ Array2D<T> & Array2D<T>::inject(const Array2D &A)
 	if (A.m_ == m_ &&  A.n_ == n_)
 	{
 		for (int i=0; i<m_; i++)
+		{
+			const T* row = A[i];
+			T* dst = (*this)[i];
 			for (int j=0; j<n_; j++)
-				v_[i][j] = A[i][j];
+				dst[j] = row[j];
+		}
 	}
 	return *this;
 }
@@ -210,10 +215,12 @@ Array2D<T> & Array2D<T>::ref(const Array2D<T> &A)
 {
 	if (this != &A)
 	{
-		v_ = A.v_;
 		data_ = A.data_;
+		base_ = A.base_;
 		m_ = A.m_;
 		n_ = A.n_;
+		stride_ = A.stride_;
+		v_ = Array1D<T*>();
 		
 	}
 	return *this;
@@ -241,14 +248,26 @@ Array2D<T>::~Array2D() {}
 
 
 template <class T>
-inline Array2D<T>::operator T**()
+inline T** Array2D<T>::row_pointers_()
 {
+	if (v_.dim1() != m_)
+	{
+		v_ = Array1D<T*>(m_);
+		for (int i=0; i<m_; i++)
+			v_[i] = base_ + i*stride_;
+	}
 	return &(v_[0]);
 }
+
+template <class T>
+inline Array2D<T>::operator T**()
+{
+	return row_pointers_();
+}
 template <class T>
 inline Array2D<T>::operator const T**()
 {
-	return &(v_[0]);
+	return (const T**) row_pointers_();
 }
 
 /* ............... extended interface ............... */
@@ -273,15 +292,10 @@ Array2D<T> Array2D<T>::subarray(int i0, int i1, int j0, int j1)
 		return A;
 
 	A.data_ = data_;
+	A.base_ = base_ + i0*stride_ + j0;
 	A.m_ = m;
 	A.n_ = n;
-	A.v_ = Array1D<T*>(m);
-	T* p = &(data_[0]) + i0 *  n_ + j0;
-	for (int i=0; i<m; i++)
-	{
-		A.v_[i] = p + i*n_;
-
-	}	
+	A.stride_ = stride_;
 	return A;
 }
 
@@ -302,7 +316,13 @@ inline int Array2D<T>::ref_count_data()
 template <class T>
 inline int Array2D<T>::ref_count_dim1()
 {
-	return v_.ref_count();
+	return data_.ref_count();
+}
+
+template <class T>
+inline int Array2D<T>::stride() const
+{
+	return stride_;
 }
 
 
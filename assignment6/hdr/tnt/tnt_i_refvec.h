@@ -24,6 +24,7 @@
 
 #include <cstdlib>
 #include <iostream>
+#include <new>
 
 #ifdef TNT_BOUNDS_CHECK
 #include <assert.h>
@@ -33,6 +34,13 @@
 #define NULL 0
 #endif
 
+/* Arrays allocated by TNT start on a multiple of this many bytes, a
+   cache line, so that rows can be streamed with aligned vector loads.
+*/
+#ifndef TNT_ALIGNMENT
+#define TNT_ALIGNMENT 64
+#endif
+
 namespace TNT
 {
 /*
@@ -59,6 +67,8 @@ class i_refvec
   private:
     T* data_;                  
     int *ref_count_;
+    char* block_;              /* allocation holding data_, aligned inside */
+    int n_;
 
 
   public:
@@ -89,20 +99,27 @@ void i_refvec<T>::copy_(T* p, const T* q, const T* e)
 }
 
 template <class T>
-i_refvec<T>::i_refvec() : data_(NULL), ref_count_(NULL) {}
+i_refvec<T>::i_refvec() : data_(NULL), ref_count_(NULL), block_(NULL), n_(0) {}
 
 /**
 	In case n is 0 or negative, it does NOT call new. 
+	The elements are placed at the first TNT_ALIGNMENT boundary
+	of the allocation.
 */
 template <class T>
-i_refvec<T>::i_refvec(int n) : data_(NULL), ref_count_(NULL)
+i_refvec<T>::i_refvec(int n) : data_(NULL), ref_count_(NULL), block_(NULL), n_(0)
 {
 	if (n >= 1)
 	{
 #ifdef TNT_DEBUG
 		std::cout  << "new data storage.\n";
 #endif
-		data_ = new T[n];
+		block_ = new char[n * sizeof(T) + TNT_ALIGNMENT];
+		size_t offset = TNT_ALIGNMENT - ((size_t) block_ % TNT_ALIGNMENT);
+		data_ = (T*) (block_ + offset);
+		for (int i=0; i<n; i++)
+			new (data_ + i) T;
+		n_ = n;
 		ref_count_ = new int;
 		*ref_count_ = 1;
 	}
@@ -110,7 +127,7 @@ i_refvec<T>::i_refvec(int n) : data_(NULL), ref_count_(NULL)
 
 template <class T>
 inline	 i_refvec<T>::i_refvec(const i_refvec<T> &V): data_(V.data_),
-	ref_count_(V.ref_count_)
+	ref_count_(V.ref_count_), block_(V.block_), n_(V.n_)
 {
 	if (V.ref_count_ != NULL)
 	    (*(V.ref_count_))++;
@@ -118,7 +135,7 @@ inline	 i_refvec<T>::i_refvec(const i_refvec<T> &V): data_(V.data_),
 
 
 template <class T>
-i_refvec<T>::i_refvec(T* data) : data_(data), ref_count_(NULL) {}
+i_refvec<T>::i_refvec(T* data) : data_(data), ref_count_(NULL), block_(NULL), n_(0) {}
 
 template <class T>
 inline T* i_refvec<T>::begin()
@@ -163,6 +180,8 @@ i_refvec<T> & i_refvec<T>::operator=(const i_refvec<T> &V)
 
 	data_ = V.data_;
 	ref_count_ = V.ref_count_;
+	block_ = V.block_;
+	n_ = V.n_;
 
 	if (V.ref_count_ != NULL)
 	    (*(V.ref_count_))++;
@@ -183,12 +202,18 @@ void i_refvec<T>::destroy()
 #ifdef TNT_DEBUG
 		std::cout << "deleted ref_count_ ...\n";
 #endif
-		if (data_ != NULL)
-			delete []data_;
+		if (block_ != NULL)
+		{
+			for (int i=0; i<n_; i++)
+				data_[i].~T();
+			delete []block_;
+		}
 #ifdef TNT_DEBUG
 		std::cout << "deleted data_[] ...\n";
 #endif
 		data_ = NULL;
+		block_ = NULL;
+		n_ = 0;
 	}
 }
 
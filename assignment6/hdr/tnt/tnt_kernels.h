@@ -0,0 +1,219 @@
+/*
+*
+* Template Numerical Toolkit (TNT)
+*
+* Mathematical and Computational Sciences Division
+* National Institute of Technology,
+* Gaithersburg, MD USA
+*
+*
+* This software was developed at the National Institute of Standards and
+* Technology (NIST) by employees of the Federal Government in the course
+* of their official duties. Pursuant to title 17 Section 105 of the
+* United States Code, this software is not subject to copyright protection
+* and is in the public domain. NIST assumes no responsibility whatsoever for
+* its use by other parties, and makes no guarantees, expressed or implied,
+* about its quality, reliability, or any other characteristic.
+*
+*/
+
+
+
+#ifndef TNT_KERNELS_H
+#define TNT_KERNELS_H
+
+#if defined(__AVX__)
+#include <immintrin.h>
+#elif defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
+namespace TNT
+{
+
+/*
+	Vector kernels on contiguous rows, used by the blocked
+	factorizations. The generic versions work for any Real; float and
+	double are specialized with SSE2 or AVX when the compiler targets
+	them. None of them assume aligned pointers.
+*/
+
+/**
+	y[0..n) += a * x[0..n)
+*/
+template <class Real>
+inline void axpy(int n, Real a, const Real *x, Real *y)
+{
+	for (int i=0; i<n; i++)
+		y[i] += a * x[i];
+}
+
+/**
+	x[0..n) *= a
+*/
+template <class Real>
+inline void scal(int n, Real a, Real *x)
+{
+	for (int i=0; i<n; i++)
+		x[i] *= a;
+}
+
+/**
+	@returns the dot product of x[0..n) and y[0..n)
+*/
+template <class Real>
+inline Real dot(int n, const Real *x, const Real *y)
+{
+	Real s = 0;
+	for (int i=0; i<n; i++)
+		s += x[i] * y[i];
+	return s;
+}
+
+
+#if defined(__AVX__)
+
+template <>
+inline void axpy<double>(int n, double a, const double *x, double *y)
+{
+	int i = 0;
+	__m256d va = _mm256_set1_pd(a);
+	for (; i+8 <= n; i += 8)
+	{
+		__m256d y0 = _mm256_add_pd(_mm256_loadu_pd(y+i), _mm256_mul_pd(va, _mm256_loadu_pd(x+i)));
+		__m256d y1 = _mm256_add_pd(_mm256_loadu_pd(y+i+4), _mm256_mul_pd(va, _mm256_loadu_pd(x+i+4)));
+		_mm256_storeu_pd(y+i, y0);
+		_mm256_storeu_pd(y+i+4, y1);
+	}
+	for (; i<n; i++)
+		y[i] += a * x[i];
+}
+
+template <>
+inline void axpy<float>(int n, float a, const float *x, float *y)
+{
+	int i = 0;
+	__m256 va = _mm256_set1_ps(a);
+	for (; i+16 <= n; i += 16)
+	{
+		__m256 y0 = _mm256_add_ps(_mm256_loadu_ps(y+i), _mm256_mul_ps(va, _mm256_loadu_ps(x+i)));
+		__m256 y1 = _mm256_add_ps(_mm256_loadu_ps(y+i+8), _mm256_mul_ps(va, _mm256_loadu_ps(x+i+8)));
+		_mm256_storeu_ps(y+i, y0);
+		_mm256_storeu_ps(y+i+8, y1);
+	}
+	for (; i<n; i++)
+		y[i] += a * x[i];
+}
+
+template <>
+inline double dot<double>(int n, const double *x, const double *y)
+{
+	int i = 0;
+	__m256d s0 = _mm256_setzero_pd(), s1 = _mm256_setzero_pd();
+	for (; i+8 <= n; i += 8)
+	{
+		s0 = _mm256_add_pd(s0, _mm256_mul_pd(_mm256_loadu_pd(x+i), _mm256_loadu_pd(y+i)));
+		s1 = _mm256_add_pd(s1, _mm256_mul_pd(_mm256_loadu_pd(x+i+4), _mm256_loadu_pd(y+i+4)));
+	}
+	double t[4];
+	_mm256_storeu_pd(t, _mm256_add_pd(s0, s1));
+	double s = (t[0] + t[1]) + (t[2] + t[3]);
+	for (; i<n; i++)
+		s += x[i] * y[i];
+	return s;
+}
+
+template <>
+inline float dot<float>(int n, const float *x, const float *y)
+{
+	int i = 0;
+	__m256 s0 = _mm256_setzero_ps(), s1 = _mm256_setzero_ps();
+	for (; i+16 <= n; i += 16)
+	{
+		s0 = _mm256_add_ps(s0, _mm256_mul_ps(_mm256_loadu_ps(x+i), _mm256_loadu_ps(y+i)));
+		s1 = _mm256_add_ps(s1, _mm256_mul_ps(_mm256_loadu_ps(x+i+8), _mm256_loadu_ps(y+i+8)));
+	}
+	float t[8];
+	_mm256_storeu_ps(t, _mm256_add_ps(s0, s1));
+	float s = ((t[0] + t[1]) + (t[2] + t[3])) + ((t[4] + t[5]) + (t[6] + t[7]));
+	for (; i<n; i++)
+		s += x[i] * y[i];
+	return s;
+}
+
+#elif defined(__SSE2__)
+
+template <>
+inline void axpy<double>(int n, double a, const double *x, double *y)
+{
+	int i = 0;
+	__m128d va = _mm_set1_pd(a);
+	for (; i+4 <= n; i += 4)
+	{
+		__m128d y0 = _mm_add_pd(_mm_loadu_pd(y+i), _mm_mul_pd(va, _mm_loadu_pd(x+i)));
+		__m128d y1 = _mm_add_pd(_mm_loadu_pd(y+i+2), _mm_mul_pd(va, _mm_loadu_pd(x+i+2)));
+		_mm_storeu_pd(y+i, y0);
+		_mm_storeu_pd(y+i+2, y1);
+	}
+	for (; i<n; i++)
+		y[i] += a * x[i];
+}
+
+template <>
+inline void axpy<float>(int n, float a, const float *x, float *y)
+{
+	int i = 0;
+	__m128 va = _mm_set1_ps(a);
+	for (; i+8 <= n; i += 8)
+	{
+		__m128 y0 = _mm_add_ps(_mm_loadu_ps(y+i), _mm_mul_ps(va, _mm_loadu_ps(x+i)));
+		__m128 y1 = _mm_add_ps(_mm_loadu_ps(y+i+4), _mm_mul_ps(va, _mm_loadu_ps(x+i+4)));
+		_mm_storeu_ps(y+i, y0);
+		_mm_storeu_ps(y+i+4, y1);
+	}
+	for (; i<n; i++)
+		y[i] += a * x[i];
+}
+
+template <>
+inline double dot<double>(int n, const double *x, const double *y)
+{
+	int i = 0;
+	__m128d s0 = _mm_setzero_pd(), s1 = _mm_setzero_pd();
+	for (; i+4 <= n; i += 4)
+	{
+		s0 = _mm_add_pd(s0, _mm_mul_pd(_mm_loadu_pd(x+i), _mm_loadu_pd(y+i)));
+		s1 = _mm_add_pd(s1, _mm_mul_pd(_mm_loadu_pd(x+i+2), _mm_loadu_pd(y+i+2)));
+	}
+	double t[2];
+	_mm_storeu_pd(t, _mm_add_pd(s0, s1));
+	double s = t[0] + t[1];
+	for (; i<n; i++)
+		s += x[i] * y[i];
+	return s;
+}
+
+template <>
+inline float dot<float>(int n, const float *x, const float *y)
+{
+	int i = 0;
+	__m128 s0 = _mm_setzero_ps(), s1 = _mm_setzero_ps();
+	for (; i+8 <= n; i += 8)
+	{
+		s0 = _mm_add_ps(s0, _mm_mul_ps(_mm_loadu_ps(x+i), _mm_loadu_ps(y+i)));
+		s1 = _mm_add_ps(s1, _mm_mul_ps(_mm_loadu_ps(x+i+4), _mm_loadu_ps(y+i+4)));
+	}
+	float t[4];
+	_mm_storeu_ps(t, _mm_add_ps(s0, s1));
+	float s = (t[0] + t[1]) + (t[2] + t[3]);
+	for (; i<n; i++)
+		s += x[i] * y[i];
+	return s;
+}
+
+#endif
+
+} /* namespace TNT */
+
+#endif
+/* TNT_KERNELS_H */
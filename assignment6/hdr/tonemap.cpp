@@ -0,0 +1,450 @@
+#include "tonemap.h"
+#include "stdio.h"
+#include "math.h"
+
+#include <vector>
+using namespace std;
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+/* Deepest pyramid level used; 1.6^8 / 4 is within level 4's reach. */
+#define MAX_LEVEL 4
+
+/* One level of the luminance pyramid. */
+struct Plane {
+	int width, height;
+	vector<float> data;
+
+	void Resize(int w, int h) {
+		width = w;
+		height = h;
+		data.resize((size_t)w * h);
+	}
+	float* Row(int y) { return &data[(size_t)y * width]; }
+	const float* Row(int y) const { return &data[(size_t)y * width]; }
+};
+
+/* A center-surround scale: the blur of the luminance by a Gaussian of
+ * standard deviation sigma. It is taken as a residual blur of pyramid
+ * level `level'; for level 0 the blur is done on the fly, otherwise it
+ * is stored in blurred and upsampled as needed.
+ */
+struct Scale {
+	int level;
+	int radius;
+	vector<float> kernel;
+	Plane blurred;
+};
+
+/* Normalized Gaussian weights for offsets -radius..radius. */
+static int
+gaussian_kernel(float sigma, vector<float>& kernel) {
+	int radius = STMax(1, (int)ceilf(3.f * sigma));
+	kernel.resize(2*radius + 1);
+	float sum = 0.f;
+	for (int i = -radius; i <= radius; i++) {
+		float w = (sigma > 0.f) ? expf(-.5f * i * i / (sigma * sigma)) : (i == 0);
+		kernel[i + radius] = w;
+		sum += w;
+	}
+	for (int i = 0; i < 2*radius + 1; i++)
+		kernel[i] /= sum;
+	return radius;
+}
+
+/* Convolve rows center-radius..center+radius of p (clamped to the
+ * image) with kernel, one output value per column. The result is
+ * written to out[radius..radius+width-1], and the edge values are
+ * repeated radius times on either side so the horizontal pass needs
+ * no clamping.
+ */
+static void
+convolve_columns(const Plane& p, int center, const float* kernel,
+                 int radius, float* out) {
+	float* dst = out + radius;
+	for (int x = 0; x < p.width; x++)
+		dst[x] = 0.f;
+	for (int j = -radius; j <= radius; j++) {
+		int y = STMin(STMax(center + j, 0), p.height - 1);
+		const float* row = p.Row(y);
+		float w = kernel[j + radius];
+		for (int x = 0; x < p.width; x++)
+			dst[x] += w * row[x];
+	}
+	for (int x = 0; x < radius; x++) {
+		out[x] = dst[0];
+		dst[p.width + x] = dst[p.width - 1];
+	}
+}
+
+/* Convolve a padded row horizontally with kernel, taking every step'th
+ * input pixel as the center of an output pixel.
+ */
+static void
+convolve_row(const float* padded, int width, int step, const float* kernel,
+             int radius, float* out) {
+	for (int x = 0; x < width; x++)
+		out[x] = 0.f;
+	for (int j = -radius; j <= radius; j++) {
+		const float* src = padded + radius + j;
+		float w = kernel[j + radius];
+		if (step == 1) {
+			// kept apart so it vectorizes
+			for (int x = 0; x < width; x++)
+				out[x] += w * src[x];
+		}
+		else {
+			for (int x = 0; x < width; x++)
+				out[x] += w * src[x * step];
+		}
+	}
+}
+
+/* Next pyramid level: filter with the 5-tap binomial kernel, which has
+ * a variance of one pixel, and drop every other row and column.
+ */
+static void
+downsample(const Plane& src, Plane& dst) {
+	static const float binomial[5] = { 1/16.f, 4/16.f, 6/16.f, 4/16.f, 1/16.f };
+	dst.Resize((src.width + 1) / 2, (src.height + 1) / 2);
+
+	#pragma omp parallel
+	{
+		vector<float> padded(src.width + 5);
+		#pragma omp for schedule(static)
+		for (int y = 0; y < dst.height; y++) {
+			convolve_columns(src, 2*y, binomial, 2, &padded[0]);
+			convolve_row(&padded[0], dst.width, 2, binomial, 2, dst.Row(y));
+		}
+	}
+}
+
+/* Separable Gaussian blur of a whole plane. */
+static void
+blur(const Plane& src, const vector<float>& kernel, int radius, Plane& dst) {
+	dst.Resize(src.width, src.height);
+
+	#pragma omp parallel
+	{
+		vector<float> padded(src.width + 2*radius);
+		#pragma omp for schedule(static)
+		for (int y = 0; y < src.height; y++) {
+			convolve_columns(src, y, &kernel[0], radius, &padded[0]);
+			convolve_row(&padded[0], src.width, 1, &kernel[0], radius, dst.Row(y));
+		}
+	}
+}
+
+/* Bilinearly upsample row y of a full resolution image from a plane of
+ * pyramid level `level'. Pixel x of a level corresponds to pixel
+ * x * 2^level of the full image. tmp must hold p.width+1 floats.
+ */
+static void
+upsample_row(const Plane& p, int level, int y, int width, float* tmp, float* out) {
+	float inv = 1.f / (1 << level);
+	int mask = (1 << level) - 1;
+	int y0 = y >> level;
+	int y1 = STMin(y0 + 1, p.height - 1);
+	float ty = (y & mask) * inv;
+
+	const float* r0 = p.Row(y0);
+	const float* r1 = p.Row(y1);
+	for (int x = 0; x < p.width; x++)
+		tmp[x] = r0[x] + ty * (r1[x] - r0[x]);
+	tmp[p.width] = tmp[p.width - 1];
+
+	// every level pixel spans 2^level output pixels with the same
+	// interpolation weights
+	int n = 1 << level;
+	float w[1 << MAX_LEVEL];
+	for (int j = 0; j < n; j++)
+		w[j] = j * inv;
+	int x = 0;
+	for (int x0 = 0; x + n <= width; x0++, x += n) {
+		float a = tmp[x0];
+		float d = tmp[x0+1] - a;
+		for (int j = 0; j < n; j++)
+			out[x + j] = a + d * w[j];
+	}
+	for (; x < width; x++)
+		out[x] = tmp[x >> level] + (x & mask) * inv * (tmp[(x >> level) + 1] - tmp[x >> level]);
+}
+
+/* For each pixel of a row pick V1 at the largest scale s_m for which
+ *
+ *   |V1(s) - V2(s)| < epsilon * (center + V1(s))
+ *
+ * holds for every s <= s_m, where center[i] is 2^phi key / s^2 in the
+ * units of the blurred rows. blurred[i] is the row blurred at scale i;
+ * since V2 at scale i is V1 at scale i+1 there are nscales+1 rows.
+ */
+static void
+select_scales(const float* const* blurred, int nscales, const float* center,
+              float epsilon, int width, float* out) {
+	int x = 0;
+#ifdef __SSE2__
+	const __m128 eps = _mm_set1_ps(epsilon);
+	const __m128 sign = _mm_set1_ps(-0.f);
+	for (; x + 4 <= width; x += 4) {
+		__m128 sel = _mm_loadu_ps(blurred[0] + x);
+		__m128 done = _mm_setzero_ps();
+		for (int i = 0; i < nscales; i++) {
+			__m128 v1 = _mm_loadu_ps(blurred[i] + x);
+			__m128 v2 = _mm_loadu_ps(blurred[i+1] + x);
+			__m128 diff = _mm_andnot_ps(sign, _mm_sub_ps(v1, v2));
+			__m128 limit = _mm_mul_ps(eps, _mm_add_ps(_mm_set1_ps(center[i]), v1));
+			done = _mm_or_ps(done, _mm_cmpnlt_ps(diff, limit));
+			if (_mm_movemask_ps(done) == 0xf)
+				break;
+			sel = _mm_or_ps(_mm_and_ps(done, sel), _mm_andnot_ps(done, v1));
+		}
+		_mm_storeu_ps(out + x, sel);
+	}
+#endif
+	for (; x < width; x++) {
+		float sel = blurred[0][x];
+		for (int i = 0; i < nscales; i++) {
+			float v1 = blurred[i][x];
+			float v2 = blurred[i+1][x];
+			if (!(fabsf(v1 - v2) < epsilon * (center[i] + v1)))
+				break;
+			sel = v1;
+		}
+		out[x] = sel;
+	}
+}
+
+/* Scale each pixel by L_d / L_w = scale / (1 + scale * V1) and store it
+ * as 8 bits. With SSE2 the twelve channels of four pixels are scaled
+ * with three multiplies, by spreading the four factors over the channels.
+ */
+static void
+write_local_row(const STColor3f* src, const float* v1, float scale, int width,
+                STColor4ub* dst) {
+	int x = 0;
+#ifdef __SSE2__
+	const __m128 top = _mm_set1_ps(255.f);
+	const __m128 zero = _mm_setzero_ps();
+	const __m128 num = _mm_set1_ps(255.f * scale);
+	const __m128 vscale = _mm_set1_ps(scale);
+	const __m128 one = _mm_set1_ps(1.f);
+	for (; x + 4 <= width; x += 4) {
+		__m128 f = _mm_div_ps(num, _mm_add_ps(one, _mm_mul_ps(vscale, _mm_loadu_ps(v1 + x))));
+		// r0 g0 b0 r1 | g1 b1 r2 g2 | b2 r3 g3 b3
+		__m128 fa = _mm_shuffle_ps(f, f, _MM_SHUFFLE(1,0,0,0));
+		__m128 fb = _mm_shuffle_ps(f, f, _MM_SHUFFLE(2,2,1,1));
+		__m128 fc = _mm_shuffle_ps(f, f, _MM_SHUFFLE(3,3,3,2));
+		const float* p = &src[x].r;
+		int c[12];
+		_mm_storeu_si128((__m128i*)c, _mm_cvttps_epi32(
+			_mm_max_ps(zero, _mm_min_ps(top, _mm_mul_ps(_mm_loadu_ps(p), fa)))));
+		_mm_storeu_si128((__m128i*)(c + 4), _mm_cvttps_epi32(
+			_mm_max_ps(zero, _mm_min_ps(top, _mm_mul_ps(_mm_loadu_ps(p + 4), fb)))));
+		_mm_storeu_si128((__m128i*)(c + 8), _mm_cvttps_epi32(
+			_mm_max_ps(zero, _mm_min_ps(top, _mm_mul_ps(_mm_loadu_ps(p + 8), fc)))));
+		for (int k = 0; k < 4; k++)
+			dst[x + k] = STColor4ub(c[3*k], c[3*k+1], c[3*k+2], 255);
+	}
+#endif
+	for (; x < width; x++) {
+		float f = 255.f * scale / (1.f + scale * v1[x]);
+		dst[x] = STColor4ub((unsigned char)STMax(STMin(src[x].r * f, 255.f), 0.f),
+		                    (unsigned char)STMax(STMin(src[x].g * f, 255.f), 0.f),
+		                    (unsigned char)STMax(STMin(src[x].b * f, 255.f), 0.f), 255);
+	}
+}
+
+ToneMapper::ToneMapper(const STHDRImage* _hdr, float _phi, float _epsilon)
+	: hdr(_hdr), phi(_phi), epsilon(_epsilon), log_average(-1.f) {
+}
+
+/* Log-average luminance of the image, computed on first use. */
+float
+ToneMapper::GetLogAverage() {
+	if (log_average < 0.f) {
+		STImageStats stats;
+		stats.Compute(hdr->GetPixels(), hdr->GetWidth() * hdr->GetHeight(), 0.0001f);
+		log_average = stats.GetLogMean(STImageStats::LUMINANCE);
+	}
+	return log_average;
+}
+
+/* Global photographic operator, C_tm = C * s / (1 + C * s) per channel
+ * with s = key / Lavg.
+ */
+void
+ToneMapper::Global(float key, STImage* result) {
+	int n = hdr->GetWidth() * hdr->GetHeight();
+	float scale = key / GetLogAverage();
+	const STColor3f* src = hdr->GetPixels();
+	STColor4ub* dst = result->GetPixels();
+
+	#pragma omp parallel for schedule(static)
+	for (int i = 0; i < n; i++) {
+		float r = src[i].r * scale;
+		float g = src[i].g * scale;
+		float b = src[i].b * scale;
+		dst[i] = STColor4ub((unsigned char)STMin(255.f, r / (1.f + r) * 255.f),
+		                    (unsigned char)STMin(255.f, g / (1.f + g) * 255.f),
+		                    (unsigned char)STMin(255.f, b / (1.f + b) * 255.f), 255);
+	}
+}
+
+/* Local photographic operator, see tonemap.h. */
+void
+ToneMapper::Local(float key, STImage* result) {
+	int width = hdr->GetWidth();
+	int height = hdr->GetHeight();
+	if (adaptation.empty())
+		BuildAdaptation();
+
+	float scale = key / GetLogAverage();
+	const STColor3f* pixels = hdr->GetPixels();
+	STColor4ub* out = result->GetPixels();
+	#pragma omp parallel for schedule(static)
+	for (int y = 0; y < height; y++) {
+		write_local_row(pixels + (size_t)y * width, &adaptation[(size_t)y * width],
+		                scale, width, out + (size_t)y * width);
+	}
+}
+
+/* Find V1 at the selected scale for every pixel.
+ *
+ * The operator works on L = scale * L_w with scale = key / Lavg, and the
+ * center-surround test compares against 2^phi key / s^2. Blurring is
+ * linear, so on the unscaled luminance the test constant becomes
+ * 2^phi Lavg / s^2, which does not depend on the key: the selected V1
+ * is computed once and every key after that only redoes the division.
+ */
+void
+ToneMapper::BuildAdaptation() {
+	int width = hdr->GetWidth();
+	int height = hdr->GetHeight();
+	const int nscales = LOCAL_TONEMAP_SCALES;
+
+	// luminance (pyramid level 0), with the weights of STImageStats
+	vector<Plane> pyramid(1);
+	pyramid[0].Resize(width, height);
+	const STColor3f* pixels = hdr->GetPixels();
+	#pragma omp parallel for schedule(static)
+	for (int y = 0; y < height; y++) {
+		const STColor3f* src = pixels + (size_t)y * width;
+		float* dst = pyramid[0].Row(y);
+		for (int x = 0; x < width; x++)
+			dst[x] = .299f * src[x].r + .587f * src[x].g + .114f * src[x].b;
+	}
+	float lavg = GetLogAverage();
+
+	// Reinhard's Gaussian at scale s has standard deviation s/4 for
+	// V1 and 1.6 s/4 for V2, i.e. that of V1 at the next scale up
+	float sigma[nscales + 1];
+	float center[nscales];
+	for (int i = 0; i <= nscales; i++) {
+		float s = powf(1.6f, (float)i);
+		sigma[i] = s / 4.f;
+		if (i < nscales)
+			center[i] = powf(2.f, phi) * lavg / (s * s);
+	}
+
+	// a pyramid level k has been blurred with a variance of
+	// (4^k - 1) / 3 full resolution pixels; take each scale from the
+	// coarsest level that is not blurrier than it
+	Scale scales[nscales + 1];
+	int pad = 1;
+	for (int i = 0; i <= nscales; i++) {
+		int level = 0;
+		while (level < MAX_LEVEL &&
+		       (powf(4.f, level + 1.f) - 1.f) / 3.f <= sigma[i] * sigma[i] &&
+		       (width >> (level + 1)) > 0 && (height >> (level + 1)) > 0)
+			level++;
+		float var = (powf(4.f, (float)level) - 1.f) / 3.f;
+		float residual = sqrtf(STMax(sigma[i] * sigma[i] - var, 0.f)) / (1 << level);
+
+		Scale& sc = scales[i];
+		sc.level = level;
+		sc.radius = gaussian_kernel(residual, sc.kernel);
+		if (level == 0)
+			pad = STMax(pad, 2*sc.radius);
+	}
+
+	// the scales only get coarser, so the last one needs the deepest level
+	pyramid.resize(scales[nscales].level + 1);
+	for (int k = 1; k < (int)pyramid.size(); k++)
+		downsample(pyramid[k-1], pyramid[k]);
+	for (int i = 0; i <= nscales; i++) {
+		if (scales[i].level > 0)
+			blur(pyramid[scales[i].level], scales[i].kernel, scales[i].radius, scales[i].blurred);
+	}
+
+	// walk the image a row at a time: blur or upsample every scale for
+	// the row and pick the scale of each pixel
+	adaptation.resize((size_t)width * height);
+	#pragma omp parallel
+	{
+		vector<float> rows((size_t)(nscales + 1) * width);
+		vector<float> tmp(width + pad);
+		const float* blurred[nscales + 1];
+		for (int i = 0; i <= nscales; i++)
+			blurred[i] = &rows[(size_t)i * width];
+
+		#pragma omp for schedule(static)
+		for (int y = 0; y < height; y++) {
+			for (int i = 0; i <= nscales; i++) {
+				Scale& sc = scales[i];
+				float* row = &rows[(size_t)i * width];
+				if (sc.level == 0) {
+					convolve_columns(pyramid[0], y, &sc.kernel[0], sc.radius, &tmp[0]);
+					convolve_row(&tmp[0], width, 1, &sc.kernel[0], sc.radius, row);
+				}
+				else {
+					upsample_row(sc.blurred, sc.level, y, width, &tmp[0], row);
+				}
+			}
+			select_scales(blurred, nscales, center, epsilon, width,
+			              &adaptation[(size_t)y * width]);
+		}
+	}
+}
+
+/* Local photographic tonemap operator, see tonemap.h. */
+void
+ToneMapLocal(STHDRImage* hdr, float key, STImage* result, float phi, float epsilon) {
+	ToneMapper mapper(hdr, phi, epsilon);
+	mapper.Local(key, result);
+}
+
+/* Make a copy of hdr shrunk by a whole factor so that neither side
+ * exceeds max_size, averaging each factor x factor box.
+ */
+STHDRImage*
+ShrinkHDR(const STHDRImage* hdr, int max_size) {
+	int width = hdr->GetWidth();
+	int height = hdr->GetHeight();
+	int factor = STMax((width + max_size - 1) / max_size, (height + max_size - 1) / max_size);
+	factor = STMax(factor, 1);
+	int w = STMax(width / factor, 1);
+	int h = STMax(height / factor, 1);
+
+	STHDRImage* small = new STHDRImage(w, h);
+	const STColor3f* src = hdr->GetPixels();
+	STColor3f* dst = small->GetPixels();
+	float norm = 1.f / (factor * factor);
+
+	#pragma omp parallel for schedule(static)
+	for (int y = 0; y < h; y++) {
+		for (int x = 0; x < w; x++) {
+			float r = 0.f, g = 0.f, b = 0.f;
+			for (int j = 0; j < factor; j++) {
+				const STColor3f* row = src + (size_t)(y*factor + j) * width + x*factor;
+				for (int i = 0; i < factor; i++) {
+					r += row[i].r;
+					g += row[i].g;
+					b += row[i].b;
+				}
+			}
+			dst[y*w + x] = STColor3f(r * norm, g * norm, b * norm);
+		}
+	}
+	return small;
+}
@@ -0,0 +1,74 @@
+#ifndef __TONEMAP_H__
+#define __TONEMAP_H__
+
+#include "st.h"
+#include "STHDRImage.h"
+#include <vector>
+using namespace std;
+
+/* Parameters of the local operator, from Reinhard et al., "Photographic
+ * Tone Reproduction for Digital Images" (2002).
+ */
+#define LOCAL_TONEMAP_SCALES    8      // center-surround scales 1, 1.6, ..., 1.6^7
+#define LOCAL_TONEMAP_PHI       8.f    // sharpening parameter
+#define LOCAL_TONEMAP_EPSILON   .05f   // threshold on the center-surround difference
+
+/* Local (dodge-and-burn) version of the photographic tonemap operator.
+ * Every pixel is divided by the average luminance of the largest
+ * neighbourhood around it that has no strong edge,
+ *
+ *   L_d(x,y) = L(x,y) / (1 + V1(x,y,s_m(x,y)))
+ *
+ * where V1(x,y,s) is L blurred by a Gaussian of scale s and s_m is the
+ * largest scale whose center-surround difference stays below epsilon.
+ *
+ * The blurred images are built from a Gaussian pyramid of the luminance.
+ * Each scale is a small residual blur of the nearest coarser level, and
+ * it is upsampled a row at a time as the scales are picked, so memory
+ * stays at the luminance, the selected V1 and the pyramid. Rows are
+ * processed in parallel, and the scale search runs on four pixels at
+ * once with SSE2.
+ *
+ * For repeated calls on the same image use a ToneMapper instead.
+ */
+void ToneMapLocal(STHDRImage* hdr, float key, STImage* result,
+                  float phi = LOCAL_TONEMAP_PHI,
+                  float epsilon = LOCAL_TONEMAP_EPSILON);
+
+/* ToneMapper - tonemaps one HDR image over and over, e.g. while the key
+ * is being adjusted in the viewer. Everything that doesn't depend on the
+ * key is computed once and cached: the log-average luminance, and for
+ * the local operator the blurred luminance V1 at every pixel's scale
+ * (see BuildAdaptation). Changing the key then only redoes the final
+ * per-pixel mapping.
+ */
+class ToneMapper {
+public:
+	ToneMapper(const STHDRImage* hdr,
+	           float phi = LOCAL_TONEMAP_PHI,
+	           float epsilon = LOCAL_TONEMAP_EPSILON);
+
+	const STHDRImage* GetImage() const { return hdr; }
+	/* Log-average luminance of the image, from STImageStats. */
+	float GetLogAverage();
+
+	/* Global photographic operator, as tonemap() in main.cpp. */
+	void Global(float key, STImage* result);
+	/* Local (dodge-and-burn) operator, as ToneMapLocal. */
+	void Local(float key, STImage* result);
+
+private:
+	void BuildAdaptation();
+
+	const STHDRImage* hdr;
+	float phi, epsilon;
+	float log_average;          // < 0 until computed
+	vector<float> adaptation;   // selected V1 per pixel, empty until computed
+};
+
+/* Make a smaller copy of hdr, at most max_size pixels on either side,
+ * by averaging boxes of pixels. Used for quick previews.
+ */
+STHDRImage* ShrinkHDR(const STHDRImage* hdr, int max_size);
+
+#endif //__TONEMAP_H__
@@ -0,0 +1,132 @@
+// STImageStats.h
+#ifndef __STIMAGESTATS_H__
+#define __STIMAGESTATS_H__
+
+// Forward-declare libst types.
+#include "stForward.h"
+
+/**
+* The STImageStats class gathers whole-image statistics (histograms,
+* min/max, mean, variance, log-average and entropy) for every channel
+* of an image in a single pass over the pixel data.
+*
+* For 8-bit images every statistic is derived from per-channel 256-bin
+* histograms, so the pixels are only touched once:
+*
+*   STImageStats stats;
+*   stats.Compute(image);
+*   float avg = stats.GetMean(STImageStats::LUMINANCE);
+*
+* Floating point pixel arrays (such as HDR images) are reduced directly
+* into min/max/sum/sum-of-squares/sum-of-logs, since they have no natural
+* histogram.
+*
+* Values for 8-bit images are reported in the [0, 1] range, the same as
+* converting the pixel to an STColor3f. Luminance uses the Rec. 601
+* weights (.299, .587, .114).
+*
+* The passes are split across threads with OpenMP (when available) and
+* use SSE2 for the reductions where the compiler supports it.
+*/
+class STImageStats
+{
+public:
+    //
+    // Channels that statistics are gathered for.
+    // ALPHA is only meaningful for 8-bit images.
+    //
+    enum Channel
+    {
+        RED = 0,
+        GREEN,
+        BLUE,
+        ALPHA,
+        LUMINANCE,
+        NUM_CHANNELS
+    };
+
+    //
+    // Number of histogram bins per channel.
+    //
+    static const int NUM_BINS = 256;
+
+    //
+    // Offset added before taking logarithms so that
+    // black pixels don't produce log(0).
+    //
+    static const float DEFAULT_LOG_DELTA;
+
+    //
+    // Construct an empty set of statistics.
+    //
+    STImageStats();
+
+    //
+    // Gather statistics for an 8-bit image. This builds the
+    // histograms and derives all the other statistics from them.
+    //
+    void Compute(const STImage* image, float logDelta = DEFAULT_LOG_DELTA);
+
+    //
+    // Gather statistics for an array of floating point pixels.
+    // No histograms are available afterwards.
+    //
+    void Compute(const STColor3f* pixels, int numPixels,
+                 float logDelta = DEFAULT_LOG_DELTA);
+
+    //
+    // Get the number of pixels the statistics were gathered over.
+    //
+    int GetNumPixels() const { return mNumPixels; }
+
+    //
+    // True if the last Compute() produced histograms.
+    //
+    bool HasHistograms() const { return mHasHistograms; }
+
+    //
+    // Get the NUM_BINS histogram counts of a channel.
+    //
+    const unsigned int* GetHistogram(Channel c) const { return mHistogram[c]; }
+
+    float GetMin(Channel c) const { return mMin[c]; }
+    float GetMax(Channel c) const { return mMax[c]; }
+    float GetMean(Channel c) const { return mMean[c]; }
+    float GetVariance(Channel c) const { return mVariance[c]; }
+
+    //
+    // Get the log-average exp(mean(log(delta + v))) of a channel.
+    //
+    float GetLogMean(Channel c) const { return mLogMean[c]; }
+
+    //
+    // Get the entropy (in bits per sample) of a channel's histogram.
+    // Only available for 8-bit images.
+    //
+    float GetEntropy(Channel c) const;
+
+    //
+    // Compute the per-channel mean squared error between two 8-bit
+    // images of the same size in a single pass. Errors are reported
+    // in [0, 1] units, with LUMINANCE being the error of the Rec. 601
+    // luma of each pixel.
+    //
+    static void MeanSquaredError(const STImage* a, const STImage* b,
+                                 float mse[NUM_CHANNELS]);
+
+private:
+    void Clear();
+
+    int  mNumPixels;
+    bool mHasHistograms;
+
+    unsigned int mHistogram[NUM_CHANNELS][NUM_BINS];
+
+    float mMin[NUM_CHANNELS];
+    float mMax[NUM_CHANNELS];
+    float mMean[NUM_CHANNELS];
+    float mVariance[NUM_CHANNELS];
+    float mLogMean[NUM_CHANNELS];
+};
+
+#endif // __STIMAGESTATS_H__
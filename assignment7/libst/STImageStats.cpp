@@ -0,0 +1,501 @@
+// STImageStats.cpp
+#include "STImageStats.h"
+
+#include "STColor3f.h"
+#include "STImage.h"
+#include "STUtil.h"
+
+#include <assert.h>
+#include <float.h>
+#include <math.h>
+#include <string.h>
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+//
+
+const float STImageStats::DEFAULT_LOG_DELTA = 0.0001f;
+
+// Pixels are processed in blocks of this many; blocks are the unit of
+// work handed to threads, and short-lived accumulators are flushed into
+// wider ones at the end of every block so they cannot overflow.
+static const int BLOCK_PIXELS = 16384;
+
+// Consecutive pixels are binned into different sub-histograms so that
+// runs of equal values don't serialize on a single counter.
+static const int NUM_SUBHISTOGRAMS = 4;
+
+// Rec. 601 luma weights.
+static const float LUMA_R = 0.299f;
+static const float LUMA_G = 0.587f;
+static const float LUMA_B = 0.114f;
+
+//
+// Rec. 601 luma of an 8-bit color in 8.8 fixed point, rounded to
+// the nearest 8-bit value. The weights add up to exactly 256.
+//
+static inline int
+Luma8(int r, int g, int b)
+{
+    return (77*r + 150*g + 29*b + 128) >> 8;
+}
+
+static inline int
+NumBlocks(int numPixels)
+{
+    return (numPixels + BLOCK_PIXELS - 1) / BLOCK_PIXELS;
+}
+
+//
+// Construct an empty set of statistics.
+//
+STImageStats::STImageStats()
+{
+    Clear();
+}
+
+void
+STImageStats::Clear()
+{
+    mNumPixels = 0;
+    mHasHistograms = false;
+    memset(mHistogram, 0, sizeof(mHistogram));
+    for (int c = 0; c < NUM_CHANNELS; c++) {
+        mMin[c] = mMax[c] = mMean[c] = mVariance[c] = mLogMean[c] = 0.f;
+    }
+}
+
+//
+// Gather statistics for an 8-bit image. One pass builds a histogram
+// for every channel; min, max, mean, variance and log-average are all
+// exact functions of the histogram, so they cost 256 steps each.
+//
+void
+STImageStats::Compute(const STImage* image, float logDelta)
+{
+    Clear();
+
+    int numPixels = image->GetWidth() * image->GetHeight();
+    const unsigned char* pixels = (const unsigned char*)image->GetPixels();
+    int numBlocks = NumBlocks(numPixels);
+
+    #pragma omp parallel
+    {
+        unsigned int sub[NUM_SUBHISTOGRAMS][NUM_CHANNELS][NUM_BINS];
+        memset(sub, 0, sizeof(sub));
+
+        #pragma omp for schedule(static)
+        for (int blk = 0; blk < numBlocks; blk++) {
+            int begin = blk * BLOCK_PIXELS;
+            int end = STMin(begin + BLOCK_PIXELS, numPixels);
+
+            for (int i = begin; i < end; i++) {
+                const unsigned char* p = pixels + 4*i;
+                unsigned int (*h)[NUM_BINS] = sub[i & (NUM_SUBHISTOGRAMS-1)];
+                h[RED][p[0]]++;
+                h[GREEN][p[1]]++;
+                h[BLUE][p[2]]++;
+                h[ALPHA][p[3]]++;
+                h[LUMINANCE][Luma8(p[0], p[1], p[2])]++;
+            }
+        }
+
+        #pragma omp critical
+        {
+            for (int s = 0; s < NUM_SUBHISTOGRAMS; s++)
+                for (int c = 0; c < NUM_CHANNELS; c++)
+                    for (int i = 0; i < NUM_BINS; i++)
+                        mHistogram[c][i] += sub[s][c][i];
+        }
+    }
+
+    mNumPixels = numPixels;
+    mHasHistograms = true;
+    if (numPixels == 0)
+        return;
+
+    // The log of each bin value only has to be taken once.
+    double logBin[NUM_BINS];
+    for (int i = 0; i < NUM_BINS; i++)
+        logBin[i] = log(logDelta + i / 255.0);
+
+    for (int c = 0; c < NUM_CHANNELS; c++) {
+        const unsigned int* h = mHistogram[c];
+        int lo = 0, hi = NUM_BINS - 1;
+        while (h[lo] == 0) lo++;
+        while (h[hi] == 0) hi--;
+
+        double sum = 0, sumSq = 0, sumLog = 0;
+        for (int i = lo; i <= hi; i++) {
+            sum    += double(h[i]) * i;
+            sumSq  += double(h[i]) * i * i;
+            sumLog += double(h[i]) * logBin[i];
+        }
+
+        double mean = sum / numPixels;
+        mMin[c] = lo / 255.f;
+        mMax[c] = hi / 255.f;
+        mMean[c] = float(mean / 255.0);
+        mVariance[c] = float(STMax(sumSq / numPixels - mean*mean, 0.0) / (255.0*255.0));
+        mLogMean[c] = float(exp(sumLog / numPixels));
+    }
+}
+
+#ifdef __SSE2__
+
+//
+// Natural log of four floats (Cephes single precision algorithm).
+// Accurate to a few ulp for positive normalized inputs, which is
+// plenty for log-averages.
+//
+static inline __m128
+LogPS(__m128 x)
+{
+    const __m128 one = _mm_set1_ps(1.f);
+
+    x = _mm_max_ps(x, _mm_set1_ps(FLT_MIN));
+    __m128i emm0 = _mm_srli_epi32(_mm_castps_si128(x), 23);
+
+    // keep only the mantissa, scaled into [0.5, 1)
+    x = _mm_and_ps(x, _mm_castsi128_ps(_mm_set1_epi32(~0x7f800000)));
+    x = _mm_or_ps(x, _mm_set1_ps(0.5f));
+
+    emm0 = _mm_sub_epi32(emm0, _mm_set1_epi32(0x7f));
+    __m128 e = _mm_add_ps(_mm_cvtepi32_ps(emm0), one);
+
+    // if x < sqrt(1/2) use 2x - 1 and e - 1, otherwise x - 1 and e
+    __m128 mask = _mm_cmplt_ps(x, _mm_set1_ps(0.707106781186547524f));
+    __m128 tmp = _mm_and_ps(x, mask);
+    x = _mm_sub_ps(x, one);
+    e = _mm_sub_ps(e, _mm_and_ps(one, mask));
+    x = _mm_add_ps(x, tmp);
+
+    __m128 z = _mm_mul_ps(x, x);
+    __m128 y = _mm_set1_ps(7.0376836292E-2f);
+    y = _mm_add_ps(_mm_mul_ps(y, x), _mm_set1_ps(-1.1514610310E-1f));
+    y = _mm_add_ps(_mm_mul_ps(y, x), _mm_set1_ps(1.1676998740E-1f));
+    y = _mm_add_ps(_mm_mul_ps(y, x), _mm_set1_ps(-1.2420140846E-1f));
+    y = _mm_add_ps(_mm_mul_ps(y, x), _mm_set1_ps(1.4249322787E-1f));
+    y = _mm_add_ps(_mm_mul_ps(y, x), _mm_set1_ps(-1.6668057665E-1f));
+    y = _mm_add_ps(_mm_mul_ps(y, x), _mm_set1_ps(2.0000714765E-1f));
+    y = _mm_add_ps(_mm_mul_ps(y, x), _mm_set1_ps(-2.4999993993E-1f));
+    y = _mm_add_ps(_mm_mul_ps(y, x), _mm_set1_ps(3.3333331174E-1f));
+    y = _mm_mul_ps(_mm_mul_ps(y, x), z);
+
+    y = _mm_add_ps(y, _mm_mul_ps(e, _mm_set1_ps(-2.12194440e-4f)));
+    y = _mm_sub_ps(y, _mm_mul_ps(z, _mm_set1_ps(0.5f)));
+    x = _mm_add_ps(x, y);
+    return _mm_add_ps(x, _mm_mul_ps(e, _mm_set1_ps(0.693359375f)));
+}
+
+static inline float
+HorizontalSum(__m128 v)
+{
+    float f[4];
+    _mm_storeu_ps(f, v);
+    return (f[0] + f[1]) + (f[2] + f[3]);
+}
+
+static inline float
+HorizontalMin(__m128 v)
+{
+    float f[4];
+    _mm_storeu_ps(f, v);
+    return STMin(STMin(f[0], f[1]), STMin(f[2], f[3]));
+}
+
+static inline float
+HorizontalMax(__m128 v)
+{
+    float f[4];
+    _mm_storeu_ps(f, v);
+    return STMax(STMax(f[0], f[1]), STMax(f[2], f[3]));
+}
+
+#endif // __SSE2__
+
+//
+// Running sums for the floating point reduction. Sums are kept in
+// double precision since images can have hundreds of millions of
+// samples.
+//
+struct STFloatAccum
+{
+    double sum[STImageStats::NUM_CHANNELS];
+    double sumSq[STImageStats::NUM_CHANNELS];
+    double sumLog[STImageStats::NUM_CHANNELS];
+    float  min[STImageStats::NUM_CHANNELS];
+    float  max[STImageStats::NUM_CHANNELS];
+
+    STFloatAccum()
+    {
+        for (int c = 0; c < STImageStats::NUM_CHANNELS; c++) {
+            sum[c] = sumSq[c] = sumLog[c] = 0.0;
+            min[c] = FLT_MAX;
+            max[c] = -FLT_MAX;
+        }
+    }
+
+    void Add(int c, float v, float logDelta)
+    {
+        sum[c] += v;
+        sumSq[c] += double(v) * v;
+        sumLog[c] += logf(logDelta + v);
+        min[c] = STMin(min[c], v);
+        max[c] = STMax(max[c], v);
+    }
+
+    void Merge(const STFloatAccum& o)
+    {
+        for (int c = 0; c < STImageStats::NUM_CHANNELS; c++) {
+            sum[c] += o.sum[c];
+            sumSq[c] += o.sumSq[c];
+            sumLog[c] += o.sumLog[c];
+            min[c] = STMin(min[c], o.min[c]);
+            max[c] = STMax(max[c], o.max[c]);
+        }
+    }
+};
+
+//
+// Reduce the pixels [begin, end) into acc.
+//
+static void
+AccumulateFloat(const STColor3f* pixels, int begin, int end,
+                float logDelta, STFloatAccum& acc)
+{
+    int i = begin;
+
+#ifdef __SSE2__
+    // Four pixels (twelve floats) at a time, deinterleaved into
+    // one register per channel plus one for luminance.
+    const int RGBY = 4;
+    __m128 vsum[RGBY], vsq[RGBY], vlog[RGBY], vmin[RGBY], vmax[RGBY];
+    for (int c = 0; c < RGBY; c++) {
+        vsum[c] = vsq[c] = vlog[c] = _mm_setzero_ps();
+        vmin[c] = _mm_set1_ps(FLT_MAX);
+        vmax[c] = _mm_set1_ps(-FLT_MAX);
+    }
+    const __m128 delta = _mm_set1_ps(logDelta);
+    const __m128 wr = _mm_set1_ps(LUMA_R);
+    const __m128 wg = _mm_set1_ps(LUMA_G);
+    const __m128 wb = _mm_set1_ps(LUMA_B);
+
+    for (; i + 4 <= end; i += 4) {
+        const float* f = &pixels[i].r;
+        __m128 a = _mm_loadu_ps(f);     // r0 g0 b0 r1
+        __m128 b = _mm_loadu_ps(f + 4); // g1 b1 r2 g2
+        __m128 c = _mm_loadu_ps(f + 8); // b2 r3 g3 b3
+
+        __m128 v[RGBY];
+        __m128 t = _mm_shuffle_ps(b, c, _MM_SHUFFLE(0,1,0,2));
+        v[0] = _mm_shuffle_ps(a, t, _MM_SHUFFLE(2,0,3,0));
+        v[1] = _mm_shuffle_ps(_mm_shuffle_ps(a, b, _MM_SHUFFLE(0,0,1,1)),
+                              _mm_shuffle_ps(b, c, _MM_SHUFFLE(2,2,3,3)),
+                              _MM_SHUFFLE(2,0,2,0));
+        v[2] = _mm_shuffle_ps(_mm_shuffle_ps(a, b, _MM_SHUFFLE(1,1,2,2)),
+                              _mm_shuffle_ps(c, c, _MM_SHUFFLE(3,3,0,0)),
+                              _MM_SHUFFLE(2,0,2,0));
+        v[3] = _mm_add_ps(_mm_add_ps(_mm_mul_ps(v[0], wr), _mm_mul_ps(v[1], wg)),
+                          _mm_mul_ps(v[2], wb));
+
+        for (int ch = 0; ch < RGBY; ch++) {
+            vsum[ch] = _mm_add_ps(vsum[ch], v[ch]);
+            vsq[ch]  = _mm_add_ps(vsq[ch], _mm_mul_ps(v[ch], v[ch]));
+            vlog[ch] = _mm_add_ps(vlog[ch], LogPS(_mm_add_ps(v[ch], delta)));
+            vmin[ch] = _mm_min_ps(vmin[ch], v[ch]);
+            vmax[ch] = _mm_max_ps(vmax[ch], v[ch]);
+        }
+    }
+
+    static const int channel[RGBY] = {
+        STImageStats::RED, STImageStats::GREEN,
+        STImageStats::BLUE, STImageStats::LUMINANCE
+    };
+    for (int ch = 0; ch < RGBY; ch++) {
+        int c = channel[ch];
+        acc.sum[c] += HorizontalSum(vsum[ch]);
+        acc.sumSq[c] += HorizontalSum(vsq[ch]);
+        acc.sumLog[c] += HorizontalSum(vlog[ch]);
+        acc.min[c] = STMin(acc.min[c], HorizontalMin(vmin[ch]));
+        acc.max[c] = STMax(acc.max[c], HorizontalMax(vmax[ch]));
+    }
+#endif
+
+    for (; i < end; i++) {
+        const STColor3f& p = pixels[i];
+        acc.Add(STImageStats::RED, p.r, logDelta);
+        acc.Add(STImageStats::GREEN, p.g, logDelta);
+        acc.Add(STImageStats::BLUE, p.b, logDelta);
+        acc.Add(STImageStats::LUMINANCE,
+                LUMA_R*p.r + LUMA_G*p.g + LUMA_B*p.b, logDelta);
+    }
+}
+
+//
+// Gather statistics for an array of floating point pixels.
+//
+void
+STImageStats::Compute(const STColor3f* pixels, int numPixels, float logDelta)
+{
+    Clear();
+
+    STFloatAccum total;
+    int numBlocks = NumBlocks(numPixels);
+
+    #pragma omp parallel
+    {
+        STFloatAccum local;
+
+        #pragma omp for schedule(static)
+        for (int blk = 0; blk < numBlocks; blk++) {
+            int begin = blk * BLOCK_PIXELS;
+            AccumulateFloat(pixels, begin,
+                            STMin(begin + BLOCK_PIXELS, numPixels),
+                            logDelta, local);
+        }
+
+        #pragma omp critical
+        total.Merge(local);
+    }
+
+    mNumPixels = numPixels;
+    if (numPixels == 0)
+        return;
+
+    for (int c = 0; c < NUM_CHANNELS; c++) {
+        if (c == ALPHA) {
+            // float pixels are always opaque
+            mMin[c] = mMax[c] = mMean[c] = 1.f;
+            mLogMean[c] = logDelta + 1.f;
+            continue;
+        }
+        double mean = total.sum[c] / numPixels;
+        mMin[c] = total.min[c];
+        mMax[c] = total.max[c];
+        mMean[c] = float(mean);
+        mVariance[c] = float(STMax(total.sumSq[c] / numPixels - mean*mean, 0.0));
+        mLogMean[c] = float(exp(total.sumLog[c] / numPixels));
+    }
+}
+
+//
+// Get the entropy (in bits per sample) of a channel's histogram.
+//
+float
+STImageStats::GetEntropy(Channel c) const
+{
+    assert(mHasHistograms);
+    if (mNumPixels == 0)
+        return 0.f;
+
+    double entropy = 0;
+    for (int i = 0; i < NUM_BINS; i++) {
+        if (mHistogram[c][i] > 0) {
+            double p = double(mHistogram[c][i]) / mNumPixels;
+            entropy -= p * log(p);
+        }
+    }
+    return float(entropy / log(2.0));
+}
+
+//
+// Compute the per-channel mean squared error between two 8-bit
+// images. The squared channel differences and the products of
+// neighboring channels (rg, gb, br) are summed exactly in integers;
+// the luma error follows from those without a second pass, since
+// (wr*dr + wg*dg + wb*db)^2 expands into exactly those terms.
+//
+void
+STImageStats::MeanSquaredError(const STImage* a, const STImage* b,
+                               float mse[NUM_CHANNELS])
+{
+    assert(a->GetWidth() == b->GetWidth() && a->GetHeight() == b->GetHeight());
+
+    int numPixels = a->GetWidth() * a->GetHeight();
+    const unsigned char* pa = (const unsigned char*)a->GetPixels();
+    const unsigned char* pb = (const unsigned char*)b->GetPixels();
+    int numBlocks = NumBlocks(numPixels);
+
+    // sq holds dr^2, dg^2, db^2, da^2; cross holds dr*dg, dg*db, db*dr
+    long long sq[4] = { 0, 0, 0, 0 };
+    long long cross[3] = { 0, 0, 0 };
+
+    #pragma omp parallel
+    {
+        long long localSq[4] = { 0, 0, 0, 0 };
+        long long localCross[3] = { 0, 0, 0 };
+
+        #pragma omp for schedule(static)
+        for (int blk = 0; blk < numBlocks; blk++) {
+            int begin = blk * BLOCK_PIXELS;
+            int end = STMin(begin + BLOCK_PIXELS, numPixels);
+            int i = begin;
+
+#ifdef __SSE2__
+            // 32-bit lanes: r g b a squares, and rg gb br aa products.
+            // Each product is at most 255^2 so a block cannot overflow.
+            __m128i zero = _mm_setzero_si128();
+            __m128i accSq = zero, accCross = zero;
+            for (; i + 4 <= end; i += 4) {
+                __m128i va = _mm_loadu_si128((const __m128i*)(pa + 4*i));
+                __m128i vb = _mm_loadu_si128((const __m128i*)(pb + 4*i));
+                __m128i d[2];
+                d[0] = _mm_sub_epi16(_mm_unpacklo_epi8(va, zero), _mm_unpacklo_epi8(vb, zero));
+                d[1] = _mm_sub_epi16(_mm_unpackhi_epi8(va, zero), _mm_unpackhi_epi8(vb, zero));
+                for (int k = 0; k < 2; k++) {
+                    // (g, b, r, a) for each of the two pixels
+                    __m128i rot = _mm_shufflehi_epi16(
+                        _mm_shufflelo_epi16(d[k], _MM_SHUFFLE(3,0,2,1)),
+                        _MM_SHUFFLE(3,0,2,1));
+                    __m128i lo = _mm_mullo_epi16(d[k], d[k]);
+                    __m128i hi = _mm_mulhi_epi16(d[k], d[k]);
+                    accSq = _mm_add_epi32(accSq, _mm_unpacklo_epi16(lo, hi));
+                    accSq = _mm_add_epi32(accSq, _mm_unpackhi_epi16(lo, hi));
+                    lo = _mm_mullo_epi16(d[k], rot);
+                    hi = _mm_mulhi_epi16(d[k], rot);
+                    accCross = _mm_add_epi32(accCross, _mm_unpacklo_epi16(lo, hi));
+                    accCross = _mm_add_epi32(accCross, _mm_unpackhi_epi16(lo, hi));
+                }
+            }
+            int s[4], x[4];
+            _mm_storeu_si128((__m128i*)s, accSq);
+            _mm_storeu_si128((__m128i*)x, accCross);
+            for (int c = 0; c < 4; c++)
+                localSq[c] += s[c];
+            for (int c = 0; c < 3; c++)
+                localCross[c] += x[c];
+#endif
+
+            for (; i < end; i++) {
+                int d[4];
+                for (int c = 0; c < 4; c++)
+                    d[c] = int(pa[4*i+c]) - int(pb[4*i+c]);
+                for (int c = 0; c < 4; c++)
+                    localSq[c] += d[c]*d[c];
+                localCross[0] += d[0]*d[1];
+                localCross[1] += d[1]*d[2];
+                localCross[2] += d[2]*d[0];
+            }
+        }
+
+        #pragma omp critical
+        {
+            for (int c = 0; c < 4; c++)
+                sq[c] += localSq[c];
+            for (int c = 0; c < 3; c++)
+                cross[c] += localCross[c];
+        }
+    }
+
+    double norm = (numPixels > 0) ? 1.0 / (double(numPixels) * 255.0 * 255.0) : 0.0;
+    for (int c = 0; c < 4; c++)
+        mse[c] = float(sq[c] * norm);
+
+    double wr = LUMA_R, wg = LUMA_G, wb = LUMA_B;
+    double luma = wr*wr*sq[0] + wg*wg*sq[1] + wb*wb*sq[2]
+                + 2.0*(wr*wg*cross[0] + wg*wb*cross[1] + wb*wr*cross[2]);
+    mse[LUMINANCE] = float(STMax(luma, 0.0) * norm);
+}
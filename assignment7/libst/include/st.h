@@ -18,6 +18,7 @@
 #include "STColor4ub.h"
 #include "STFont.h"
 #include "STImage.h"
+#include "STImageStats.h"
 #include "STJoystick.h"
 #include "STPoint2.h"
 #include "STPoint3.h"
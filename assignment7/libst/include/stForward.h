@@ -15,6 +15,7 @@ struct STColor4f;
 struct STColor4ub;
 class STFont;
 class STImage;
+class STImageStats;
 class STJoystick;
 struct STPoint2;
 struct STPoint3;
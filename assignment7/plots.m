@@ -4,52 +4,44 @@
 
 close all; clear all;
 
-% mandrill
+% rate-distortion curves from a sweep, e.g.
+%   ./MicroUI -sweep sweep.csv assignment7images/Mandrill.png assignment7images/MonaLisa.png
+
+results = readtable('wavelet/sweep.csv', 'Delimiter', ',');
+images = unique(results.image, 'stable');
 
 figure();
 hold on;
 
-entropy = [5.540663 5.537652 5.529445 5.476813 5.178717 4.265658 2.49727];
-psnr = [39.688141 38.638695 38.60318 38.26778 32.315872 21.209816 13.428112];
-
-plot(entropy, psnr);
+for i = 1:numel(images)
+    rows = strcmp(results.image, images{i});
+    plot(results.entropy(rows), results.psnr(rows), '-o');
+end
 
-% mona lisa
+xlabel('entropy');
+ylabel('PSNR');
+legend(images, 'Interpreter', 'none');
 
-entropy = [4.441130 4.420294 4.417159 4.377809 4.091026 3.184715 1.475442];
-psnr = [40.627651 39.267334 38.234413 34.163448 24.817711 16.815660 11.832013];
+figure();
+hold on;
 
-plot(entropy, psnr, 'r');
+for i = 1:numel(images)
+    rows = strcmp(results.image, images{i});
+    plot(results.bpp(rows), results.psnr(rows), '-o');
+end
 
-xlabel('entropy');
+xlabel('coded bits per pixel');
 ylabel('PSNR');
-legend('mandrill', 'mona lisa');
-
-
-% quality: 0.000000
-% PSNR: 40.627651
-% entropy: 4.441130
-% 
-% quality: 0.100000
-% PSNR: 39.267334
-% entropy: 4.420294
-% 
-% quality: 0.200000
-% PSNR: 38.234413
-% entropy: 4.417159
-% 
-% quality: 0.300000
-% PSNR: 34.163448
-% entropy: 4.377809
-% 
-% quality: 0.500000
-% PSNR: 24.817711
-% entropy: 4.091026
-% 
-% quality: 0.750000
-% PSNR: 16.815660
-% entropy: 3.184715
-% 
-% quality: 1.000000
-% PSNR: 11.832013
-% entropy: 1.475442
+legend(images, 'Interpreter', 'none');
+
+figure();
+hold on;
+
+for i = 1:numel(images)
+    rows = strcmp(results.image, images{i});
+    plot(results.bpp(rows), results.msssim(rows), '-o');
+end
+
+xlabel('coded bits per pixel');
+ylabel('MS-SSIM');
+legend(images, 'Interpreter', 'none');
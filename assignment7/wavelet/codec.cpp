@@ -0,0 +1,812 @@
+// codec.cpp
+#include "codec.h"
+#include <stdio.h>
+#include <string.h>
+#include <math.h>
+
+using namespace std;
+
+// side of the blocks a subband is coded in
+#define CODEC_BLOCK_SIZE 64
+
+#define CODEC_VERSION 1
+#define CODEC_HEADER_SIZE 28
+
+// flags
+#define CODEC_LOSSLESS 1
+
+//
+// Adaptive binary range coder, the one LZMA uses: probabilities of a
+// zero are 11 bits and move 1/32 of the way towards every coded bit.
+//
+#define PROB_BITS 11
+#define PROB_INIT (1 << (PROB_BITS - 1))
+#define PROB_MOVE_BITS 5
+#define RANGE_TOP (1u << 24)
+
+typedef unsigned short Prob;
+
+class RangeEncoder
+{
+public:
+    RangeEncoder(vector<unsigned char>& out)
+        : mOut(out), mLow(0), mRange(0xFFFFFFFFu), mCache(0), mCacheSize(1)
+    {
+    }
+
+    //
+    // Code a bit with an adaptive probability. Returns the bit.
+    //
+    int Bit(Prob& prob, int bit)
+    {
+        unsigned int bound = (mRange >> PROB_BITS) * prob;
+        if(bit)
+        {
+            mLow += bound;
+            mRange -= bound;
+            prob -= prob >> PROB_MOVE_BITS;
+        }
+        else
+        {
+            mRange = bound;
+            prob += ((1 << PROB_BITS) - prob) >> PROB_MOVE_BITS;
+        }
+        while(mRange < RANGE_TOP)
+        {
+            mRange <<= 8;
+            ShiftLow();
+        }
+        return bit;
+    }
+
+    //
+    // Code a bit with probability 1/2. Returns the bit.
+    //
+    int Direct(int bit)
+    {
+        mRange >>= 1;
+        if(bit)
+            mLow += mRange;
+        while(mRange < RANGE_TOP)
+        {
+            mRange <<= 8;
+            ShiftLow();
+        }
+        return bit;
+    }
+
+    void Flush()
+    {
+        for(int i = 0; i < 5; i++)
+            ShiftLow();
+    }
+
+private:
+    void ShiftLow()
+    {
+        if((unsigned int)mLow < 0xFF000000u || (mLow >> 32) != 0)
+        {
+            unsigned char carry = (unsigned char)(mLow >> 32);
+            unsigned char byte = mCache;
+            do
+            {
+                mOut.push_back((unsigned char)(byte + carry));
+                byte = 0xFF;
+            } while(--mCacheSize != 0);
+            mCache = (unsigned char)(mLow >> 24);
+        }
+        mCacheSize++;
+        mLow = (mLow & 0x00FFFFFFu) << 8;
+    }
+
+    vector<unsigned char>& mOut;
+    unsigned long long mLow;
+    unsigned int mRange;
+    unsigned char mCache;
+    unsigned long long mCacheSize;
+};
+
+
+class RangeDecoder
+{
+public:
+    RangeDecoder(const unsigned char* data, size_t size)
+        : mData(data), mEnd(data + size), mRange(0xFFFFFFFFu), mCode(0)
+    {
+        for(int i = 0; i < 5; i++)
+            mCode = (mCode << 8) | Next();
+    }
+
+    //
+    // Decode a bit with an adaptive probability. The bit passed in
+    // is ignored, so the coding loops can be shared with the encoder.
+    //
+    int Bit(Prob& prob, int)
+    {
+        unsigned int bound = (mRange >> PROB_BITS) * prob;
+        int bit;
+        if(mCode < bound)
+        {
+            mRange = bound;
+            prob += ((1 << PROB_BITS) - prob) >> PROB_MOVE_BITS;
+            bit = 0;
+        }
+        else
+        {
+            mCode -= bound;
+            mRange -= bound;
+            prob -= prob >> PROB_MOVE_BITS;
+            bit = 1;
+        }
+        while(mRange < RANGE_TOP)
+        {
+            mRange <<= 8;
+            mCode = (mCode << 8) | Next();
+        }
+        return bit;
+    }
+
+    int Direct(int)
+    {
+        mRange >>= 1;
+        int bit = 0;
+        if(mCode >= mRange)
+        {
+            mCode -= mRange;
+            bit = 1;
+        }
+        while(mRange < RANGE_TOP)
+        {
+            mRange <<= 8;
+            mCode = (mCode << 8) | Next();
+        }
+        return bit;
+    }
+
+private:
+    // a truncated stream reads as zeros
+    unsigned int Next() { return (mData < mEnd) ? *mData++ : 0; }
+
+    const unsigned char* mData;
+    const unsigned char* mEnd;
+    unsigned int mRange;
+    unsigned int mCode;
+};
+
+
+//
+// The adaptive probabilities of one subband.
+//
+struct BandContexts
+{
+    // significance, by the significant neighbours: horizontal (0-2),
+    // vertical (0-2) and whether any diagonal one is
+    Prob sig[18];
+    // whether any of a run of four quiet coefficients becomes significant
+    Prob run;
+    // refinement, for the first refinement of a coefficient and the rest
+    Prob refine[2];
+    // bit tree for the number of bit planes of a block
+    Prob planes[32];
+
+    BandContexts()
+    {
+        Prob* p = sig;
+        for(size_t i = 0; i < sizeof(*this) / sizeof(Prob); i++)
+            p[i] = PROB_INIT;
+    }
+};
+
+
+//
+// True if the four coefficients at s and their neighbours are all
+// insignificant. Rows of the state are W bytes apart.
+//
+static inline bool quiet(const unsigned char* s, int W)
+{
+    unsigned char any = 0;
+    for(int k = -1; k <= 4; k++)
+        any |= s[k - W] | s[k] | s[k + W];
+    return any == 0;
+}
+
+
+//
+// Code the magnitudes and signs of a bw x bh block, bit plane by bit
+// plane from the top. With the encoder, mag, sign and numPlanes are
+// read; with the decoder they are written (mag and sign must be zero).
+//
+// state has a border of one coefficient around the block, and holds 0
+// for a coefficient that is not significant yet, 1 once it is, and 2
+// once it has been refined.
+//
+template <class Coder>
+static void code_block(Coder& coder, BandContexts& ctx, unsigned int* mag,
+                       unsigned char* sign, int bw, int bh, int& numPlanes,
+                       unsigned char* state)
+{
+    int m = 1;
+    for(int b = 4; b >= 0; b--)
+        m = (m << 1) | coder.Bit(ctx.planes[m], (numPlanes >> b) & 1);
+    numPlanes = m - 32;
+
+    int W = bw + 2;
+    memset(state, 0, W * (bh + 2));
+    for(int p = numPlanes - 1; p >= 0; p--)
+    {
+        for(int y = 0; y < bh; y++)
+        {
+            unsigned char* s = state + (y + 1) * W + 1;
+            unsigned int* row = mag + y * bw;
+            unsigned char* rowSign = sign + y * bw;
+            int end = 0;
+            for(int x = 0; x < bw; x++)
+            {
+                // a run of four that has nothing significant around it
+                // usually stays that way, and costs a single bit
+                if(x >= end && (x & 3) == 0 && x + 4 <= bw && quiet(s + x, W))
+                {
+                    int any = ((row[x] | row[x+1] | row[x+2] | row[x+3]) >> p) & 1;
+                    if(!coder.Bit(ctx.run, any))
+                    {
+                        x += 3;
+                        continue;
+                    }
+                    end = x + 4;
+                }
+
+                unsigned char* t = s + x;
+                if(*t)
+                {
+                    int bit = coder.Bit(ctx.refine[*t - 1], (row[x] >> p) & 1);
+                    row[x] |= (unsigned int)bit << p;
+                    *t = 2;
+                }
+                else
+                {
+                    int h = (t[-1] != 0) + (t[1] != 0);
+                    int v = (t[-W] != 0) + (t[W] != 0);
+                    int d = (t[-W-1] | t[-W+1] | t[W-1] | t[W+1]) != 0;
+                    if(coder.Bit(ctx.sig[(h * 3 + v) * 2 + d], (row[x] >> p) & 1))
+                    {
+                        row[x] |= 1u << p;
+                        rowSign[x] = (unsigned char)coder.Direct(rowSign[x]);
+                        *t = 1;
+                    }
+                }
+            }
+        }
+    }
+}
+
+
+//
+// Code the quantized (or, for lossless streams, the integer transform)
+// coefficients of a subband as 64x64 blocks.
+//
+template <class T>
+static void encode_band(const T* plane, int stride, const Subband& band,
+                        vector<unsigned char>& out)
+{
+    const int B = CODEC_BLOCK_SIZE;
+    vector<unsigned int> mag(B * B);
+    vector<unsigned char> sign(B * B);
+    vector<unsigned char> state((B + 2) * (B + 2));
+    RangeEncoder coder(out);
+    BandContexts ctx;
+
+    for(int by = 0; by < band.height; by += B)
+    {
+        for(int bx = 0; bx < band.width; bx += B)
+        {
+            int bw = min(B, band.width - bx);
+            int bh = min(B, band.height - by);
+
+            unsigned int bits = 0;
+            for(int y = 0; y < bh; y++)
+            {
+                const T* src = plane + (size_t)(band.y + by + y) * stride + band.x + bx;
+                for(int x = 0; x < bw; x++)
+                {
+                    unsigned int m = (unsigned int)abs((int)src[x]);
+                    mag[y * bw + x] = m;
+                    sign[y * bw + x] = src[x] < 0;
+                    bits |= m;
+                }
+            }
+            int numPlanes = 0;
+            while(numPlanes < 31 && (bits >> numPlanes))
+                numPlanes++;
+
+            code_block(coder, ctx, &mag[0], &sign[0], bw, bh, numPlanes, &state[0]);
+        }
+    }
+    coder.Flush();
+}
+
+
+template <class T>
+static void decode_band(const unsigned char* data, size_t size, const Subband& band,
+                        T* plane, int stride)
+{
+    const int B = CODEC_BLOCK_SIZE;
+    vector<unsigned int> mag(B * B);
+    vector<unsigned char> sign(B * B);
+    vector<unsigned char> state((B + 2) * (B + 2));
+    RangeDecoder coder(data, size);
+    BandContexts ctx;
+
+    for(int by = 0; by < band.height; by += B)
+    {
+        for(int bx = 0; bx < band.width; bx += B)
+        {
+            int bw = min(B, band.width - bx);
+            int bh = min(B, band.height - by);
+            fill(mag.begin(), mag.end(), 0);
+            fill(sign.begin(), sign.end(), 0);
+            int numPlanes = 0;
+            code_block(coder, ctx, &mag[0], &sign[0], bw, bh, numPlanes, &state[0]);
+
+            for(int y = 0; y < bh; y++)
+            {
+                T* dst = plane + (size_t)(band.y + by + y) * stride + band.x + bx;
+                for(int x = 0; x < bw; x++)
+                {
+                    // at most 31 planes, so this fits
+                    int m = (int)mag[y * bw + x];
+                    dst[x] = (T)(sign[y * bw + x] ? -m : m);
+                }
+            }
+        }
+    }
+}
+
+
+//
+// The reversible color transform of JPEG 2000 and its inverse.
+//
+static inline void forward_color(const STColor4ub& c, int& y, int& u, int& v)
+{
+    y = (c.r + 2*c.g + c.b) >> 2;
+    u = c.b - c.g;
+    v = c.r - c.g;
+}
+
+
+static inline STColor4ub inverse_color(int y, int u, int v)
+{
+    int g = y - ((u + v) >> 2);
+    int r = v + g;
+    int b = u + g;
+    return STColor4ub((unsigned char)max(0, min(255, r)),
+                      (unsigned char)max(0, min(255, g)),
+                      (unsigned char)max(0, min(255, b)), 255);
+}
+
+
+static void put32(unsigned char* p, unsigned int v)
+{
+    p[0] = (unsigned char)v;
+    p[1] = (unsigned char)(v >> 8);
+    p[2] = (unsigned char)(v >> 16);
+    p[3] = (unsigned char)(v >> 24);
+}
+
+
+static unsigned int get32(const unsigned char* p)
+{
+    return p[0] | (p[1] << 8) | (p[2] << 16) | ((unsigned int)p[3] << 24);
+}
+
+
+void EncodeImage(const STImage* image, const CodecParams& params,
+                 vector<unsigned char>& stream)
+{
+    int width = image->GetWidth();
+    int height = image->GetHeight();
+    const int numChannels = 3;
+
+    const STColor4ub* pixels = image->GetPixels();
+    size_t numPixels = (size_t)width * height;
+    vector<Subband> bands;
+    WaveletSubbands(width, height, 0, params.tileSize, bands);
+
+    // every subband of every channel on its own, coarse to fine
+    int numChunks = (int)bands.size() * numChannels;
+    vector< vector<unsigned char> > chunks(numChunks);
+
+    if(params.lossless)
+    {
+        IntegerImage planes(width, height, numChannels);
+        short* py = planes.GetPlane(0);
+        short* pu = planes.GetPlane(1);
+        short* pv = planes.GetPlane(2);
+        for(size_t i = 0; i < numPixels; i++)
+        {
+            int y, u, v;
+            forward_color(pixels[i], y, u, v);
+            py[i] = (short)y;
+            pu[i] = (short)u;
+            pv[i] = (short)v;
+        }
+        WaveletForwardInteger(planes, 0, params.tileSize);
+
+        #pragma omp parallel for schedule(dynamic)
+        for(int k = 0; k < numChunks; k++)
+        {
+            int band = k / numChannels, c = k % numChannels;
+            encode_band(planes.GetPlane(c), width, bands[band], chunks[k]);
+        }
+    }
+    else
+    {
+        PlanarImage planes(width, height, numChannels);
+        float* py = planes.GetPlane(0);
+        float* pu = planes.GetPlane(1);
+        float* pv = planes.GetPlane(2);
+        for(size_t i = 0; i < numPixels; i++)
+        {
+            int y, u, v;
+            forward_color(pixels[i], y, u, v);
+            py[i] = y / 255.0f;
+            pu[i] = u / 255.0f;
+            pv[i] = v / 255.0f;
+        }
+        WaveletForward(planes, params.wavelet, 0, params.tileSize);
+
+        Quantizer quantizer;
+        QuantizerParams qparams;
+        qparams.quality = params.quality;
+        quantizer.Setup(width, height, params.tileSize, qparams);
+        QuantizedImage quantized;
+        quantizer.Quantize(planes, quantized);
+
+        #pragma omp parallel for schedule(dynamic)
+        for(int k = 0; k < numChunks; k++)
+        {
+            int band = k / numChannels, c = k % numChannels;
+            encode_band(quantized.GetPlane(c), width, bands[band], chunks[k]);
+        }
+    }
+
+    size_t size = CODEC_HEADER_SIZE + 4 * (size_t)numChunks;
+    for(int k = 0; k < numChunks; k++)
+        size += chunks[k].size();
+    stream.resize(size);
+
+    unsigned char* p = &stream[0];
+    memcpy(p, "WVC1", 4);
+    p[4] = CODEC_VERSION;
+    p[5] = (unsigned char)(params.lossless ? WAVELET_CDF53 : params.wavelet);
+    p[6] = (unsigned char)numChannels;
+    p[7] = params.lossless ? CODEC_LOSSLESS : 0;
+    put32(p + 8, width);
+    put32(p + 12, height);
+    put32(p + 16, max(params.tileSize, 0));
+    unsigned int quality;
+    memcpy(&quality, &params.quality, 4);
+    put32(p + 20, quality);
+    put32(p + 24, numChunks);
+    p += CODEC_HEADER_SIZE;
+    for(int k = 0; k < numChunks; k++, p += 4)
+        put32(p, (unsigned int)chunks[k].size());
+    for(int k = 0; k < numChunks; k++)
+    {
+        if(!chunks[k].empty())
+            memcpy(p, &chunks[k][0], chunks[k].size());
+        p += chunks[k].size();
+    }
+}
+
+
+//
+// Undo the color transform of the planes of a decoded image.
+//
+static void to_pixels(const IntegerImage& planes, STColor4ub* pixels)
+{
+    const short* py = planes.GetPlane(0);
+    const short* pu = planes.GetPlane(1);
+    const short* pv = planes.GetPlane(2);
+    size_t numPixels = (size_t)planes.GetWidth() * planes.GetHeight();
+    for(size_t i = 0; i < numPixels; i++)
+        pixels[i] = inverse_color(py[i], pu[i], pv[i]);
+}
+
+
+//
+// A corrupted stream can decode to any float, so the samples are
+// clamped far outside the color range before they are rounded, which
+// keeps the integer color transform from overflowing.
+//
+static inline int to_level(float value)
+{
+    return (int)lrintf(max(-4096.0f, min(4096.0f, value)) * 255.0f);
+}
+
+
+static void to_pixels(const PlanarImage& planes, STColor4ub* pixels)
+{
+    const float* py = planes.GetPlane(0);
+    const float* pu = planes.GetPlane(1);
+    const float* pv = planes.GetPlane(2);
+    size_t numPixels = (size_t)planes.GetWidth() * planes.GetHeight();
+    for(size_t i = 0; i < numPixels; i++)
+        pixels[i] = inverse_color(to_level(py[i]), to_level(pu[i]), to_level(pv[i]));
+}
+
+
+//
+// Decode a stream, either at 1/2^level of the resolution or, with a
+// region, just the rectangle (x, y, width, height). The chunks of the
+// details finer than the level, and of the tiles outside the
+// rectangle, are skipped without being decoded.
+//
+static STImage* decode(const unsigned char* data, size_t size, int level, bool region,
+                       int x, int y, int regionWidth, int regionHeight)
+{
+    if(size < CODEC_HEADER_SIZE || memcmp(data, "WVC1", 4) != 0 || data[4] != CODEC_VERSION)
+    {
+        fprintf(stderr, "DecodeImage() - Not a wavelet stream.\n");
+        return NULL;
+    }
+    int wavelet = data[5];
+    int numChannels = data[6];
+    bool lossless = (data[7] & CODEC_LOSSLESS) != 0;
+    int width = (int)get32(data + 8);
+    int height = (int)get32(data + 12);
+    int tileSize = (int)get32(data + 16);
+    float quality;
+    unsigned int bits = get32(data + 20);
+    memcpy(&quality, &bits, 4);
+    unsigned int numChunks = get32(data + 24);
+
+    if(wavelet >= NUM_WAVELETS || numChannels != 3 || width <= 0 || height <= 0 ||
+       (double)width * height > (1 << 28) || tileSize < 0 || tileSize > (1 << 28) ||
+       (lossless && wavelet != WAVELET_CDF53))
+    {
+        fprintf(stderr, "DecodeImage() - Bad stream header.\n");
+        return NULL;
+    }
+    // every tile has at least one chunk per channel, so tiles too small
+    // for the stream to hold are rejected before the bands are listed
+    int tile = (tileSize > 0) ? tileSize : max(width, height);
+    double numTiles = (double)((width + tile - 1) / tile) * ((height + tile - 1) / tile);
+    if(numTiles * numChannels > (double)(size - CODEC_HEADER_SIZE) / 4)
+    {
+        fprintf(stderr, "DecodeImage() - Bad stream header.\n");
+        return NULL;
+    }
+    vector<Subband> bands;
+    WaveletSubbands(width, height, 0, tileSize, bands);
+    if(numChunks != bands.size() * numChannels ||
+       size < CODEC_HEADER_SIZE + 4 * (size_t)numChunks)
+    {
+        fprintf(stderr, "DecodeImage() - Bad stream header.\n");
+        return NULL;
+    }
+
+    vector<size_t> offsets(numChunks + 1);
+    offsets[0] = CODEC_HEADER_SIZE + 4 * (size_t)numChunks;
+    for(unsigned int k = 0; k < numChunks; k++)
+        offsets[k + 1] = offsets[k] + get32(data + CODEC_HEADER_SIZE + 4 * k);
+    if(offsets[numChunks] > size)
+    {
+        fprintf(stderr, "DecodeImage() - Stream is truncated.\n");
+        return NULL;
+    }
+
+    if(region)
+    {
+        regionWidth = min(x + regionWidth, width) - max(x, 0);
+        regionHeight = min(y + regionHeight, height) - max(y, 0);
+        x = max(x, 0);
+        y = max(y, 0);
+        if(regionWidth <= 0 || regionHeight <= 0)
+        {
+            fprintf(stderr, "DecodeRegion() - The region is outside the image.\n");
+            return NULL;
+        }
+        level = 0;
+    }
+    // no side is over 2^28, so any deeper level is a single pixel too
+    level = max(0, min(level, 28));
+
+    // the chunks the output depends on
+    vector<int> needed;
+    for(unsigned int k = 0; k < numChunks; k++)
+    {
+        const Subband& band = bands[k / numChannels];
+        if(band.orientation != SUBBAND_LL && band.level <= level)
+            continue;
+        int tx = band.x / tile * tile, ty = band.y / tile * tile;
+        if(region && (tx >= x + regionWidth || tx + tile <= x ||
+                      ty >= y + regionHeight || ty + tile <= y))
+            continue;
+        needed.push_back(k);
+    }
+
+    // For a preview, the bands coarser than the level are the whole
+    // transform of the preview image, with every tile level-times
+    // smaller. If all the tiles have that many levels, they are decoded
+    // straight into that smaller transform, so the buffers and the
+    // inverse only cost about 1/4^level of the full size.
+    int outWidth = width, outHeight = height, outTileSize = tileSize;
+    vector<Subband> targets(numChunks);
+    for(size_t n = 0; n < needed.size(); n++)
+        targets[needed[n]] = bands[needed[n] / numChannels];
+    bool compact = !region && level > 0;
+    for(size_t k = 0; compact && k < bands.size(); k++)
+        compact = bands[k].orientation != SUBBAND_LL || bands[k].level >= level;
+    if(compact)
+    {
+        // the bands of a tile come first in both lists, coarse to fine
+        vector<Subband> small;
+        outWidth = 0;
+        outHeight = 0;
+        for(int tx = 0; tx < width; tx += tile)
+            outWidth += (min(tile, width - tx) + (1 << level) - 1) >> level;
+        for(int ty = 0; ty < height; ty += tile)
+            outHeight += (min(tile, height - ty) + (1 << level) - 1) >> level;
+        outTileSize = (tileSize > 0) ? (tileSize + (1 << level) - 1) >> level : 0;
+        WaveletSubbands(outWidth, outHeight, 0, outTileSize, small);
+        if(small.size() * numChannels != needed.size())
+            compact = false;
+        for(size_t n = 0; compact && n < needed.size(); n++)
+        {
+            const Subband& target = small[n / numChannels];
+            const Subband& band = bands[needed[n] / numChannels];
+            if(target.width != band.width || target.height != band.height)
+                compact = false;
+            targets[needed[n]] = target;
+        }
+        if(!compact)
+        {
+            outWidth = width;
+            outHeight = height;
+            outTileSize = tileSize;
+            for(size_t n = 0; n < needed.size(); n++)
+                targets[needed[n]] = bands[needed[n] / numChannels];
+        }
+    }
+
+    STImage* image = NULL;
+    if(lossless)
+    {
+        IntegerImage planes(outWidth, outHeight, numChannels);
+        #pragma omp parallel for schedule(dynamic)
+        for(int n = 0; n < (int)needed.size(); n++)
+        {
+            int k = needed[n];
+            decode_band(data + offsets[k], offsets[k + 1] - offsets[k], targets[k],
+                        planes.GetPlane(k % numChannels), outWidth);
+        }
+
+        IntegerImage out;
+        IntegerImage* result = &planes;
+        if(region)
+        {
+            WaveletInverseIntegerRegion(planes, x, y, regionWidth, regionHeight, out, 0, tileSize);
+            result = &out;
+        }
+        else if(compact || level == 0)
+            WaveletInverseInteger(planes, 0, outTileSize);
+        else
+        {
+            WaveletInverseInteger(planes, 0, tileSize, level);
+            WaveletLowBand(planes, level, 0, tileSize, out);
+            result = &out;
+        }
+        image = new STImage(result->GetWidth(), result->GetHeight());
+        to_pixels(*result, image->GetPixels());
+    }
+    else
+    {
+        Quantizer quantizer;
+        QuantizerParams qparams;
+        qparams.quality = quality;
+        quantizer.Setup(outWidth, outHeight, outTileSize, qparams);
+        QuantizedImage quantized(outWidth, outHeight, numChannels);
+        #pragma omp parallel for schedule(dynamic)
+        for(int n = 0; n < (int)needed.size(); n++)
+        {
+            int k = needed[n];
+            decode_band(data + offsets[k], offsets[k + 1] - offsets[k], targets[k],
+                        quantized.GetPlane(k % numChannels), outWidth);
+        }
+        PlanarImage planes;
+        quantizer.Dequantize(quantized, planes);
+
+        PlanarImage out;
+        PlanarImage* result = &planes;
+        if(region)
+        {
+            WaveletInverseRegion(planes, (WaveletType)wavelet, x, y, regionWidth, regionHeight,
+                                 out, 0, tileSize);
+            result = &out;
+        }
+        else if(compact || level == 0)
+            WaveletInverse(planes, (WaveletType)wavelet, 0, outTileSize);
+        else
+        {
+            WaveletInverse(planes, (WaveletType)wavelet, 0, tileSize, level);
+            WaveletLowBand(planes, level, 0, tileSize, out);
+            result = &out;
+        }
+        image = new STImage(result->GetWidth(), result->GetHeight());
+        to_pixels(*result, image->GetPixels());
+    }
+    return image;
+}
+
+
+STImage* DecodeImage(const unsigned char* data, size_t size, int level)
+{
+    return decode(data, size, level, false, 0, 0, 0, 0);
+}
+
+
+STImage* DecodeRegion(const unsigned char* data, size_t size, int x, int y,
+                      int width, int height)
+{
+    return decode(data, size, 0, true, x, y, width, height);
+}
+
+
+size_t CodedSize(const QuantizedImage& coeffs, int tileSize)
+{
+    int width = coeffs.GetWidth();
+    int numChannels = coeffs.GetChannels();
+    vector<Subband> bands;
+    WaveletSubbands(width, coeffs.GetHeight(), 0, tileSize, bands);
+
+    int numChunks = (int)bands.size() * numChannels;
+    size_t size = CODEC_HEADER_SIZE + 4 * (size_t)numChunks;
+    #pragma omp parallel
+    {
+        vector<unsigned char> chunk;
+        #pragma omp for schedule(dynamic) reduction(+:size)
+        for(int k = 0; k < numChunks; k++)
+        {
+            int band = k / numChannels, c = k % numChannels;
+            chunk.clear();
+            encode_band(coeffs.GetPlane(c), width, bands[band], chunk);
+            size += chunk.size();
+        }
+    }
+    return size;
+}
+
+
+static bool read_file(const string& filename, vector<unsigned char>& stream)
+{
+    FILE* file = fopen(filename.c_str(), "rb");
+    if(file == NULL)
+    {
+        fprintf(stderr, "LoadCompressed() - Could not open '%s'.\n", filename.c_str());
+        return false;
+    }
+    unsigned char buffer[65536];
+    size_t n;
+    while((n = fread(buffer, 1, sizeof(buffer), file)) > 0)
+        stream.insert(stream.end(), buffer, buffer + n);
+    fclose(file);
+    return !stream.empty();
+}
+
+
+STImage* LoadCompressed(const string& filename, int level)
+{
+    vector<unsigned char> stream;
+    if(!read_file(filename, stream))
+        return NULL;
+    return DecodeImage(&stream[0], stream.size(), level);
+}
+
+
+STImage* LoadCompressedRegion(const string& filename, int x, int y, int width, int height)
+{
+    vector<unsigned char> stream;
+    if(!read_file(filename, stream))
+        return NULL;
+    return DecodeRegion(&stream[0], stream.size(), x, y, width, height);
+}
@@ -0,0 +1,91 @@
+// codec.h
+#ifndef __CODEC_H__
+#define __CODEC_H__
+
+#include "st.h"
+#include "wavelet.h"
+#include "quantizer.h"
+#include <vector>
+
+//
+// Settings for the wavelet codec.
+//
+struct CodecParams
+{
+    WaveletType wavelet;
+    // the viewer's quality: 0 quantizes every band with a step of one
+    // 8-bit level, higher values quantize finer details more coarsely
+    float quality;
+    // tile size for the transform, 0 for a single tile
+    int tileSize;
+    // code the reversible integer 5/3 transform without quantizing
+    // it, so the image decodes bit-exactly; wavelet and quality are
+    // ignored
+    bool lossless;
+
+    CodecParams()
+        : wavelet(WAVELET_CDF97), quality(0.5f), tileSize(0), lossless(false)
+    {
+    }
+};
+
+//
+// Compress an image into a stream, replacing its contents.
+//
+// The pixels go through the reversible color transform of JPEG 2000
+// (Y = (R + 2G + B) / 4, U = B - G, V = R - G), the wavelet transform
+// and a deadzone quantizer. Every subband of every channel is then cut
+// into 64x64 blocks, and each block is coded bit plane by bit plane
+// with an adaptive binary range coder, using the significance of the
+// neighbouring coefficients as context (much like EBCOT, with a
+// single pass per plane). Subbands are coded independently and in
+// parallel, and their sizes are stored up front.
+//
+// Lossless streams skip the quantizer and code the coefficients of the
+// integer 5/3 transform (WaveletForwardInteger) instead.
+//
+// The stream starts with the magic "WVC1".
+//
+void EncodeImage(const STImage* image, const CodecParams& params,
+                 std::vector<unsigned char>& stream);
+
+//
+// Decompress a stream written by EncodeImage. Returns NULL if the
+// stream is not valid.
+//
+// With a level, the image comes out at 1/2^level of the resolution
+// (see WaveletLowBand) for a preview: the details finer than that are
+// neither decoded nor transformed.
+//
+STImage* DecodeImage(const unsigned char* data, size_t size, int level = 0);
+
+//
+// Decompress only the width x height rectangle at (x, y) of a stream.
+// Only the tiles the rectangle overlaps are decoded, and only the
+// coefficients it depends on are transformed (WaveletInverseRegion).
+//
+STImage* DecodeRegion(const unsigned char* data, size_t size, int x, int y,
+                      int width, int height);
+
+//
+// Decode a file holding a stream from EncodeImage (MicroUI -encode
+// writes them, usually with the extension .wvc), at 1/2^level of the
+// resolution. Returns NULL on error.
+//
+STImage* LoadCompressed(const std::string& filename, int level = 0);
+
+//
+// Decode a rectangle of a file holding a stream.
+//
+STImage* LoadCompressedRegion(const std::string& filename, int x, int y,
+                              int width, int height);
+
+//
+// Get the size of the stream the subband coder makes of quantized
+// coefficients from a transform with the given tile size, without
+// keeping it. This measures the rate of quantizer settings the stream
+// header cannot describe, such as the viewer's nonlinear ones.
+//
+size_t CodedSize(const QuantizedImage& coeffs, int tileSize);
+
+#endif //__CODEC_H__
@@ -11,6 +11,11 @@
 #include "stglut.h"
 
 #include <assert.h>
+
+#include "wavelet.h"
+#include "codec.h"
+#include "quantizer.h"
+#include "metrics.h"
 //
 // Include headers for UI clases.
 //
@@ -42,216 +47,98 @@ float g_quality = 0.1;
 float g_power = 0.9;
 bool g_nonlinearize = false;
 bool g_softclip = false;
+WaveletType g_wavelet = WAVELET_HAAR;
+int g_tileSize = 0;
 
 
-inline float signum(const float &v)
+inline unsigned char to_byte(float v)
 {
-    return v/fabsf(v);
-}
-
-
-STColor4ub quantize(STVector3 v, float level, float qfactor)
-{
-    if(level > 0)
-    {
-        v.x -= 0.5;
-        v.y -= 0.5;
-        v.z -= 0.5;
-
-        v.x = v.x / (powf(level, powf(qfactor,3)));
-        v.y = v.y / (powf(level, powf(qfactor,3)));
-        v.z = v.z / (powf(level, powf(qfactor,3)));
-        
-        if(g_nonlinearize)
-        {
-            float pow = g_power;
-            v.x = (v.x == 0) ? 0 : signum(v.x)*powf(fabsf(v.x), pow);
-            v.y = (v.y == 0) ? 0 : signum(v.y)*powf(fabsf(v.y), pow);
-            v.z = (v.z == 0) ? 0 : signum(v.z)*powf(fabsf(v.z), pow);
-        }
-
-        if(g_softclip)
-        {
-            v.x = v.x/(1.1-fabsf(v.x));
-            v.y = v.y/(1.1-fabsf(v.y));
-            v.z = v.z/(1.1-fabsf(v.z));
-        }
-        
-        v.x += 0.5;
-        v.y += 0.5;
-        v.z += 0.5;
-
-        if(v.x < 0) { v.x = 0; }
-        if(v.x > 1) { v.x = 1; }
-        if(v.y < 0) { v.y = 0; }
-        if(v.y > 1) { v.y = 1; }
-        if(v.z < 0) { v.z = 0; }
-        if(v.z > 1) { v.z = 1; }
-    }
-    
-    return STColor4ub(v.x*255, v.y*255, v.z*255, 255);
+    if(v < 0) { v = 0; }
+    if(v > 1) { v = 1; }
+    return (unsigned char)(v*255);
 }
 
 
-STColor4ub reverse_quantize(STVector3 v, float level, float qfactor)
+//
+// Transform an image with g_wavelet into planar coefficients.
+//
+void wavelet_transform(const STImage * in, PlanarImage & coeffs)
 {
-    if(level > 0)
-    {
-        v.x -= 0.5;
-        v.y -= 0.5;
-        v.z -= 0.5;
-        
-        v.x = v.x * (powf(level, powf(qfactor,3)));
-        v.y = v.y * (powf(level, powf(qfactor,3)));
-        v.z = v.z * (powf(level, powf(qfactor,3)));
-        
-        if(g_nonlinearize)
-        {
-            float pow = 1.0/g_power;
-            v.x = (v.x == 0) ? 0 : signum(v.x)*powf(fabsf(v.x), pow);
-            v.y = (v.y == 0) ? 0 : signum(v.y)*powf(fabsf(v.y), pow);
-            v.z = (v.z == 0) ? 0 : signum(v.z)*powf(fabsf(v.z), pow);
-        }
-        
-//        v.x = v.x/(1-fabsf(v.x));
-//        v.y = v.y/(1-fabsf(v.y));
-//        v.z = v.z/(1-fabsf(v.z));
-        
-        v.x += 0.5;
-        v.y += 0.5;
-        v.z += 0.5;
-
-        if(v.x < 0) { v.x = 0; }
-        if(v.x > 1) { v.x = 1; }
-        if(v.y < 0) { v.y = 0; }
-        if(v.y > 1) { v.y = 1; }
-        if(v.z < 0) { v.z = 0; }
-        if(v.z > 1) { v.z = 1; }
-    }
-
-    return STColor4ub(v.x*255, v.y*255, v.z*255, 255);
+    coeffs = PlanarImage(in);
+    WaveletForward(coeffs, g_wavelet, 0, g_tileSize);
 }
 
 
-void haar1d_forward(const STVector3 * in, STVector3 * out, int N, int stride)
+//
+// Set up a quantizer for the current sliders and switches.
+//
+void setup_quantizer(Quantizer & quantizer, int width, int height)
 {
-    for(int i = 0; i < N/2; i++)
-    {
-        // smooth
-        out[i*stride] = (in[i*2*stride] + in[i*2*stride+stride])/2.0;
-        // detail
-        out[N/2*stride+i*stride] = (in[i*2*stride] - in[i*2*stride+stride])/2.0 + STVector3(0.5, 0.5, 0.5);
-    }
+    QuantizerParams params;
+    params.quality = g_quality;
+    params.power = g_power;
+    params.nonlinearize = g_nonlinearize;
+    params.softclip = g_softclip;
+    quantizer.Setup(width, height, g_tileSize, params);
 }
 
 
-void haar_forward(const STImage * in, STImage * out)
+//
+// Draw quantized coefficients into an image: the low band as is, the
+// details offset to mid grey and clamped.
+//
+void show_quantized(const Quantizer & quantizer, const QuantizedImage & in, STImage * out)
 {
-    int width = in->GetWidth();
-    int height = in->GetHeight();
-    int size = width*height;
-    
-    STVector3 * buf1 = new STVector3[size];
-    STVector3 * buf2 = new STVector3[size];
-    
-    for(int y = 0; y < height; y++)
-    {
-        for(int x = 0; x < width; x++)
-        {
-            STColor4ub c = in->GetPixel(x, y);
-            buf1[y*width+x] = STVector3(c.r/255.0f, c.g/255.0f, c.b/255.0f);
-        }
-    }
-    
-    for(int N = width; N > 1; N /= 2)
+    int width = in.GetWidth();
+    const vector<Subband> & bands = quantizer.GetSubbands();
+    const int * r = in.GetPlane(0);
+    const int * g = in.GetPlane(1);
+    const int * b = in.GetPlane(2);
+    STColor4ub * pixels = out->GetPixels();
+    for(size_t k = 0; k < bands.size(); k++)
     {
-        // columns
-        for(int i = 0; i < N; i++)
-            haar1d_forward(buf1+i, buf2+i, N, width);
-        for(int i = 0; i < N; i++)
-            memcpy(buf1+i*width, buf2+i*width, N*sizeof(STVector3));
-        
-        // rows
-        for(int i = 0; i < N/2; i++)
-            haar1d_forward(buf1+i*width, buf2+i*width, N, 1);
-        for(int i = 0; i < N/2; i++)
-            memcpy(buf1+i*width, buf2+i*width, N*sizeof(STVector3));
-    }
-    
-    for(int y = 0; y < height; y++)
-    {
-        for(int x = 0; x < width; x++)
+        const Subband & band = bands[k];
+        int offset = (band.orientation == SUBBAND_LL) ? 0 : 127;
+        for(int y = band.y; y < band.y + band.height; y++)
         {
-            int level = max(ceilf(log2f(x+1)), ceilf(log2f(y+1)));
-            //float level = max((log2f(x+1)), (log2f(y+1)));
-            out->SetPixel(x, y, quantize(buf1[y*width+x], level, g_quality));
+            for(int x = band.x; x < band.x + band.width; x++)
+            {
+                int i = y*width+x;
+                pixels[i] = STColor4ub((unsigned char)max(0, min(255, r[i] + offset)),
+                                       (unsigned char)max(0, min(255, g[i] + offset)),
+                                       (unsigned char)max(0, min(255, b[i] + offset)),
+                                       255);
+            }
         }
     }
-    
-//    out->SetPixel(0, 0, STColor4ub(0, 255, 127));
-    
-    delete[] buf1;
-    delete[] buf2;
-}
-
-
-void haar1d_backward(const STVector3 * in, STVector3 * out, int N, int stride)
-{
-    for(int i = 0; i < N/2; i++)
-    {
-        // smooth
-        out[i*2*stride] = in[i*stride] + (in[N/2*stride+i*stride] - STVector3(0.5, 0.5, 0.5));
-        // detail
-        out[i*2*stride+stride] = in[i*stride] - (in[N/2*stride+i*stride] - STVector3(0.5, 0.5, 0.5));
-    }
 }
 
 
-void haar_backward(const STImage * in, STImage * out)
+//
+// Reconstruct an image from quantized coefficients of a transform with
+// the given wavelet and tile size.
+//
+void wavelet_backward(const Quantizer & quantizer, const QuantizedImage & in,
+                      WaveletType wavelet, int tileSize, STImage * out)
 {
-    int width = in->GetWidth();
-    int height = in->GetHeight();
-    int size = width*height;
-    
-    STVector3 * buf1 = new STVector3[size];
-    STVector3 * buf2 = new STVector3[size];
-    
-    for(int y = 0; y < height; y++)
-    {
-        for(int x = 0; x < width; x++)
-        {
-            STColor4ub c = in->GetPixel(x, y);
-            buf1[y*width+x] = STVector3(c.r/255.0f, c.g/255.0f, c.b/255.0f);
-        }
-    }
+    int width = in.GetWidth();
+    int height = in.GetHeight();
     
-    for(int N = 2; N <= width; N *= 2)
-    {
-        // rows
-        for(int i = 0; i < N/2; i++)
-            haar1d_backward(buf1+i*width, buf2+i*width, N, 1);
-        for(int i = 0; i < N/2; i++)
-            memcpy(buf1+i*width, buf2+i*width, N*sizeof(STVector3));
-        
-        // columns
-        for(int i = 0; i < N; i++)
-            haar1d_backward(buf1+i, buf2+i, N, width);
-        for(int i = 0; i < N; i++)
-            memcpy(buf1+i*width, buf2+i*width, N*sizeof(STVector3));
-    }
+    PlanarImage coeffs;
+    quantizer.Dequantize(in, coeffs);
+    WaveletInverse(coeffs, wavelet, 0, tileSize);
     
+    const float * r = coeffs.GetPlane(0);
+    const float * g = coeffs.GetPlane(1);
+    const float * b = coeffs.GetPlane(2);
     for(int y = 0; y < height; y++)
     {
         for(int x = 0; x < width; x++)
         {
-            int level = max(ceilf(log2f(x+1)), ceilf(log2f(y+1)));
-            //float level = max((log2f(x+1)), (log2f(y+1)));
-            out->SetPixel(x, y, reverse_quantize(buf1[y*width+x], level, g_quality));
+            int i = y*width+x;
+            out->SetPixel(x, y, STColor4ub(to_byte(r[i]), to_byte(g[i]), to_byte(b[i]), 255));
         }
     }
-    
-    delete[] buf1;
-    delete[] buf2;
 }
 
 
@@ -277,62 +164,127 @@ void diff(const STImage * a, const STImage * b, STImage * out)
 }
 
 
-float compute_psnr(const STImage * a, const STImage * b)
+//
+// Get the entropy of quantized coefficients in bits, with the channels
+// pooled into a single histogram.
+//
+float compute_entropy(const QuantizedImage & q)
 {
-    int width = a->GetWidth();
-    int height = a->GetHeight();
-    
-    float mse = 0;
-    float I_max = 0;
-    
-    for(int y = 0; y < height; y++)
+    size_t size = (size_t)q.GetWidth() * q.GetHeight();
+    int channels = q.GetChannels();
+    int lo = 0, hi = 0;
+    for(int c = 0; c < channels; c++)
     {
-        for(int x = 0; x < width; x++)
+        const int * p = q.GetPlane(c);
+        for(size_t i = 0; i < size; i++)
         {
-            STColor4ub c_a = a->GetPixel(x, y);
-            STColor4ub c_b = b->GetPixel(x, y);
-            float I_a = .299*(c_a.r/255.0f) + .587*(c_a.g/255.0f) + .114*(c_a.b/255.0f);
-            float I_b = .299*(c_b.r/255.0f) + .587*(c_b.g/255.0f) + .114*(c_b.b/255.0f);
-            mse += (I_b - I_a)*(I_b - I_a);
-            if(I_a > I_max)
-                I_max = I_a;
+            lo = min(lo, p[i]);
+            hi = max(hi, p[i]);
         }
     }
     
-    mse /= (width*height);
+    vector<unsigned int> histogram(hi - lo + 1, 0);
+    for(int c = 0; c < channels; c++)
+    {
+        const int * p = q.GetPlane(c);
+        for(size_t i = 0; i < size; i++)
+            histogram[p[i] - lo]++;
+    }
     
-    return 10*log10f(I_max*I_max/mse);
+    float total = (float)channels * size;
+    float entropy = 0;
+    for(size_t i = 0; i < histogram.size(); i++)
+    {
+        float p = histogram[i] / total;
+        if(p > 0)
+            entropy += p * log2f(p);
+    }
+    
+    return -entropy;
 }
 
 
-float compute_entropy(const STImage * i)
+//
+// The stages of the viewer, in order. Each one only depends on the
+// stages before it and on its own parameters:
+//
+//   transform    g_wavelet and g_tileSize
+//   quantize     g_quality, g_power, g_nonlinearize and g_softclip
+//   reconstruct  nothing else; also makes the difference image,
+//                PSNR and entropy
+//
+enum PipelineStage
 {
-    int width = i->GetWidth();
-    int height = i->GetHeight();
-    float bin[256];
-    memset(bin, 0, sizeof(float)*256);
-    
-    for(int y = 0; y < height; y++)
+    STAGE_TRANSFORM = 0,
+    STAGE_QUANTIZE,
+    STAGE_RECONSTRUCT,
+    NUM_STAGES
+};
+
+//
+// The parameters the cached stages were computed with.
+//
+struct PipelineParams
+{
+    WaveletType wavelet;
+    int tileSize;
+    float quality;
+    float power;
+    bool nonlinearize;
+    bool softclip;
+};
+
+static PlanarImage g_coefficients;
+static Quantizer g_quantizer;
+static QuantizedImage g_quantized;
+static PipelineParams g_pipelineParams;
+static int g_validStages = 0;
+static ImageMetrics g_metrics;
+static float g_entropy = 0;
+
+
+//
+// Bring the cached stages up to date with the current parameters,
+// rerunning only the first stage whose parameters changed and the
+// ones after it. Returns true if anything was recomputed.
+//
+bool update_pipeline()
+{
+    const PipelineParams & p = g_pipelineParams;
+    int first = g_validStages;
+    if(p.wavelet != g_wavelet || p.tileSize != g_tileSize)
+        first = min(first, (int)STAGE_TRANSFORM);
+    else if(p.quality != g_quality || p.power != g_power ||
+            p.nonlinearize != g_nonlinearize || p.softclip != g_softclip)
+        first = min(first, (int)STAGE_QUANTIZE);
+    
+    if(first >= NUM_STAGES)
+        return false;
+    
+    if(first <= STAGE_TRANSFORM)
+        wavelet_transform(g_original, g_coefficients);
+    if(first <= STAGE_QUANTIZE)
     {
-        for(int x = 0; x < width; x++)
-        {
-            STColor4ub c = i->GetPixel(x, y);
-            bin[c.r]++;
-            bin[c.g]++;
-            bin[c.b]++;
-        }
+        setup_quantizer(g_quantizer, g_original->GetWidth(), g_original->GetHeight());
+        g_quantizer.Quantize(g_coefficients, g_quantized);
+        show_quantized(g_quantizer, g_quantized, g_xformquantized);
     }
-    
-    float entropy = 0;
-    
-    for(int i = 0; i < 256; i++)
+    if(first <= STAGE_RECONSTRUCT)
     {
-        bin[i] /= 3*width*height;
-        if(bin[i] > 0)
-            entropy += bin[i] * log2f(bin[i]);
+        wavelet_backward(g_quantizer, g_quantized, g_wavelet, g_tileSize, g_reconstructed);
+        diff(g_original, g_reconstructed, g_difference);
+        ComputeMetrics(g_original, g_reconstructed, g_metrics, METRIC_PSNR | METRIC_SSIM);
+        g_entropy = compute_entropy(g_quantized);
     }
     
-    return -entropy;
+    g_pipelineParams.wavelet = g_wavelet;
+    g_pipelineParams.tileSize = g_tileSize;
+    g_pipelineParams.quality = g_quality;
+    g_pipelineParams.power = g_power;
+    g_pipelineParams.nonlinearize = g_nonlinearize;
+    g_pipelineParams.softclip = g_softclip;
+    g_validStages = NUM_STAGES;
+    return true;
 }
 
 
@@ -341,13 +293,13 @@ float compute_entropy(const STImage * i)
 //
 void DisplayCallback()
 {
-    haar_forward(g_original, g_xformquantized);
-    haar_backward(g_xformquantized, g_reconstructed);
-    
-    diff(g_original, g_reconstructed, g_difference);
-    
-    printf("PSNR: %f\n", compute_psnr(g_original, g_reconstructed));
-    printf("entropy: %f\n", compute_entropy(g_xformquantized));
+    // redraws that changed nothing, like expose events, only draw
+    if(update_pipeline())
+    {
+        printf("PSNR: %f\n", g_metrics.psnr[METRIC_LUMA]);
+        printf("SSIM: %f\n", g_metrics.ssim[METRIC_LUMA]);
+        printf("entropy: %f\n", g_entropy);
+    }
 
     glMatrixMode(GL_MODELVIEW);
     glLoadIdentity();
@@ -421,6 +373,18 @@ void KeyCallback(unsigned char key, int x, int y)
             printf("softclip: %i\n", g_softclip);
             redisplay = true;
             break;
+            
+        case 'w':
+            g_wavelet = (WaveletType)((g_wavelet + 1) % NUM_WAVELETS);
+            printf("wavelet: %s\n", WaveletName(g_wavelet));
+            redisplay = true;
+            break;
+            
+        case 't':
+            g_tileSize = g_tileSize ? 0 : WAVELET_TILE_SIZE;
+            printf("tiles: %i\n", g_tileSize);
+            redisplay = true;
+            break;
     }
     
     if(redisplay)
@@ -491,8 +455,275 @@ void Initialize()
     glEnable(GL_SMOOTH);
 }
 
+//
+// Parse a comma separated list of numbers.
+//
+vector<float> parse_list(const char * text)
+{
+    vector<float> values;
+    char * end;
+    for(;;)
+    {
+        float v = (float)strtod(text, &end);
+        if(end == text)
+            break;
+        values.push_back(v);
+        if(*end != ',')
+            break;
+        text = end + 1;
+    }
+    return values;
+}
+
+//
+// Parse a wavelet number, returning false if it isn't one of the
+// WaveletType values.
+//
+bool parse_wavelet(const char * text, WaveletType & wavelet)
+{
+    char * end;
+    long value = strtol(text, &end, 10);
+    if(end == text || *end != '\0' || value < 0 || value >= NUM_WAVELETS)
+        return false;
+    wavelet = (WaveletType)value;
+    return true;
+}
+
+
+//
+// The numbers for one image and one setting of a sweep.
+//
+struct SweepResult
+{
+    ImageMetrics metrics;
+    float entropy;
+    size_t bytes;
+};
+
+
+//
+// MicroUI -sweep out.csv [-wavelet n] [-tiles] [-quality q,q,...]
+//              [-power p,p,...] image...
+//
+// Measure the rate and distortion of every quality (and, with -power,
+// every power of the nonlinear quantizer) on every image, and write
+// one CSV row per image and setting with the PSNR, SSIM and MS-SSIM of
+// the luma, the entropy of the quantized coefficients and the size the
+// codec's coder makes of them.
+// Each image is transformed once; the settings then run in parallel.
+//
+int run_sweep(int argc, char ** argv)
+{
+    const char * usage = "usage: MicroUI -sweep out.csv [-wavelet n] [-tiles] "
+                         "[-quality q,q,...] [-power p,p,...] image...\n";
+    if(argc < 2)
+    {
+        fprintf(stderr, "%s", usage);
+        return 1;
+    }
+    const char * csvName = argv[0];
+    WaveletType wavelet = g_wavelet;
+    int tileSize = 0;
+    float defaultQualities[] = { 0, 0.1f, 0.2f, 0.3f, 0.5f, 0.75f, 1 };
+    vector<float> qualities(defaultQualities, defaultQualities + sizeof(defaultQualities)/sizeof(float));
+    vector<float> powers;
+    vector<const char *> images;
+    for(int i = 1; i < argc; i++)
+    {
+        if(strcmp(argv[i], "-wavelet") == 0 && i + 1 < argc)
+        {
+            if(!parse_wavelet(argv[++i], wavelet))
+            {
+                fprintf(stderr, "%swavelet n is 0 to %d\n", usage, NUM_WAVELETS - 1);
+                return 1;
+            }
+        }
+        else if(strcmp(argv[i], "-tiles") == 0)
+            tileSize = WAVELET_TILE_SIZE;
+        else if(strcmp(argv[i], "-quality") == 0 && i + 1 < argc)
+            qualities = parse_list(argv[++i]);
+        else if(strcmp(argv[i], "-power") == 0 && i + 1 < argc)
+            powers = parse_list(argv[++i]);
+        else
+            images.push_back(argv[i]);
+    }
+    
+    vector<QuantizerParams> settings;
+    for(size_t q = 0; q < qualities.size(); q++)
+    {
+        QuantizerParams params;
+        params.quality = qualities[q];
+        if(powers.empty())
+            settings.push_back(params);
+        for(size_t p = 0; p < powers.size(); p++)
+        {
+            params.power = powers[p];
+            params.nonlinearize = true;
+            settings.push_back(params);
+        }
+    }
+    
+    FILE * csv = fopen(csvName, "w");
+    if(csv == NULL)
+    {
+        fprintf(stderr, "Could not write '%s'.\n", csvName);
+        return 1;
+    }
+    fprintf(csv, "image,wavelet,tile,quality,power,nonlinear,psnr,ssim,msssim,entropy,bytes,bpp\n");
+    
+    for(size_t i = 0; i < images.size(); i++)
+    {
+        STTimer timer;
+        timer.Reset();
+        STImage original(images[i]);
+        int width = original.GetWidth();
+        int height = original.GetHeight();
+        
+        PlanarImage coeffs(&original);
+        WaveletForward(coeffs, wavelet, 0, tileSize);
+        
+        int numSettings = (int)settings.size();
+        vector<SweepResult> results(numSettings);
+        #pragma omp parallel for schedule(dynamic)
+        for(int k = 0; k < numSettings; k++)
+        {
+            Quantizer quantizer;
+            quantizer.Setup(width, height, tileSize, settings[k]);
+            QuantizedImage quantized;
+            quantizer.Quantize(coeffs, quantized);
+            
+            STImage reconstructed(width, height);
+            wavelet_backward(quantizer, quantized, wavelet, tileSize, &reconstructed);
+            ComputeMetrics(&original, &reconstructed, results[k].metrics);
+            results[k].entropy = compute_entropy(quantized);
+            results[k].bytes = CodedSize(quantized, tileSize);
+        }
+        
+        for(int k = 0; k < numSettings; k++)
+        {
+            const QuantizerParams & params = settings[k];
+            const ImageMetrics & metrics = results[k].metrics;
+            fprintf(csv, "%s,%s,%d,%g,%g,%d,%f,%f,%f,%f,%d,%f\n", images[i], WaveletName(wavelet),
+                    tileSize, params.quality, params.power, params.nonlinearize ? 1 : 0,
+                    metrics.psnr[METRIC_LUMA], metrics.ssim[METRIC_LUMA],
+                    metrics.msssim[METRIC_LUMA], results[k].entropy, (int)results[k].bytes,
+                    8.0 * results[k].bytes / ((double)width * height));
+        }
+        printf("%s: %d settings in %.1f ms\n", images[i], numSettings, timer.GetElapsedMillis());
+    }
+    
+    fclose(csv);
+    return 0;
+}
+
+
 int main(int argc, char** argv)
 {
+    //
+    // MicroUI -bench [width [height]] times the passes of the
+    // transforms instead of opening the viewer.
+    //
+    if(argc >= 2 && strcmp(argv[1], "-bench") == 0)
+    {
+        int width = (argc >= 3) ? atoi(argv[2]) : 4096;
+        int height = (argc >= 4) ? atoi(argv[3]) : width;
+        WaveletBenchmark(width, height);
+        return 0;
+    }
+
+    //
+    // MicroUI -sweep out.csv [options] image... writes rate-distortion
+    // results to a CSV file instead of opening the viewer (see run_sweep).
+    //
+    if(argc >= 2 && strcmp(argv[1], "-sweep") == 0)
+        return run_sweep(argc - 2, argv + 2);
+
+    //
+    // MicroUI -encode in.png out.wvc [quality [wavelet [tile]]] and
+    // MicroUI -decode in.wvc out.png [level | x y width height] run
+    // the codec. A quality of "lossless" makes an archival stream, and
+    // a tile size (0, the default, for none) transforms and codes the
+    // image in tiles. A level decodes a preview at 1/2^level of the
+    // size, and a rectangle decodes just that part of the image (only
+    // the tiles it overlaps, in a tiled stream).
+    //
+    if(argc >= 4 && strcmp(argv[1], "-encode") == 0)
+    {
+        CodecParams params;
+        if(argc >= 5 && strcmp(argv[4], "lossless") == 0)
+        {
+            params.lossless = true;
+            params.wavelet = WAVELET_CDF53;
+        }
+        else if(argc >= 5)
+            params.quality = (float)atof(argv[4]);
+        if(argc >= 6 && !parse_wavelet(argv[5], params.wavelet))
+        {
+            fprintf(stderr, "usage: MicroUI -encode in.png out.wvc [quality [wavelet [tile]]]\n"
+                            "wavelet is 0 to %d\n", NUM_WAVELETS - 1);
+            return 1;
+        }
+        if(argc >= 7)
+            params.tileSize = max(atoi(argv[6]), 0);
+        STImage image(argv[2]);
+
+        STTimer timer;
+        timer.Reset();
+        vector<unsigned char> stream;
+        EncodeImage(&image, params, stream);
+        float encodeTime = timer.GetElapsedMillis();
+
+        timer.Reset();
+        STImage* decoded = DecodeImage(&stream[0], stream.size());
+        float decodeTime = timer.GetElapsedMillis();
+
+        FILE* file = fopen(argv[3], "wb");
+        if(file == NULL || fwrite(&stream[0], 1, stream.size(), file) != stream.size())
+        {
+            fprintf(stderr, "Could not write '%s'.\n", argv[3]);
+            return 1;
+        }
+        fclose(file);
+
+        float bpp = 8.0f * stream.size() / (image.GetWidth() * image.GetHeight());
+        if(params.lossless)
+        {
+            bool exact = memcmp(image.GetPixels(), decoded->GetPixels(),
+                                image.GetWidth() * image.GetHeight() * sizeof(STColor4ub)) == 0;
+            printf("lossless: %d bytes, %.3f bpp, %s\n", (int)stream.size(), bpp,
+                   exact ? "bit-exact" : "NOT bit-exact");
+        }
+        else
+        {
+            ImageMetrics metrics;
+            ComputeMetrics(&image, decoded, metrics);
+            printf("%s, quality %g: %d bytes, %.3f bpp, PSNR %.2f dB, SSIM %.4f, MS-SSIM %.4f\n",
+                   WaveletName(params.wavelet), params.quality, (int)stream.size(), bpp,
+                   metrics.psnr[METRIC_LUMA], metrics.ssim[METRIC_LUMA],
+                   metrics.msssim[METRIC_LUMA]);
+        }
+        printf("encode %.2f ms, decode %.2f ms\n", encodeTime, decodeTime);
+        delete decoded;
+        return 0;
+    }
+    if(argc >= 4 && strcmp(argv[1], "-decode") == 0)
+    {
+        STTimer timer;
+        timer.Reset();
+        STImage* image;
+        if(argc >= 8)
+            image = LoadCompressedRegion(argv[2], atoi(argv[4]), atoi(argv[5]),
+                                         atoi(argv[6]), atoi(argv[7]));
+        else
+            image = LoadCompressed(argv[2], (argc >= 5) ? atoi(argv[4]) : 0);
+        if(image == NULL)
+            return 1;
+        printf("decode %.2f ms\n", timer.GetElapsedMillis());
+        image->Save(argv[3]);
+        delete image;
+        return 0;
+    }
+    
     if(argc == 2)
         g_original = new STImage(argv[1]);
     else
@@ -501,29 +732,11 @@ int main(int argc, char** argv)
     gWindowSizeX = g_original->GetWidth() * 2;
     gWindowSizeY = g_original->GetHeight() * 2;
     
-    assert(gWindowSizeX == gWindowSizeY && log2f(gWindowSizeX)==floorf(log2f(gWindowSizeX)));
-    
     g_xformquantized = new STImage(g_original->GetWidth(), g_original->GetHeight());
     g_reconstructed = new STImage(g_original->GetWidth(), g_original->GetHeight());
     g_difference = new STImage(g_original->GetWidth(), g_original->GetHeight());
     
     
-    {
-        float qualities[] = { 0, 0.1, 0.2, 0.3, 0.5, 0.75, 1 };
-        
-        for(int i = 0; i < sizeof(qualities)/sizeof(float); i++)
-        {
-            g_quality = qualities[i];
-            
-            haar_forward(g_original, g_xformquantized);
-            haar_backward(g_xformquantized, g_reconstructed);
-            
-            printf("quality: %f\n", g_quality);
-            printf("PSNR: %f\n", compute_psnr(g_original, g_reconstructed));
-            printf("entropy: %f\n", compute_entropy(g_xformquantized));
-        }
-    }
-    
     g_quality = 0.5;
     
     //
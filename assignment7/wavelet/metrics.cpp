@@ -0,0 +1,417 @@
+// metrics.cpp
+#include "metrics.h"
+#include "wavelet.h"
+#include <assert.h>
+#include <math.h>
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+using namespace std;
+
+//
+// The SSIM window and constants of Wang et al., for samples in [0, 1].
+//
+#define SSIM_WINDOW 11
+#define SSIM_SIGMA 1.5f
+#define SSIM_C1 (0.01f * 0.01f)
+#define SSIM_C2 (0.03f * 0.03f)
+
+//
+// Output rows per job. A strip of a 4096-wide image keeps its five
+// filtered moments (about 3 MB) in the cache between the two passes.
+//
+#define SSIM_STRIP_ROWS 32
+
+#define MSSSIM_SCALES 5
+static const float kMsssimWeights[MSSSIM_SCALES] =
+{
+    0.0448f, 0.2856f, 0.3001f, 0.2363f, 0.1333f
+};
+
+//
+// The local statistics the window gathers: the means of a, b, a^2, b^2
+// and ab.
+//
+enum Moment
+{
+    MOMENT_A = 0,
+    MOMENT_B,
+    MOMENT_AA,
+    MOMENT_BB,
+    MOMENT_AB,
+    NUM_MOMENTS
+};
+
+
+ImageMetrics::ImageMetrics()
+{
+    for(int c = 0; c < NUM_METRIC_CHANNELS; c++)
+        mse[c] = psnr[c] = ssim[c] = msssim[c] = 0;
+}
+
+
+static void gaussian_window(float g[SSIM_WINDOW])
+{
+    float sum = 0;
+    for(int k = 0; k < SSIM_WINDOW; k++)
+    {
+        float t = (float)(k - SSIM_WINDOW / 2);
+        g[k] = expf(-t * t / (2 * SSIM_SIGMA * SSIM_SIGMA));
+        sum += g[k];
+    }
+    for(int k = 0; k < SSIM_WINDOW; k++)
+        g[k] /= sum;
+}
+
+
+//
+// Split an image into planes of r, g, b and luma in [0, 1].
+//
+static void to_planes(const STImage* image, PlanarImage& out)
+{
+    int width = image->GetWidth();
+    int height = image->GetHeight();
+    out.Resize(width, height, NUM_METRIC_CHANNELS);
+    const STColor4ub* pixels = image->GetPixels();
+    const float scale = 1.0f / 255.0f;
+
+    #pragma omp parallel for schedule(static)
+    for(int y = 0; y < height; y++)
+    {
+        const STColor4ub* p = pixels + (size_t)y * width;
+        float* r = out.GetRow(METRIC_RED, y);
+        float* g = out.GetRow(METRIC_GREEN, y);
+        float* b = out.GetRow(METRIC_BLUE, y);
+        float* l = out.GetRow(METRIC_LUMA, y);
+        for(int x = 0; x < width; x++)
+        {
+            r[x] = p[x].r * scale;
+            g[x] = p[x].g * scale;
+            b[x] = p[x].b * scale;
+            l[x] = 0.299f * r[x] + 0.587f * g[x] + 0.114f * b[x];
+        }
+    }
+}
+
+
+//
+// Average 2x2 blocks of every channel, dropping an odd last row or
+// column.
+//
+static void downsample(const PlanarImage& in, PlanarImage& out)
+{
+    int width = in.GetWidth() / 2;
+    int height = in.GetHeight() / 2;
+    int channels = in.GetChannels();
+    out.Resize(width, height, channels);
+
+    int numRows = height * channels;
+    #pragma omp parallel for schedule(static)
+    for(int k = 0; k < numRows; k++)
+    {
+        int c = k / height, y = k % height;
+        const float* s0 = in.GetRow(c, 2 * y);
+        const float* s1 = in.GetRow(c, 2 * y + 1);
+        float* d = out.GetRow(c, y);
+        for(int x = 0; x < width; x++)
+            d[x] = 0.25f * (s0[2*x] + s0[2*x + 1] + s1[2*x] + s1[2*x + 1]);
+    }
+}
+
+
+//
+// Filter numRows rows of a and b (stride floats apart) along x, for
+// the outWidth window positions that fit in a row, into the rows of
+// the moments.
+//
+static void filter_rows(const float* a, const float* b, int stride, int numRows,
+                        int outWidth, const float* g, float* const moments[NUM_MOMENTS])
+{
+    for(int r = 0; r < numRows; r++)
+    {
+        const float* pa = a + (size_t)r * stride;
+        const float* pb = b + (size_t)r * stride;
+        size_t row = (size_t)r * outWidth;
+        int x = 0;
+#ifdef __SSE2__
+        for(; x + 4 <= outWidth; x += 4)
+        {
+            __m128 sa = _mm_setzero_ps(), sb = sa, saa = sa, sbb = sa, sab = sa;
+            for(int k = 0; k < SSIM_WINDOW; k++)
+            {
+                __m128 gk = _mm_set1_ps(g[k]);
+                __m128 va = _mm_loadu_ps(pa + x + k);
+                __m128 vb = _mm_loadu_ps(pb + x + k);
+                __m128 ga = _mm_mul_ps(gk, va);
+                __m128 gb = _mm_mul_ps(gk, vb);
+                sa = _mm_add_ps(sa, ga);
+                sb = _mm_add_ps(sb, gb);
+                saa = _mm_add_ps(saa, _mm_mul_ps(ga, va));
+                sbb = _mm_add_ps(sbb, _mm_mul_ps(gb, vb));
+                sab = _mm_add_ps(sab, _mm_mul_ps(ga, vb));
+            }
+            _mm_storeu_ps(moments[MOMENT_A] + row + x, sa);
+            _mm_storeu_ps(moments[MOMENT_B] + row + x, sb);
+            _mm_storeu_ps(moments[MOMENT_AA] + row + x, saa);
+            _mm_storeu_ps(moments[MOMENT_BB] + row + x, sbb);
+            _mm_storeu_ps(moments[MOMENT_AB] + row + x, sab);
+        }
+#endif
+        for(; x < outWidth; x++)
+        {
+            float sa = 0, sb = 0, saa = 0, sbb = 0, sab = 0;
+            for(int k = 0; k < SSIM_WINDOW; k++)
+            {
+                float ga = g[k] * pa[x + k];
+                float gb = g[k] * pb[x + k];
+                sa += ga;
+                sb += gb;
+                saa += ga * pa[x + k];
+                sbb += gb * pb[x + k];
+                sab += ga * pb[x + k];
+            }
+            moments[MOMENT_A][row + x] = sa;
+            moments[MOMENT_B][row + x] = sb;
+            moments[MOMENT_AA][row + x] = saa;
+            moments[MOMENT_BB][row + x] = sbb;
+            moments[MOMENT_AB][row + x] = sab;
+        }
+    }
+}
+
+
+//
+// The contrast-structure term and the full SSIM of one window from its
+// moments.
+//
+static inline void ssim_terms(float ma, float mb, float eaa, float ebb, float eab,
+                              float& ssim, float& cs)
+{
+    float maa = ma * ma, mbb = mb * mb, mab = ma * mb;
+    cs = (2 * (eab - mab) + SSIM_C2) / ((eaa - maa) + (ebb - mbb) + SSIM_C2);
+    ssim = cs * (2 * mab + SSIM_C1) / (maa + mbb + SSIM_C1);
+}
+
+
+//
+// Filter the moments along y, for numRows output rows, and add up the
+// SSIM and contrast-structure terms of every window.
+//
+static void score_rows(float* const moments[NUM_MOMENTS], int outWidth, int numRows,
+                       const float* g, double& ssimSum, double& csSum)
+{
+    for(int y = 0; y < numRows; y++)
+    {
+        float rowSsim = 0, rowCs = 0;
+        int x = 0;
+#ifdef __SSE2__
+        __m128 accSsim = _mm_setzero_ps(), accCs = _mm_setzero_ps();
+        __m128 c1 = _mm_set1_ps(SSIM_C1), c2 = _mm_set1_ps(SSIM_C2);
+        for(; x + 4 <= outWidth; x += 4)
+        {
+            // the window is symmetric, so rows k and 10 - k share a weight
+            __m128 m[NUM_MOMENTS];
+            __m128 gc = _mm_set1_ps(g[SSIM_WINDOW / 2]);
+            size_t centre = (size_t)(y + SSIM_WINDOW / 2) * outWidth + x;
+            for(int i = 0; i < NUM_MOMENTS; i++)
+                m[i] = _mm_mul_ps(gc, _mm_loadu_ps(moments[i] + centre));
+            for(int k = 0; k < SSIM_WINDOW / 2; k++)
+            {
+                __m128 gk = _mm_set1_ps(g[k]);
+                size_t top = (size_t)(y + k) * outWidth + x;
+                size_t bottom = (size_t)(y + SSIM_WINDOW - 1 - k) * outWidth + x;
+                for(int i = 0; i < NUM_MOMENTS; i++)
+                {
+                    __m128 pair = _mm_add_ps(_mm_loadu_ps(moments[i] + top),
+                                             _mm_loadu_ps(moments[i] + bottom));
+                    m[i] = _mm_add_ps(m[i], _mm_mul_ps(gk, pair));
+                }
+            }
+            __m128 maa = _mm_mul_ps(m[MOMENT_A], m[MOMENT_A]);
+            __m128 mbb = _mm_mul_ps(m[MOMENT_B], m[MOMENT_B]);
+            __m128 mab = _mm_mul_ps(m[MOMENT_A], m[MOMENT_B]);
+            __m128 sab = _mm_sub_ps(m[MOMENT_AB], mab);
+            __m128 var = _mm_add_ps(_mm_sub_ps(m[MOMENT_AA], maa), _mm_sub_ps(m[MOMENT_BB], mbb));
+            __m128 cs = _mm_div_ps(_mm_add_ps(_mm_add_ps(sab, sab), c2), _mm_add_ps(var, c2));
+            __m128 l = _mm_div_ps(_mm_add_ps(_mm_add_ps(mab, mab), c1),
+                                  _mm_add_ps(_mm_add_ps(maa, mbb), c1));
+            accCs = _mm_add_ps(accCs, cs);
+            accSsim = _mm_add_ps(accSsim, _mm_mul_ps(l, cs));
+        }
+        float s[4], c[4];
+        _mm_storeu_ps(s, accSsim);
+        _mm_storeu_ps(c, accCs);
+        rowSsim = (s[0] + s[1]) + (s[2] + s[3]);
+        rowCs = (c[0] + c[1]) + (c[2] + c[3]);
+#endif
+        for(; x < outWidth; x++)
+        {
+            float m[NUM_MOMENTS];
+            for(int i = 0; i < NUM_MOMENTS; i++)
+            {
+                m[i] = 0;
+                for(int k = 0; k < SSIM_WINDOW; k++)
+                    m[i] += g[k] * moments[i][(size_t)(y + k) * outWidth + x];
+            }
+            float ssim, cs;
+            ssim_terms(m[MOMENT_A], m[MOMENT_B], m[MOMENT_AA], m[MOMENT_BB], m[MOMENT_AB],
+                       ssim, cs);
+            rowSsim += ssim;
+            rowCs += cs;
+        }
+        ssimSum += rowSsim;
+        csSum += rowCs;
+    }
+}
+
+
+//
+// SSIM of a plane smaller than the window, with the whole plane as a
+// single window of equal weights.
+//
+static void whole_plane_ssim(const float* a, const float* b, size_t size,
+                             float& ssim, float& cs)
+{
+    double sa = 0, sb = 0, saa = 0, sbb = 0, sab = 0;
+    for(size_t i = 0; i < size; i++)
+    {
+        sa += a[i];
+        sb += b[i];
+        saa += a[i] * a[i];
+        sbb += b[i] * b[i];
+        sab += a[i] * b[i];
+    }
+    double n = (double)max(size, (size_t)1);
+    ssim_terms((float)(sa / n), (float)(sb / n), (float)(saa / n), (float)(sbb / n),
+               (float)(sab / n), ssim, cs);
+}
+
+
+//
+// Get the mean SSIM and contrast-structure term of every channel of b
+// against a. The strips of all channels run in parallel; their sums
+// are added up in order, so the result does not depend on the number
+// of threads.
+//
+static void ssim_planes(const PlanarImage& a, const PlanarImage& b, float* ssim, float* cs)
+{
+    int width = a.GetWidth();
+    int height = a.GetHeight();
+    int channels = a.GetChannels();
+    if(width < SSIM_WINDOW || height < SSIM_WINDOW)
+    {
+        for(int c = 0; c < channels; c++)
+            whole_plane_ssim(a.GetPlane(c), b.GetPlane(c), (size_t)width * height,
+                             ssim[c], cs[c]);
+        return;
+    }
+
+    int outWidth = width - SSIM_WINDOW + 1;
+    int outHeight = height - SSIM_WINDOW + 1;
+    int numStrips = (outHeight + SSIM_STRIP_ROWS - 1) / SSIM_STRIP_ROWS;
+    int numJobs = numStrips * channels;
+    vector<double> ssimSums(numJobs, 0.0), csSums(numJobs, 0.0);
+    float g[SSIM_WINDOW];
+    gaussian_window(g);
+
+    #pragma omp parallel
+    {
+        size_t momentSize = (size_t)(SSIM_STRIP_ROWS + SSIM_WINDOW - 1) * outWidth;
+        vector<float> scratch(NUM_MOMENTS * momentSize);
+        float* moments[NUM_MOMENTS];
+        for(int i = 0; i < NUM_MOMENTS; i++)
+            moments[i] = &scratch[i * momentSize];
+
+        #pragma omp for schedule(dynamic)
+        for(int k = 0; k < numJobs; k++)
+        {
+            int c = k / numStrips;
+            int y0 = (k % numStrips) * SSIM_STRIP_ROWS;
+            int rows = min(SSIM_STRIP_ROWS, outHeight - y0);
+            filter_rows(a.GetRow(c, y0), b.GetRow(c, y0), width, rows + SSIM_WINDOW - 1,
+                        outWidth, g, moments);
+            score_rows(moments, outWidth, rows, g, ssimSums[k], csSums[k]);
+        }
+    }
+
+    double numWindows = (double)outWidth * outHeight;
+    for(int c = 0; c < channels; c++)
+    {
+        double s = 0, t = 0;
+        for(int k = c * numStrips; k < (c + 1) * numStrips; k++)
+        {
+            s += ssimSums[k];
+            t += csSums[k];
+        }
+        ssim[c] = (float)(s / numWindows);
+        cs[c] = (float)(t / numWindows);
+    }
+}
+
+
+void ComputeMetrics(const STImage* a, const STImage* b, ImageMetrics& metrics, int which)
+{
+    assert(a->GetWidth() == b->GetWidth() && a->GetHeight() == b->GetHeight());
+    metrics = ImageMetrics();
+
+    if(which & METRIC_PSNR)
+    {
+        static const STImageStats::Channel kStatsChannels[NUM_METRIC_CHANNELS] =
+        {
+            STImageStats::RED, STImageStats::GREEN, STImageStats::BLUE,
+            STImageStats::LUMINANCE
+        };
+        float mse[STImageStats::NUM_CHANNELS];
+        STImageStats::MeanSquaredError(a, b, mse);
+        for(int c = 0; c < NUM_METRIC_CHANNELS; c++)
+        {
+            metrics.mse[c] = mse[kStatsChannels[c]];
+            metrics.psnr[c] = (metrics.mse[c] > 0) ? -10 * log10f(metrics.mse[c]) : INFINITY;
+        }
+    }
+
+    if((which & (METRIC_SSIM | METRIC_MSSSIM)) == 0)
+        return;
+
+    PlanarImage pa, pb;
+    to_planes(a, pa);
+    to_planes(b, pb);
+    float ssim[NUM_METRIC_CHANNELS], cs[NUM_METRIC_CHANNELS];
+    ssim_planes(pa, pb, ssim, cs);
+    for(int c = 0; c < NUM_METRIC_CHANNELS; c++)
+        metrics.ssim[c] = ssim[c];
+
+    if((which & METRIC_MSSSIM) == 0)
+        return;
+
+    // a weighted geometric mean of the contrast-structure terms of
+    // every scale but the coarsest, whose full SSIM stands in for it;
+    // negative terms (anticorrelated windows) count as zero
+    int numScales = 1;
+    while(numScales < MSSSIM_SCALES &&
+          min(pa.GetWidth(), pa.GetHeight()) / 2 >= SSIM_WINDOW)
+    {
+        float weight = kMsssimWeights[numScales - 1];
+        for(int c = 0; c < NUM_METRIC_CHANNELS; c++)
+            metrics.msssim[c] += weight * logf(max(cs[c], 1e-6f));
+
+        PlanarImage next;
+        downsample(pa, next);
+        swap(pa, next);
+        downsample(pb, next);
+        swap(pb, next);
+        ssim_planes(pa, pb, ssim, cs);
+        numScales++;
+    }
+
+    float totalWeight = 0;
+    for(int j = 0; j < numScales; j++)
+        totalWeight += kMsssimWeights[j];
+    for(int c = 0; c < NUM_METRIC_CHANNELS; c++)
+    {
+        float sum = metrics.msssim[c] + kMsssimWeights[numScales - 1] * logf(max(ssim[c], 1e-6f));
+        metrics.msssim[c] = expf(sum / totalWeight);
+    }
+}
@@ -0,0 +1,67 @@
+// metrics.h
+#ifndef __METRICS_H__
+#define __METRICS_H__
+
+#include "st.h"
+
+//
+// The channels the metrics are reported for. LUMA is the Rec. 601
+// luma (.299, .587, .114) of each pixel, as in STImageStats.
+//
+enum MetricChannel
+{
+    METRIC_RED = 0,
+    METRIC_GREEN,
+    METRIC_BLUE,
+    METRIC_LUMA,
+    NUM_METRIC_CHANNELS
+};
+
+//
+// Which metrics ComputeMetrics works out. SSIM comes for free with
+// MS-SSIM, whose finest scale computes it anyway.
+//
+enum MetricFlags
+{
+    METRIC_PSNR   = 1,
+    METRIC_SSIM   = 2,
+    METRIC_MSSSIM = 4,
+    METRIC_ALL    = 7
+};
+
+//
+// The distortion of an image against a reference, per channel. Metrics
+// that were not asked for are left at 0.
+//
+struct ImageMetrics
+{
+    // mean squared error in [0, 1] units, and the PSNR in dB for a
+    // peak of 1 (255 levels); identical channels have an infinite PSNR
+    float mse[NUM_METRIC_CHANNELS];
+    float psnr[NUM_METRIC_CHANNELS];
+    float ssim[NUM_METRIC_CHANNELS];
+    float msssim[NUM_METRIC_CHANNELS];
+
+    ImageMetrics();
+};
+
+//
+// Compare two images of the same size.
+//
+// SSIM is the mean of the structural similarity (Wang et al., 2004)
+// over every position of an 11x11 Gaussian window with a sigma of 1.5
+// that fits in the image, with K1 = 0.01 and K2 = 0.03. The window is
+// separable, so the local means, variances and covariance come from a
+// horizontal and a vertical pass of 11 taps over strips of rows,
+// which run in parallel and do 4 positions per SSE2 register.
+//
+// MS-SSIM (Wang, Simoncelli and Bovik, 2003) combines the contrast
+// and structure terms of 5 scales, each a 2x2 average of the one
+// before, with the luminance term of the coarsest, using the weights
+// of the paper. Images too small for 5 scales use the ones that fit,
+// with the weights scaled to add up to 1.
+//
+void ComputeMetrics(const STImage* a, const STImage* b, ImageMetrics& metrics,
+                    int which = METRIC_ALL);
+
+#endif //__METRICS_H__
@@ -0,0 +1,224 @@
+// quantizer.cpp
+#include "quantizer.h"
+#include <math.h>
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+using namespace std;
+
+//
+// The nonlinearity is tabulated for magnitudes below COMPAND_RANGE
+// steps, COMPAND_RESOLUTION entries per step; larger ones (which only
+// the overshoot of the longer filters produces) are computed directly.
+//
+#define COMPAND_RANGE 512
+#define COMPAND_RESOLUTION 8
+
+
+Quantizer::Quantizer()
+    : mWidth(0), mHeight(0), mNonlinear(false)
+{
+}
+
+
+void Quantizer::Setup(int width, int height, int tileSize, const QuantizerParams& params)
+{
+    mWidth = width;
+    mHeight = height;
+    mParams = params;
+    mParams.power = max(params.power, 0.01f);
+    mNonlinear = params.nonlinearize || params.softclip;
+
+    WaveletSubbands(width, height, 0, tileSize, mSubbands);
+    mSteps.resize(mSubbands.size());
+    float exponent = powf(params.quality, 3);
+    int coarsest = 0;
+    for(size_t k = 0; k < mSubbands.size(); k++)
+    {
+        float factor = 1.0f;
+        if(mSubbands[k].orientation == SUBBAND_LL)
+            coarsest = mSubbands[k].level;
+        else
+            factor = powf((float)(coarsest - mSubbands[k].level + 1), exponent);
+        mSteps[k] = factor / 255.0f;
+    }
+
+    mCompandTable.clear();
+    mExpandTable.clear();
+    if(mNonlinear)
+    {
+        // one extra entry so the last interval can be interpolated
+        int n = COMPAND_RANGE * COMPAND_RESOLUTION + 1;
+        mCompandTable.resize(n);
+        for(int i = 0; i < n; i++)
+            mCompandTable[i] = Compand((float)i / COMPAND_RESOLUTION);
+
+        int m = (int)mCompandTable[n - 1] + 2;
+        mExpandTable.resize(m);
+        mExpandTable[0] = 0;
+        for(int i = 1; i < m; i++)
+            mExpandTable[i] = Expand(i + 0.5f);
+    }
+}
+
+
+//
+// The viewer's nonlinearity on a magnitude v in steps: a power, then
+// the soft clip x / (1.1 - x) on the [0, 1] range, continued linearly
+// past 1 so it stays invertible.
+//
+float Quantizer::Compand(float v) const
+{
+    float x = v / 255.0f;
+    if(mParams.nonlinearize)
+        x = powf(x, mParams.power);
+    if(mParams.softclip)
+        x = x / (1.1f - min(x, 1.0f));
+    return 255.0f * x;
+}
+
+
+float Quantizer::Expand(float v) const
+{
+    float x = v / 255.0f;
+    if(mParams.softclip)
+        x = (x <= 10.0f) ? 1.1f * x / (1.0f + x) : 0.1f * x;
+    if(mParams.nonlinearize)
+        x = powf(x, 1.0f / mParams.power);
+    return 255.0f * x;
+}
+
+
+void Quantizer::QuantizeBand(int band, const float* src, int* dst, int stride) const
+{
+    const Subband& b = mSubbands[band];
+    float scale = 1.0f / mSteps[band];
+    src += (size_t)b.y * stride + b.x;
+    dst += (size_t)b.y * stride + b.x;
+
+    if(mNonlinear && b.orientation != SUBBAND_LL)
+    {
+        const float* table = &mCompandTable[0];
+        float limit = (float)COMPAND_RANGE;
+        for(int y = 0; y < b.height; y++, src += stride, dst += stride)
+        {
+            for(int x = 0; x < b.width; x++)
+            {
+                float v = fabsf(src[x]) * scale;
+                float m;
+                if(v < limit)
+                {
+                    float t = v * COMPAND_RESOLUTION;
+                    int i = (int)t;
+                    m = table[i] + (t - i) * (table[i + 1] - table[i]);
+                }
+                else
+                    m = Compand(v);
+                int q = (int)m;
+                dst[x] = (src[x] < 0) ? -q : q;
+            }
+        }
+        return;
+    }
+
+    for(int y = 0; y < b.height; y++, src += stride, dst += stride)
+    {
+        int x = 0;
+#ifdef __SSE2__
+        // truncating |c| / s and then restoring the sign is the same as
+        // truncating c / s, which rounds towards zero
+        __m128 vs = _mm_set1_ps(scale);
+        for(; x + 8 <= b.width; x += 8)
+        {
+            __m128i q0 = _mm_cvttps_epi32(_mm_mul_ps(_mm_loadu_ps(src + x), vs));
+            __m128i q1 = _mm_cvttps_epi32(_mm_mul_ps(_mm_loadu_ps(src + x + 4), vs));
+            _mm_storeu_si128((__m128i*)(dst + x), q0);
+            _mm_storeu_si128((__m128i*)(dst + x + 4), q1);
+        }
+#endif
+        for(; x < b.width; x++)
+            dst[x] = (int)(src[x] * scale);
+    }
+}
+
+
+void Quantizer::DequantizeBand(int band, const int* src, float* dst, int stride) const
+{
+    const Subband& b = mSubbands[band];
+    float step = mSteps[band];
+    src += (size_t)b.y * stride + b.x;
+    dst += (size_t)b.y * stride + b.x;
+
+    if(mNonlinear && b.orientation != SUBBAND_LL)
+    {
+        const float* table = &mExpandTable[0];
+        int size = (int)mExpandTable.size();
+        for(int y = 0; y < b.height; y++, src += stride, dst += stride)
+        {
+            for(int x = 0; x < b.width; x++)
+            {
+                int m = abs(src[x]);
+                float v = step * ((m < size) ? table[m] : Expand(m + 0.5f));
+                dst[x] = (src[x] < 0) ? -v : v;
+            }
+        }
+        return;
+    }
+
+    for(int y = 0; y < b.height; y++, src += stride, dst += stride)
+    {
+        int x = 0;
+#ifdef __SSE2__
+        __m128 vstep = _mm_set1_ps(step);
+        __m128 half = _mm_set1_ps(0.5f);
+        __m128i zero = _mm_setzero_si128();
+        for(; x + 4 <= b.width; x += 4)
+        {
+            __m128i q = _mm_loadu_si128((const __m128i*)(src + x));
+            __m128i sign = _mm_srai_epi32(q, 31);
+            __m128i m = _mm_sub_epi32(_mm_xor_si128(q, sign), sign);
+            __m128 v = _mm_mul_ps(_mm_add_ps(_mm_cvtepi32_ps(m), half), vstep);
+            // zero stays zero, the rest get the sign of q back
+            v = _mm_andnot_ps(_mm_castsi128_ps(_mm_cmpeq_epi32(m, zero)), v);
+            v = _mm_or_ps(v, _mm_castsi128_ps(_mm_slli_epi32(sign, 31)));
+            _mm_storeu_ps(dst + x, v);
+        }
+#endif
+        for(; x < b.width; x++)
+        {
+            int m = abs(src[x]);
+            float v = m ? (m + 0.5f) * step : 0.0f;
+            dst[x] = (src[x] < 0) ? -v : v;
+        }
+    }
+}
+
+
+void Quantizer::Quantize(const PlanarImage& coeffs, QuantizedImage& out) const
+{
+    int channels = coeffs.GetChannels();
+    out.Resize(mWidth, mHeight, channels);
+    int numJobs = (int)mSubbands.size() * channels;
+    #pragma omp parallel for schedule(dynamic)
+    for(int k = 0; k < numJobs; k++)
+    {
+        int band = k / channels, c = k % channels;
+        QuantizeBand(band, coeffs.GetPlane(c), out.GetPlane(c), mWidth);
+    }
+}
+
+
+void Quantizer::Dequantize(const QuantizedImage& in, PlanarImage& coeffs) const
+{
+    int channels = in.GetChannels();
+    coeffs.Resize(mWidth, mHeight, channels);
+    int numJobs = (int)mSubbands.size() * channels;
+    #pragma omp parallel for schedule(dynamic)
+    for(int k = 0; k < numJobs; k++)
+    {
+        int band = k / channels, c = k % channels;
+        DequantizeBand(band, in.GetPlane(c), coeffs.GetPlane(c), mWidth);
+    }
+}
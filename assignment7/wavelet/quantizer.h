@@ -0,0 +1,95 @@
+// quantizer.h
+#ifndef __QUANTIZER_H__
+#define __QUANTIZER_H__
+
+#include "wavelet.h"
+#include <vector>
+
+//
+// Quantized coefficients, one integer per sample.
+//
+typedef Planes<int> QuantizedImage;
+
+//
+// Settings of the quantizer, the viewer's sliders and switches.
+//
+struct QuantizerParams
+{
+    // 0 quantizes every subband with a step of one 8-bit level; higher
+    // values quantize finer details more coarsely
+    float quality;
+    // with nonlinearize, detail magnitudes are raised to this power
+    // before they are quantized
+    float power;
+    bool nonlinearize;
+    // compress large details towards the top of the range
+    bool softclip;
+
+    QuantizerParams()
+        : quality(0), power(1), nonlinearize(false), softclip(false)
+    {
+    }
+};
+
+//
+// A deadzone quantizer for the subbands of a wavelet transform. Setup
+// works out the step of every subband and the tables of the
+// nonlinearity once, so quantizing is a multiply (or a table lookup)
+// per coefficient over whole subbands.
+//
+// A coefficient c in a subband with step s becomes
+//   q = sign(c) floor(|c| / s)
+// and comes back as sign(q) (|q| + 1/2) s, or 0 for q = 0, so the zero
+// bin is twice as wide as the others. The low band has a step of one
+// 8-bit level; the details of level l of a tile, counted from 1 at its
+// coarsest level, get l^(quality^3) levels.
+//
+class Quantizer
+{
+public:
+    Quantizer();
+
+    //
+    // Set the quantizer up for a width x height image transformed with
+    // the given tile size (see WaveletSubbands).
+    //
+    void Setup(int width, int height, int tileSize, const QuantizerParams& params);
+
+    const std::vector<Subband>& GetSubbands() const { return mSubbands; }
+
+    //
+    // Get the step of a subband, or of the nonlinear domain for the
+    // details when the quantizer is nonlinear.
+    //
+    float GetStep(int band) const { return mSteps[band]; }
+
+    //
+    // Quantize every channel of coefficients into out, or the other way
+    // around. Subbands and channels run in parallel.
+    //
+    void Quantize(const PlanarImage& coeffs, QuantizedImage& out) const;
+    void Dequantize(const QuantizedImage& in, PlanarImage& coeffs) const;
+
+private:
+    void QuantizeBand(int band, const float* src, int* dst, int stride) const;
+    void DequantizeBand(int band, const int* src, float* dst, int stride) const;
+
+    // the nonlinearity on a detail magnitude in 8-bit levels, and its
+    // inverse
+    float Compand(float v) const;
+    float Expand(float v) const;
+
+    int mWidth;
+    int mHeight;
+    QuantizerParams mParams;
+    bool mNonlinear;
+    std::vector<Subband> mSubbands;
+    std::vector<float> mSteps;
+
+    // Compand sampled over [0, COMPAND_RANGE) for the forward direction,
+    // and the reconstruction of every magnitude it can produce
+    std::vector<float> mCompandTable;
+    std::vector<float> mExpandTable;
+};
+
+#endif //__QUANTIZER_H__
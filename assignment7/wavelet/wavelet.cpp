@@ -0,0 +1,929 @@
+// wavelet.cpp
+#include "wavelet.h"
+#include <assert.h>
+#include <string.h>
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+using namespace std;
+
+//
+// A lifting step either predicts the odd samples from the even ones,
+//   d[i] += weight * (s[i] + s[i + offset])
+// or updates the even samples from the odd ones,
+//   s[i] += weight * (d[i - offset] + d[i])
+// where s and d are the even and odd halves of the signal. An offset
+// of 0 uses a single neighbour (Haar), an offset of 1 the neighbours
+// on both sides, mirrored at the ends of the signal.
+//
+// The reversible transform rounds a step to an integer instead: it
+// adds or subtracts (the sign of the weight) the sum of the neighbours
+// plus round, shifted right by shift.
+//
+struct LiftingStep
+{
+    bool predict;
+    int offset;
+    float weight;
+    short round;
+    int shift;
+};
+
+struct Lifting
+{
+    int numSteps;
+    LiftingStep steps[4];
+    float lowScale;
+    float highScale;
+};
+
+// CDF 9/7 lifting coefficients (Daubechies and Sweldens, "Factoring
+// wavelet transforms into lifting steps", 1998)
+#define CDF97_ALPHA -1.586134342059924f
+#define CDF97_BETA  -0.052980118572961f
+#define CDF97_GAMMA  0.882911075530934f
+#define CDF97_DELTA  0.443506852043971f
+#define CDF97_K      1.230174104914001f
+
+static const Lifting kLiftings[NUM_WAVELETS] =
+{
+    // Haar: d = b - a, s = a + d/2
+    { 2, { { true, 0, -0.5f }, { false, 0, 0.25f } }, 1.0f, -0.5f },
+    // 5/3: d = odd - mean of the even neighbours, s = even + (d- + d+)/4
+    { 2, { { true, 1, -0.5f }, { false, 1, 0.25f } }, 1.0f, -0.5f },
+    // 9/7
+    { 4, { { true, 1, CDF97_ALPHA }, { false, 1, CDF97_BETA },
+           { true, 1, CDF97_GAMMA }, { false, 1, CDF97_DELTA } },
+      1.0f/CDF97_K, -0.5f*CDF97_K },
+};
+
+//
+// The reversible 5/3 transform of JPEG 2000 is the integer version of
+// the 5/3 steps, with the divisions rounded down:
+//   d[i] -= (s[i] + s[i+1]) >> 1
+//   s[i] += (d[i-1] + d[i] + 2) >> 2
+// and no scaling, so the high band has a gain of 2. Undoing a step
+// subtracts exactly what it added, whatever the rounding was.
+//
+static const Lifting kReversible =
+    { 2, { { true, 1, -0.5f, 0, 1 }, { false, 1, 0.25f, 2, 2 } }, 1.0f, 1.0f };
+
+
+const char* WaveletName(WaveletType type)
+{
+    switch(type)
+    {
+        case WAVELET_HAAR: return "Haar";
+        case WAVELET_CDF53: return "CDF 5/3";
+        case WAVELET_CDF97: return "CDF 9/7";
+        default: return "unknown";
+    }
+}
+
+
+PlanarImage::PlanarImage(const STImage* image)
+{
+    Resize(image->GetWidth(), image->GetHeight(), 3);
+
+    const STColor4ub* pixels = image->GetPixels();
+    float* r = GetPlane(0);
+    float* g = GetPlane(1);
+    float* b = GetPlane(2);
+    size_t size = (size_t)GetWidth() * GetHeight();
+    for(size_t i = 0; i < size; i++)
+    {
+        r[i] = pixels[i].r / 255.0f;
+        g[i] = pixels[i].g / 255.0f;
+        b[i] = pixels[i].b / 255.0f;
+    }
+}
+
+
+
+
+int WaveletMaxLevels(int width, int height)
+{
+    int levels = 0;
+    while(width >= 2 && height >= 2)
+    {
+        width = (width + 1) / 2;
+        height = (height + 1) / 2;
+        levels++;
+    }
+    return levels;
+}
+
+
+//
+// The size of a side after l levels: the low half of a side of n is
+// (n + 1) / 2 samples long.
+//
+static inline int low_size(int n, int l)
+{
+    return (n + (1 << l) - 1) >> l;
+}
+
+
+//
+// The number of levels to use on a width x height tile.
+//
+static inline int tile_levels(int levels, int width, int height)
+{
+    int maxLevels = WaveletMaxLevels(width, height);
+    return (levels <= 0 || levels > maxLevels) ? maxLevels : levels;
+}
+
+
+void WaveletSubbands(int width, int height, int levels, int tileSize,
+                     vector<Subband>& subbands)
+{
+    subbands.clear();
+    if(tileSize <= 0)
+        tileSize = max(width, height);
+
+    for(int y0 = 0; y0 < height; y0 += tileSize)
+    {
+        for(int x0 = 0; x0 < width; x0 += tileSize)
+        {
+            int w = min(tileSize, width - x0);
+            int h = min(tileSize, height - y0);
+            int numLevels = tile_levels(levels, w, h);
+
+            Subband ll = { numLevels, SUBBAND_LL, x0, y0,
+                           low_size(w, numLevels), low_size(h, numLevels) };
+            subbands.push_back(ll);
+            for(int l = numLevels; l >= 1; l--)
+            {
+                // the w x h region split at level l
+                int pw = low_size(w, l - 1), ph = low_size(h, l - 1);
+                int lowW = (pw + 1) / 2, lowH = (ph + 1) / 2;
+                Subband hl = { l, SUBBAND_HL, x0 + lowW, y0, pw - lowW, lowH };
+                Subband lh = { l, SUBBAND_LH, x0, y0 + lowH, lowW, ph - lowH };
+                Subband hh = { l, SUBBAND_HH, x0 + lowW, y0 + lowH, pw - lowW, ph - lowH };
+                subbands.push_back(hl);
+                subbands.push_back(lh);
+                subbands.push_back(hh);
+            }
+        }
+    }
+}
+
+
+//
+// dst[i] += w * (a[i] + b[i]) for i in [0, n). This is the whole inner
+// loop of a lifting step, on contiguous halves of the signal.
+//
+static inline void lift(float* dst, const float* a, const float* b, int n, float w)
+{
+    int i = 0;
+#ifdef __SSE2__
+    __m128 vw = _mm_set1_ps(w);
+    for(; i + 8 <= n; i += 8)
+    {
+        __m128 d0 = _mm_loadu_ps(dst + i);
+        __m128 d1 = _mm_loadu_ps(dst + i + 4);
+        __m128 s0 = _mm_add_ps(_mm_loadu_ps(a + i), _mm_loadu_ps(b + i));
+        __m128 s1 = _mm_add_ps(_mm_loadu_ps(a + i + 4), _mm_loadu_ps(b + i + 4));
+        _mm_storeu_ps(dst + i, _mm_add_ps(d0, _mm_mul_ps(vw, s0)));
+        _mm_storeu_ps(dst + i + 4, _mm_add_ps(d1, _mm_mul_ps(vw, s1)));
+    }
+#endif
+    for(; i < n; i++)
+        dst[i] += w * (a[i] + b[i]);
+}
+
+
+//
+// dst[i] -= (a[i] + b[i] + round) >> shift for i in [0, n), or += with
+// add. Eight samples per SSE2 register; the sum cannot overflow for
+// the coefficients of 8-bit images.
+//
+static inline void lift(short* dst, const short* a, const short* b, int n,
+                        short round, int shift, bool add)
+{
+    int i = 0;
+#ifdef __SSE2__
+    __m128i vr = _mm_set1_epi16(round);
+    for(; i + 8 <= n; i += 8)
+    {
+        __m128i sum = _mm_add_epi16(_mm_loadu_si128((const __m128i*)(a + i)),
+                                    _mm_loadu_si128((const __m128i*)(b + i)));
+        __m128i v = _mm_srai_epi16(_mm_add_epi16(sum, vr), shift);
+        __m128i x = _mm_loadu_si128((const __m128i*)(dst + i));
+        x = add ? _mm_add_epi16(x, v) : _mm_sub_epi16(x, v);
+        _mm_storeu_si128((__m128i*)(dst + i), x);
+    }
+#endif
+    for(; i < n; i++)
+    {
+        short v = (short)((a[i] + b[i] + round) >> shift);
+        dst[i] = add ? dst[i] + v : dst[i] - v;
+    }
+}
+
+
+//
+// Apply a lifting step (or undo it) to n samples with the neighbours
+// a and b. The reversible transform rounds the step and, like the
+// float one, subtracts the predictions and adds the updates.
+//
+static inline void lift_step(float* dst, const float* a, const float* b, int n,
+                             const LiftingStep& step, bool inverse)
+{
+    lift(dst, a, b, n, inverse ? -step.weight : step.weight);
+}
+
+
+static inline void lift_step(short* dst, const short* a, const short* b, int n,
+                             const LiftingStep& step, bool inverse)
+{
+    lift(dst, a, b, n, step.round, step.shift, (step.weight > 0) != inverse);
+}
+
+
+//
+// Run the lifting steps on the halves s (ns samples) and d (nd samples)
+// of a signal, forwards or backwards. The signal is ns + nd long, so
+// ns is nd or nd + 1, and it is extended symmetrically at both ends:
+// the sample before s[0] is d[0], and the sample after the last one
+// is the one before it.
+//
+template <class T>
+static void lift_steps(T* s, T* d, int ns, int nd, const Lifting& f, bool inverse)
+{
+    for(int k = 0; k < f.numSteps; k++)
+    {
+        const LiftingStep& step = f.steps[inverse ? f.numSteps - 1 - k : k];
+        if(step.predict)
+        {
+            if(step.offset == 0)
+                lift_step(d, s, s, nd, step, inverse);
+            else
+            {
+                // without an s[nd], d[nd-1] sees s[nd-1] on both sides
+                int m = (ns > nd) ? nd : nd - 1;
+                lift_step(d, s, s + 1, m, step, inverse);
+                if(m < nd)
+                    lift_step(d + nd - 1, s + nd - 1, s + nd - 1, 1, step, inverse);
+            }
+        }
+        else
+        {
+            if(step.offset == 0)
+                lift_step(s, d, d, nd, step, inverse);
+            else
+            {
+                lift_step(s, d, d, 1, step, inverse);
+                lift_step(s + 1, d, d + 1, nd - 1, step, inverse);
+                if(ns > nd)
+                    lift_step(s + nd, d + nd - 1, d + nd - 1, 1, step, inverse);
+            }
+        }
+    }
+}
+
+
+//
+// dst[i] = scale * src[i] for i in [0, n).
+//
+static inline void scale_copy(const float* src, int n, float scale, float* dst)
+{
+    int i = 0;
+#ifdef __SSE2__
+    __m128 vs = _mm_set1_ps(scale);
+    for(; i + 4 <= n; i += 4)
+        _mm_storeu_ps(dst + i, _mm_mul_ps(vs, _mm_loadu_ps(src + i)));
+#endif
+    for(; i < n; i++)
+        dst[i] = scale * src[i];
+}
+
+
+//
+// The reversible transform has scales of 1, so it only copies.
+//
+static inline void scale_copy(const short* src, int n, float, short* dst)
+{
+    memcpy(dst, src, n * sizeof(short));
+}
+
+
+//
+// Split ns + nd samples into their even half s and odd half d.
+//
+static void split(const float* x, int ns, int nd, float* s, float* d)
+{
+    int i = 0;
+#ifdef __SSE2__
+    for(; i + 4 <= nd; i += 4)
+    {
+        __m128 a = _mm_loadu_ps(x + 2*i);
+        __m128 b = _mm_loadu_ps(x + 2*i + 4);
+        _mm_storeu_ps(s + i, _mm_shuffle_ps(a, b, _MM_SHUFFLE(2, 0, 2, 0)));
+        _mm_storeu_ps(d + i, _mm_shuffle_ps(a, b, _MM_SHUFFLE(3, 1, 3, 1)));
+    }
+#endif
+    for(; i < nd; i++)
+    {
+        s[i] = x[2*i];
+        d[i] = x[2*i+1];
+    }
+    if(ns > nd)
+        s[nd] = x[2*nd];
+}
+
+
+static void split(const short* x, int ns, int nd, short* s, short* d)
+{
+    int i = 0;
+#ifdef __SSE2__
+    // sign-extend the even and the odd samples to 32 bits and pack them
+    for(; i + 8 <= nd; i += 8)
+    {
+        __m128i a = _mm_loadu_si128((const __m128i*)(x + 2*i));
+        __m128i b = _mm_loadu_si128((const __m128i*)(x + 2*i + 8));
+        __m128i evenA = _mm_srai_epi32(_mm_slli_epi32(a, 16), 16);
+        __m128i evenB = _mm_srai_epi32(_mm_slli_epi32(b, 16), 16);
+        _mm_storeu_si128((__m128i*)(s + i), _mm_packs_epi32(evenA, evenB));
+        _mm_storeu_si128((__m128i*)(d + i), _mm_packs_epi32(_mm_srai_epi32(a, 16),
+                                                            _mm_srai_epi32(b, 16)));
+    }
+#endif
+    for(; i < nd; i++)
+    {
+        s[i] = x[2*i];
+        d[i] = x[2*i+1];
+    }
+    if(ns > nd)
+        s[nd] = x[2*nd];
+}
+
+
+//
+// Merge the halves s and d back into ns + nd samples.
+//
+static void merge(const float* s, const float* d, int ns, int nd, float* x)
+{
+    int i = 0;
+#ifdef __SSE2__
+    for(; i + 4 <= nd; i += 4)
+    {
+        __m128 a = _mm_loadu_ps(s + i);
+        __m128 b = _mm_loadu_ps(d + i);
+        _mm_storeu_ps(x + 2*i, _mm_unpacklo_ps(a, b));
+        _mm_storeu_ps(x + 2*i + 4, _mm_unpackhi_ps(a, b));
+    }
+#endif
+    for(; i < nd; i++)
+    {
+        x[2*i] = s[i];
+        x[2*i+1] = d[i];
+    }
+    if(ns > nd)
+        x[2*nd] = s[nd];
+}
+
+
+static void merge(const short* s, const short* d, int ns, int nd, short* x)
+{
+    int i = 0;
+#ifdef __SSE2__
+    for(; i + 8 <= nd; i += 8)
+    {
+        __m128i a = _mm_loadu_si128((const __m128i*)(s + i));
+        __m128i b = _mm_loadu_si128((const __m128i*)(d + i));
+        _mm_storeu_si128((__m128i*)(x + 2*i), _mm_unpacklo_epi16(a, b));
+        _mm_storeu_si128((__m128i*)(x + 2*i + 8), _mm_unpackhi_epi16(a, b));
+    }
+#endif
+    for(; i < nd; i++)
+    {
+        x[2*i] = s[i];
+        x[2*i+1] = d[i];
+    }
+    if(ns > nd)
+        x[2*nd] = s[nd];
+}
+
+
+//
+// Transform a row of n samples in place: the even and odd samples are
+// split into a line of scratch, lifted there, and written back as the
+// low half followed by the high half.
+//
+template <class T>
+static void forward_row(T* x, int n, const Lifting& f, T* scratch)
+{
+    int ns = (n + 1) / 2, nd = n / 2;
+    T* s = scratch;
+    T* d = scratch + ns;
+    split(x, ns, nd, s, d);
+    lift_steps(s, d, ns, nd, f, false);
+    scale_copy(s, ns, f.lowScale, x);
+    scale_copy(d, nd, f.highScale, x + ns);
+}
+
+
+template <class T>
+static void inverse_row(T* x, int n, const Lifting& f, T* scratch)
+{
+    int ns = (n + 1) / 2, nd = n / 2;
+    T* s = scratch;
+    T* d = scratch + ns;
+    scale_copy(x, ns, 1.0f/f.lowScale, s);
+    scale_copy(x + ns, nd, 1.0f/f.highScale, d);
+    lift_steps(s, d, ns, nd, f, true);
+    merge(s, d, ns, nd, x);
+}
+
+
+//
+// One level of the transform, on the rows or the columns of the w x h
+// corner of a plane with rows stride samples apart.
+//
+// Lifting a column at a time would touch a new cache line (and, for
+// wide images, a new page) for every sample. The columns are instead
+// lifted a whole row at a time, with SIMD across the row, and the rows
+// are sorted into the low and high halves afterwards, so both passes
+// stream through memory in the same order and reach about the same
+// bandwidth (see WaveletBenchmark).
+//
+template <class T>
+static void forward_rows(T* plane, int stride, int w, int h,
+                         const Lifting& f, T* scratch)
+{
+    for(int y = 0; y < h; y++)
+        forward_row(plane + (size_t)y*stride, w, f, scratch);
+}
+
+
+template <class T>
+static void inverse_rows(T* plane, int stride, int w, int h,
+                         const Lifting& f, T* scratch)
+{
+    for(int y = 0; y < h; y++)
+        inverse_row(plane + (size_t)y*stride, w, f, scratch);
+}
+
+
+//
+// Run the lifting steps down the columns of a w x (ns + nd) region,
+// forwards or backwards, with the rows still interleaved: row 2i is
+// s[i] and row 2i+1 is d[i]. Step k trails step k-1 by one index, so
+// a single sweep from top to bottom does all of them while the few
+// rows in flight stay in cache.
+//
+template <class T>
+static void sweep_steps(T* plane, int stride, int w, int ns, int nd,
+                        const Lifting& f, bool inverse)
+{
+    int numSteps = f.numSteps;
+    for(int t = 0; t < ns + numSteps - 1; t++)
+    {
+        for(int k = 0; k < numSteps; k++)
+        {
+            int i = t - k;
+            const LiftingStep& step = f.steps[inverse ? numSteps - 1 - k : k];
+            T* row = plane + (size_t)(2*i)*stride;
+            if(step.predict)
+            {
+                if(i < 0 || i >= nd)
+                    continue;
+                const T* s1 = (step.offset && i + 1 < ns) ? row + 2*(size_t)stride : row;
+                lift_step(row + stride, row, s1, w, step, inverse);
+            }
+            else
+            {
+                if(i < 0 || i >= (step.offset ? ns : nd))
+                    continue;
+                const T* d1 = (i < nd) ? row + stride : row - stride;
+                const T* d0 = (step.offset && i > 0) ? row - stride : d1;
+                lift_step(row, d0, d1, w, step, inverse);
+            }
+        }
+    }
+}
+
+
+//
+// Move the even rows of a w x (ns + nd) region to its top ns rows and
+// the odd rows to the nd rows below (or back, for the inverse),
+// applying the low and high scales on the way. Each cycle of the
+// permutation is followed with two rows of scratch, so every row is
+// read and written once, front to back.
+//
+template <class T>
+static void permute_rows(T* plane, int stride, int w, int ns, int nd,
+                         const Lifting& f, bool inverse, T* scratch)
+{
+    int h = ns + nd;
+    vector<bool> done(h, false);
+    T* a = scratch;
+    T* b = scratch + w;
+    for(int start = 0; start < h; start++)
+    {
+        if(done[start])
+            continue;
+        int cur = start;
+        scale_copy(plane + (size_t)start*stride, w, 1.0f, a);
+        do
+        {
+            int dst;
+            float scale;
+            if(inverse)
+            {
+                dst = (cur < ns) ? 2*cur : 2*(cur-ns) + 1;
+                scale = (cur < ns) ? 1.0f/f.lowScale : 1.0f/f.highScale;
+            }
+            else
+            {
+                dst = (cur % 2 == 0) ? cur/2 : ns + cur/2;
+                scale = (cur % 2 == 0) ? f.lowScale : f.highScale;
+            }
+            T* target = plane + (size_t)dst*stride;
+            if(dst != start)
+                scale_copy(target, w, 1.0f, b);
+            scale_copy(a, w, scale, target);
+            swap(a, b);
+            done[dst] = true;
+            cur = dst;
+        } while(cur != start);
+    }
+}
+
+
+template <class T>
+static void forward_columns(T* plane, int stride, int w, int h,
+                            const Lifting& f, T* scratch)
+{
+    sweep_steps(plane, stride, w, (h + 1) / 2, h / 2, f, false);
+    permute_rows(plane, stride, w, (h + 1) / 2, h / 2, f, false, scratch);
+}
+
+
+template <class T>
+static void inverse_columns(T* plane, int stride, int w, int h,
+                            const Lifting& f, T* scratch)
+{
+    permute_rows(plane, stride, w, (h + 1) / 2, h / 2, f, true, scratch);
+    sweep_steps(plane, stride, w, (h + 1) / 2, h / 2, f, true);
+}
+
+
+//
+// Do or undo one level of the transform on the w x h corner of a plane.
+//
+template <class T>
+static inline void forward_level(T* plane, int stride, int w, int h,
+                                 const Lifting& f, T* scratch)
+{
+    forward_rows(plane, stride, w, h, f, scratch);
+    forward_columns(plane, stride, w, h, f, scratch);
+}
+
+
+template <class T>
+static inline void inverse_level(T* plane, int stride, int w, int h,
+                                 const Lifting& f, T* scratch)
+{
+    inverse_columns(plane, stride, w, h, f, scratch);
+    inverse_rows(plane, stride, w, h, f, scratch);
+}
+
+
+//
+// Run the transform on every tile of every channel, in parallel.
+//
+template <class T>
+static void transform(Planes<T>& image, const Lifting& f, int levels, int tileSize,
+                      bool inverse, int toLevel)
+{
+    int width = image.GetWidth();
+    int height = image.GetHeight();
+    if(tileSize <= 0)
+        tileSize = max(width, height);
+    int tilesX = (width + tileSize - 1) / tileSize;
+    int tilesY = (height + tileSize - 1) / tileSize;
+    int numTiles = tilesX * tilesY;
+    int numJobs = numTiles * image.GetChannels();
+
+    #pragma omp parallel
+    {
+        vector<T> scratch(2 * min(width, tileSize) + 1);
+        #pragma omp for schedule(dynamic)
+        for(int job = 0; job < numJobs; job++)
+        {
+            int c = job / numTiles;
+            int x = (job % numTiles) % tilesX * tileSize;
+            int y = (job % numTiles) / tilesX * tileSize;
+            int w = min(tileSize, width - x);
+            int h = min(tileSize, height - y);
+            T* origin = image.GetRow(c, y) + x;
+            int numLevels = tile_levels(levels, w, h);
+            if(inverse)
+            {
+                for(int l = numLevels - 1; l >= toLevel; l--)
+                    inverse_level(origin, width, low_size(w, l), low_size(h, l), f,
+                                  &scratch[0]);
+            }
+            else
+            {
+                for(int l = 0; l < numLevels; l++)
+                    forward_level(origin, width, low_size(w, l), low_size(h, l), f,
+                                  &scratch[0]);
+            }
+        }
+    }
+}
+
+
+void WaveletForward(PlanarImage& image, WaveletType type, int levels, int tileSize)
+{
+    transform<float>(image, kLiftings[type], levels, tileSize, false, 0);
+}
+
+
+void WaveletInverse(PlanarImage& image, WaveletType type, int levels, int tileSize,
+                    int toLevel)
+{
+    transform<float>(image, kLiftings[type], levels, tileSize, true, toLevel);
+}
+
+
+void WaveletForwardInteger(IntegerImage& image, int levels, int tileSize)
+{
+    transform(image, kReversible, levels, tileSize, false, 0);
+}
+
+
+void WaveletInverseInteger(IntegerImage& image, int levels, int tileSize, int toLevel)
+{
+    transform(image, kReversible, levels, tileSize, true, toLevel);
+}
+
+
+//
+// The size of the image WaveletLowBand makes: the level low bands of
+// the tiles side by side.
+//
+static void low_band_size(int width, int height, int level, int tileSize, int& w, int& h)
+{
+    if(tileSize <= 0)
+        tileSize = max(width, height);
+    w = 0;
+    for(int x = 0; x < width; x += tileSize)
+        w += low_size(min(tileSize, width - x), level);
+    h = 0;
+    for(int y = 0; y < height; y += tileSize)
+        h += low_size(min(tileSize, height - y), level);
+}
+
+
+template <class T>
+static void low_band(const T* plane, int width, int height, int level, int levels,
+                     int tileSize, T* out, int outWidth)
+{
+    if(tileSize <= 0)
+        tileSize = max(width, height);
+    int oy = 0;
+    for(int y0 = 0; y0 < height; y0 += tileSize)
+    {
+        int h = min(tileSize, height - y0);
+        int ox = 0;
+        for(int x0 = 0; x0 < width; x0 += tileSize)
+        {
+            int w = min(tileSize, width - x0);
+            // a tile with fewer levels has a larger low band, which is
+            // subsampled to the same size
+            int shift = max(level - tile_levels(levels, w, h), 0);
+            int lw = low_size(w, level), lh = low_size(h, level);
+            int maxX = low_size(w, level - shift) - 1;
+            int maxY = low_size(h, level - shift) - 1;
+            for(int y = 0; y < lh; y++)
+            {
+                const T* src = plane + (size_t)(y0 + min(y << shift, maxY)) * width + x0;
+                T* dst = out + (size_t)(oy + y) * outWidth + ox;
+                for(int x = 0; x < lw; x++)
+                    dst[x] = src[min(x << shift, maxX)];
+            }
+            ox += lw;
+        }
+        oy += low_size(h, level);
+    }
+}
+
+
+template <class T>
+static void low_bands(const Planes<T>& image, int level, int levels, int tileSize,
+                      Planes<T>& out)
+{
+    int w, h;
+    low_band_size(image.GetWidth(), image.GetHeight(), level, tileSize, w, h);
+    out.Resize(w, h, image.GetChannels());
+    for(int c = 0; c < image.GetChannels(); c++)
+        low_band(image.GetPlane(c), image.GetWidth(), image.GetHeight(), level, levels,
+                 tileSize, out.GetPlane(c), w);
+}
+
+
+void WaveletLowBand(const PlanarImage& image, int level, int levels, int tileSize,
+                    PlanarImage& out)
+{
+    low_bands<float>(image, level, levels, tileSize, out);
+}
+
+
+void WaveletLowBand(const IntegerImage& image, int level, int levels, int tileSize,
+                    IntegerImage& out)
+{
+    low_bands(image, level, levels, tileSize, out);
+}
+
+
+//
+// Reconstruct the rectangle [x0, x1) x [y0, y1) of a w x h tile from
+// its coefficients (rows stride apart) into dst.
+//
+// Going down the levels, the rectangle needs the samples of each low
+// band from half its start to half its end, plus the numSteps samples
+// on either side that the lifting steps reach. Only those samples and
+// the details next to them are copied into a window, which is inverted
+// as if it were a whole signal. The mirroring at the sides of the
+// window is wrong unless it is the edge of the tile, but its errors
+// move inwards by one sample per lifting step, so they never reach the
+// samples that are needed.
+//
+template <class T>
+static void inverse_window(const T* tile, int stride, int w, int h, int numLevels,
+                           int x0, int y0, int x1, int y1, const Lifting& f,
+                           T* dst, int dstStride)
+{
+    int margin = f.numSteps;
+    vector<int> ax(numLevels + 1), bx(numLevels + 1), ay(numLevels + 1), by(numLevels + 1);
+    ax[0] = x0; bx[0] = x1;
+    ay[0] = y0; by[0] = y1;
+    for(int l = 1; l <= numLevels; l++)
+    {
+        ax[l] = max(ax[l-1] / 2 - margin, 0);
+        bx[l] = min((bx[l-1] + 1) / 2 + margin, low_size(w, l));
+        ay[l] = max(ay[l-1] / 2 - margin, 0);
+        by[l] = min((by[l-1] + 1) / 2 + margin, low_size(h, l));
+    }
+
+    // start with the part of the coarsest low band that is needed
+    int wx = ax[numLevels], wy = ay[numLevels];
+    int ww = bx[numLevels] - wx, wh = by[numLevels] - wy;
+    vector<T> window(ww * wh), next, scratch;
+    for(int y = 0; y < wh; y++)
+        memcpy(&window[y * ww], tile + (size_t)(wy + y) * stride + wx, ww * sizeof(T));
+
+    for(int l = numLevels; l >= 1; l--)
+    {
+        int nsx = low_size(w, l), ndx = low_size(w, l - 1) - nsx;
+        int nsy = low_size(h, l), ndy = low_size(h, l - 1) - nsy;
+        int sx = bx[l] - ax[l], dx = min(bx[l], ndx) - ax[l];
+        int sy = by[l] - ay[l], dy = min(by[l], ndy) - ay[l];
+        int bw = sx + dx, bh = sy + dy;
+        next.resize(bw * bh);
+        scratch.resize(2 * bw + 1);
+
+        // the low band from the window, the details from the tile
+        for(int y = 0; y < sy; y++)
+        {
+            T* row = &next[y * bw];
+            memcpy(row, &window[(ay[l] - wy + y) * ww + ax[l] - wx], sx * sizeof(T));
+            memcpy(row + sx, tile + (size_t)(ay[l] + y) * stride + nsx + ax[l], dx * sizeof(T));
+        }
+        for(int y = 0; y < dy; y++)
+        {
+            T* row = &next[(sy + y) * bw];
+            const T* src = tile + (size_t)(nsy + ay[l] + y) * stride;
+            memcpy(row, src + ax[l], sx * sizeof(T));
+            memcpy(row + sx, src + nsx + ax[l], dx * sizeof(T));
+        }
+        inverse_level(&next[0], bw, bw, bh, f, &scratch[0]);
+
+        window.swap(next);
+        wx = 2 * ax[l];
+        wy = 2 * ay[l];
+        ww = bw;
+        wh = bh;
+    }
+
+    for(int y = y0; y < y1; y++)
+        memcpy(dst + (size_t)(y - y0) * dstStride, &window[(y - wy) * ww + x0 - wx],
+               (x1 - x0) * sizeof(T));
+}
+
+
+template <class T>
+static void inverse_rectangle(const Planes<T>& coeffs, const Lifting& f, int x, int y,
+                              int width, int height, Planes<T>& out, int levels,
+                              int tileSize)
+{
+    int imageWidth = coeffs.GetWidth();
+    int imageHeight = coeffs.GetHeight();
+    out.Resize(width, height, coeffs.GetChannels());
+    if(tileSize <= 0)
+        tileSize = max(imageWidth, imageHeight);
+
+    // the tiles the rectangle overlaps
+    vector<int> tiles;
+    for(int ty = y / tileSize * tileSize; ty < y + height; ty += tileSize)
+        for(int tx = x / tileSize * tileSize; tx < x + width; tx += tileSize)
+        {
+            tiles.push_back(tx);
+            tiles.push_back(ty);
+        }
+    int numTiles = (int)tiles.size() / 2;
+    int numJobs = numTiles * coeffs.GetChannels();
+
+    #pragma omp parallel for schedule(dynamic)
+    for(int job = 0; job < numJobs; job++)
+    {
+        int c = job / numTiles;
+        int tx = tiles[2 * (job % numTiles)], ty = tiles[2 * (job % numTiles) + 1];
+        int w = min(tileSize, imageWidth - tx);
+        int h = min(tileSize, imageHeight - ty);
+        int x0 = max(x, tx) - tx, x1 = min(x + width, tx + w) - tx;
+        int y0 = max(y, ty) - ty, y1 = min(y + height, ty + h) - ty;
+        const T* tile = coeffs.GetRow(c, ty) + tx;
+        T* dst = out.GetRow(c, ty + y0 - y) + tx + x0 - x;
+        inverse_window(tile, imageWidth, w, h, tile_levels(levels, w, h),
+                       x0, y0, x1, y1, f, dst, width);
+    }
+}
+
+
+void WaveletInverseRegion(const PlanarImage& coeffs, WaveletType type, int x, int y,
+                          int width, int height, PlanarImage& out, int levels, int tileSize)
+{
+    inverse_rectangle<float>(coeffs, kLiftings[type], x, y, width, height, out, levels, tileSize);
+}
+
+
+void WaveletInverseIntegerRegion(const IntegerImage& coeffs, int x, int y, int width,
+                                 int height, IntegerImage& out, int levels, int tileSize)
+{
+    inverse_rectangle(coeffs, kReversible, x, y, width, height, out, levels, tileSize);
+}
+
+
+//
+// Time the passes of one level of a transform on a plane and print the
+// best of repeats runs of each.
+//
+template <class T>
+static void benchmark_passes(Planes<T>& image, const Lifting& f, int repeats)
+{
+    typedef void (*Pass)(T*, int, int, int, const Lifting&, T*);
+    static const Pass passes[4] =
+        { forward_rows<T>, forward_columns<T>, inverse_columns<T>, inverse_rows<T> };
+    static const char* names[4] = { "forward rows", "forward columns", "inverse columns", "inverse rows" };
+
+    int width = image.GetWidth(), height = image.GetHeight();
+    vector<T> scratch(2*width);
+    // every pass reads and writes the plane once
+    double megabytes = 2.0 * width * height * sizeof(T) / 1048576.0;
+    for(int p = 0; p < 4; p++)
+    {
+        float best = 0.0f;
+        for(int r = 0; r < repeats; r++)
+        {
+            STTimer timer;
+            timer.Reset();
+            passes[p](image.GetPlane(0), width, width, height, f, &scratch[0]);
+            float ms = timer.GetElapsedMillis();
+            if(r == 0 || ms < best)
+                best = ms;
+        }
+        printf("  %-16s %8.2f ms %8.0f MB/s\n", names[p], best, megabytes * 1000.0 / max(best, 1e-3f));
+    }
+}
+
+
+void WaveletBenchmark(int width, int height, int repeats)
+{
+    PlanarImage image(width, height, 1);
+    float* plane = image.GetPlane(0);
+    for(size_t i = 0; i < (size_t)width*height; i++)
+        plane[i] = (float)(i % 251) / 251.0f;
+
+    printf("%i x %i plane, %.1f MB per pass, best of %i\n", width, height,
+           (double)width * height * sizeof(float) / 1048576.0, repeats);
+    for(int t = 0; t < NUM_WAVELETS; t++)
+    {
+        printf("%s\n", WaveletName((WaveletType)t));
+        benchmark_passes<float>(image, kLiftings[t], repeats);
+    }
+
+    IntegerImage integer(width, height, 1);
+    short* samples = integer.GetPlane(0);
+    for(size_t i = 0; i < (size_t)width*height; i++)
+        samples[i] = (short)(i % 251);
+
+    printf("CDF 5/3 reversible, 16-bit\n");
+    benchmark_passes(integer, kReversible, repeats);
+}
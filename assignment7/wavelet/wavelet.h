@@ -0,0 +1,235 @@
+// wavelet.h
+#ifndef __WAVELET_H__
+#define __WAVELET_H__
+
+#include "st.h"
+#include <vector>
+
+//
+// The wavelets the transform can use. All of them are computed with
+// lifting steps, so the transform needs no second copy of the image.
+//
+enum WaveletType
+{
+    WAVELET_HAAR = 0,
+    WAVELET_CDF53,      // LeGall 5/3, the JPEG 2000 reversible filter
+    WAVELET_CDF97,      // Cohen-Daubechies-Feauveau 9/7, the JPEG 2000 lossy filter
+    NUM_WAVELETS
+};
+
+//
+// Get a printable name for a wavelet.
+//
+const char* WaveletName(WaveletType type);
+
+//
+// An image of T samples stored as one plane per channel, rows from the
+// bottom like STImage. Keeping the channels apart means the transform
+// works on contiguous runs of a single channel, which is what the SIMD
+// lifting steps want.
+//
+template <class T>
+class Planes
+{
+public:
+    Planes()
+        : mWidth(0), mHeight(0), mChannels(0)
+    {
+    }
+
+    Planes(int width, int height, int channels = 3)
+    {
+        Resize(width, height, channels);
+    }
+
+    //
+    // Change the size of the image. The contents are undefined.
+    //
+    void Resize(int width, int height, int channels = 3)
+    {
+        mWidth = width;
+        mHeight = height;
+        mChannels = channels;
+        mData.resize((size_t)width * height * channels);
+    }
+
+    int GetWidth() const { return mWidth; }
+    int GetHeight() const { return mHeight; }
+    int GetChannels() const { return mChannels; }
+
+    //
+    // Get the first row of a channel. Rows are GetWidth() samples apart.
+    //
+    T* GetPlane(int c) { return &mData[(size_t)c * mWidth * mHeight]; }
+    const T* GetPlane(int c) const { return &mData[(size_t)c * mWidth * mHeight]; }
+
+    //
+    // Get row y of a channel.
+    //
+    T* GetRow(int c, int y) { return GetPlane(c) + (size_t)y * mWidth; }
+    const T* GetRow(int c, int y) const { return GetPlane(c) + (size_t)y * mWidth; }
+
+private:
+    int mWidth;
+    int mHeight;
+    int mChannels;
+    std::vector<T> mData;
+};
+
+//
+// The float image the transform works on.
+//
+class PlanarImage : public Planes<float>
+{
+public:
+    PlanarImage() {}
+    PlanarImage(int width, int height, int channels = 3)
+        : Planes<float>(width, height, channels)
+    {
+    }
+
+    //
+    // Make an image with the r, g and b channels of an STImage,
+    // scaled to [0, 1].
+    //
+    PlanarImage(const STImage* image);
+};
+
+//
+// A tile size that keeps a tile of one channel (256 KB) in L2.
+//
+#define WAVELET_TILE_SIZE 256
+
+//
+// The kinds of subbands. HL is high-pass along the rows and low-pass
+// along the columns, LH the other way around.
+//
+enum SubbandOrientation
+{
+    SUBBAND_LL = 0,
+    SUBBAND_HL,
+    SUBBAND_LH,
+    SUBBAND_HH
+};
+
+//
+// A rectangle of coefficients from one level of the transform. Level 1
+// holds the finest details; the LL band of a tile has the level of its
+// coarsest details.
+//
+struct Subband
+{
+    int level;
+    int orientation;
+    int x, y;
+    int width, height;
+};
+
+//
+// Get the number of levels a full decomposition of a width x height
+// image has, i.e. how often both sides can be halved (rounding up)
+// before one of them is a single sample.
+//
+int WaveletMaxLevels(int width, int height);
+
+//
+// List the subbands WaveletForward produces with the same arguments:
+// for every tile, its LL band, then the HL, LH and HH bands from the
+// coarsest level to the finest.
+//
+void WaveletSubbands(int width, int height, int levels, int tileSize,
+                     std::vector<Subband>& subbands);
+
+//
+// Transform every channel of an image in place, levels times (0, or
+// more than a tile allows, for WaveletMaxLevels). Each level splits
+// the rows and then the columns of the current low band into a low
+// half followed by a high half, so the coefficients end up in the
+// usual pyramid with the final low band at (0, 0); WaveletSubbands
+// gives the layout. A side of n samples splits into (n + 1) / 2 low
+// and n / 2 high ones, and signals are extended symmetrically at the
+// ends, so any size works.
+//
+// The low filters have a gain of 1 on a constant signal and the high
+// filters a gain of 1 on the alternating signal 1, -1, 1, ..., so the
+// low band keeps the range of the pixels and the Haar coefficients are
+// (a + b) / 2 and (a - b) / 2.
+//
+// With a tileSize, the image is cut into tileSize x tileSize tiles
+// (smaller at the right and top edges) which are transformed on their
+// own, each with its own pyramid. Tiles and channels are transformed
+// in parallel.
+//
+void WaveletForward(PlanarImage& image, WaveletType type, int levels = 0,
+                    int tileSize = 0);
+
+//
+// Undo WaveletForward with the same type, levels and tile size.
+//
+// With a toLevel, only the levels coarser than it are undone, which
+// costs about 1/4^toLevel of the full inverse. Each tile then holds its
+// low band of that level, the image at 1/2^toLevel of the resolution
+// (see WaveletLowBand), in front of the untouched finer details: a
+// toLevel-level transform, which a later call with toLevel as the
+// number of levels refines further.
+//
+void WaveletInverse(PlanarImage& image, WaveletType type, int levels = 0,
+                    int tileSize = 0, int toLevel = 0);
+
+//
+// Copy the low bands of a level out of the tiles of a transform and
+// put them side by side, giving the image at 1/2^level of the
+// resolution (rounded up, tile by tile). The low bands of tiles with
+// fewer levels are subsampled.
+//
+void WaveletLowBand(const PlanarImage& image, int level, int levels, int tileSize,
+                    PlanarImage& out);
+
+//
+// Reconstruct the width x height rectangle at (x, y) of an image from
+// the coefficients of WaveletForward (with the same type, levels and
+// tile size), leaving them as they are. Only the coefficients the
+// rectangle depends on are transformed: at every level, the part of
+// the pyramid under the rectangle plus a few samples around it, so a
+// small rectangle costs a small fraction of the whole inverse. The
+// rectangle must lie inside the image.
+//
+void WaveletInverseRegion(const PlanarImage& coeffs, WaveletType type, int x, int y,
+                          int width, int height, PlanarImage& out, int levels = 0,
+                          int tileSize = 0);
+
+//
+// A 16-bit integer image for the reversible transform.
+//
+typedef Planes<short> IntegerImage;
+
+//
+// The reversible 5/3 transform of JPEG 2000 on an integer image, with
+// the same layout, levels and tiles as WaveletForward. It rounds every
+// lifting step to an integer, so WaveletInverseInteger gives back the
+// exact samples. The high bands have a gain of 2 rather than 1.
+//
+// The coefficients of samples with up to 9 bits (8-bit pixels, or
+// their color differences) fit in 16 bits, so the transform needs half
+// the memory of the float one and does 8 samples per SSE2 register.
+//
+// The low band and region functions work the same as with the float
+// transform.
+//
+void WaveletForwardInteger(IntegerImage& image, int levels = 0, int tileSize = 0);
+void WaveletInverseInteger(IntegerImage& image, int levels = 0, int tileSize = 0,
+                           int toLevel = 0);
+void WaveletLowBand(const IntegerImage& image, int level, int levels, int tileSize,
+                    IntegerImage& out);
+void WaveletInverseIntegerRegion(const IntegerImage& coeffs, int x, int y, int width,
+                                 int height, IntegerImage& out, int levels = 0,
+                                 int tileSize = 0);
+
+//
+// Time each pass of one level of every transform on a width x height
+// plane and print the best of repeats runs, with the memory bandwidth
+// it reached (each pass reads and writes the plane once).
+//
+void WaveletBenchmark(int width, int height, int repeats = 5);
+
+#endif //__WAVELET_H__
@@ -5,9 +5,21 @@
 #include "stgl.h"
 
 #include <assert.h>
+#include <limits.h>
 #include <stdio.h>
-#include <map>
+#include <stdlib.h>
 #include <math.h>
+#include <string.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#ifndef _WIN32
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#else
+#include <process.h>
+#endif
+#include <algorithm>
 
 //
 
@@ -41,11 +53,19 @@ STShape::STShape(const VertexArray& vertices, const FaceArray& faces)
 {
 }
 
-// Create an STShape from a geometric model file.
-// Currently only supports the OBJ file format.
-STShape::STShape(const std::string& filename)
+// Create an STShape from a geometric model file, either an
+// OBJ file or a binary .stm file.
+STShape::STShape(const std::string& filename, bool useCache)
 {
-    if (LoadOBJ(filename) != ST_OK) {
+    STStatus status;
+    if (STGetExtension(filename).compare("STM") == 0)
+        status = LoadSTM(filename);
+    else if (useCache)
+        status = LoadCachedOBJ(filename);
+    else
+        status = LoadOBJ(filename);
+
+    if (status != ST_OK) {
         throw new std::runtime_error("Error creating STShape");
     }
 }
@@ -167,20 +187,534 @@ void STShape::GenerateNormals()
     }
 }
 
-// Helper function to deal with the particular way
-// that indices must be interpreted in an .obj file
-static int OBJIndexing(int input, size_t numValues)
+//
+// A whole file, mapped into memory where mmap is available and read
+// into it elsewhere (_WIN32).
+//
+class STMappedFile
 {
-    if (input > 0) return input - 1;
-    return numValues + input;
+public:
+    STMappedFile() : mData(NULL), mSize(0), mMapping(NULL) {}
+    ~STMappedFile() { Close(); }
+
+    // Returns false if the file can't be opened.
+    bool Open(const std::string& filename);
+    void Close();
+
+    const char* GetData() const { return mData; }
+    size_t GetSize() const { return mSize; }
+
+private:
+    const char* mData;
+    size_t mSize;
+    void* mMapping;
+    std::vector<char> mContents;
+};
+
+bool STMappedFile::Open(const std::string& filename)
+{
+    Close();
+#ifndef _WIN32
+    int fd = open(filename.c_str(), O_RDONLY);
+    if (fd < 0)
+        return false;
+    struct stat st;
+    if (fstat(fd, &st) != 0) {
+        close(fd);
+        return false;
+    }
+    mSize = (size_t)st.st_size;
+    if (mSize > 0) {
+        mMapping = mmap(NULL, mSize, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (mMapping == MAP_FAILED) {
+            mMapping = NULL;
+            mSize = 0;
+            close(fd);
+            return false;
+        }
+        mData = (const char*)mMapping;
+    }
+    close(fd);
+    return true;
+#else
+    FILE* file = fopen(filename.c_str(), "rb");
+    if (!file)
+        return false;
+    fseek(file, 0, SEEK_END);
+    long size = ftell(file);
+    fseek(file, 0, SEEK_SET);
+    mContents.resize(size > 0 ? size : 0);
+    mSize = fread(mContents.empty() ? NULL : &mContents[0], 1, mContents.size(), file);
+    fclose(file);
+    mData = mContents.empty() ? NULL : &mContents[0];
+    return true;
+#endif
+}
+
+void STMappedFile::Close()
+{
+#ifndef _WIN32
+    if (mMapping)
+        munmap(mMapping, mSize);
+#endif
+    mMapping = NULL;
+    mData = NULL;
+    mSize = 0;
+    mContents.clear();
 }
 
+//
+// The OBJ loader works on the mapped file in chunks of about
+// kOBJChunkSize bytes, cut at line ends. A first parallel pass only
+// counts the lines, positions, texture coordinates, normals, faces and
+// face corners of every chunk; their prefix sums give each chunk the
+// place its data takes in the whole file. The second parallel pass then
+// parses every chunk straight into those places, so the result is the
+// same as a serial parse no matter how the chunks are scheduled, and
+// relative (negative) indices resolve against the counts before them.
+// Finally a serial pass turns the corners into vertices and faces.
+//
+static const size_t kOBJChunkSize = 1 << 20;
+
+enum OBJCommand
+{
+    OBJ_EMPTY,
+    OBJ_POSITION,
+    OBJ_TEXCOORD,
+    OBJ_NORMAL,
+    OBJ_FACE,
+    OBJ_IGNORED,
+    OBJ_UNKNOWN
+};
+
+//
+// One corner of a face: indices of its position, texture coordinate
+// and normal from 0, with -1 for those it doesn't give. A position of
+// -1 marks a corner that couldn't be parsed.
+//
+struct OBJCorner
+{
+    int position;
+    int texCoord;
+    int normal;
+};
+
+struct OBJChunk
+{
+    const char* begin;
+    const char* end;
+
+    // what the chunk holds, from the first pass
+    size_t numLines;
+    size_t numPositions;
+    size_t numTexCoords;
+    size_t numNormals;
+    size_t numFaces;
+    size_t numCorners;
+
+    // where its data starts in the whole file
+    size_t firstLine;
+    size_t firstPosition;
+    size_t firstTexCoord;
+    size_t firstNormal;
+    size_t firstFace;
+    size_t firstCorner;
+
+    // problems the second pass found, reported in file order
+    size_t numBadLines;
+    size_t numBadCorners;
+    size_t firstBadLine;
+    std::string firstBadText;
+};
+
+static inline bool IsBlank(char c)
+{
+    return c == ' ' || c == '\t' || c == '\r';
+}
+
+//
+// Find the next token of a line, before any comment. Returns false
+// at the end of the line.
+//
+static inline bool NextToken(const char*& p, const char* end, const char*& tokenEnd)
+{
+    while (p < end && IsBlank(*p))
+        ++p;
+    if (p == end || *p == '#')
+        return false;
+    tokenEnd = p;
+    while (tokenEnd < end && !IsBlank(*tokenEnd))
+        ++tokenEnd;
+    return true;
+}
+
+//
+// Read the command that starts a line and move past it.
+//
+static OBJCommand ReadCommand(const char*& p, const char* end)
+{
+    const char* commandEnd;
+    if (!NextToken(p, end, commandEnd))
+        return OBJ_EMPTY;
+    const char* command = p;
+    size_t length = commandEnd - command;
+    p = commandEnd;
+
+    if (length == 1) {
+        switch (command[0]) {
+        case 'v': return OBJ_POSITION;
+        case 'f': return OBJ_FACE;
+        case 'o': return OBJ_IGNORED;
+        }
+    }
+    if (length == 2 && command[0] == 'v') {
+        if (command[1] == 't')
+            return OBJ_TEXCOORD;
+        if (command[1] == 'n')
+            return OBJ_NORMAL;
+    }
+    if (command[0] == 'g' || command[0] == 's' ||
+        (length == 6 && (memcmp(command, "usemtl", 6) == 0 ||
+                         memcmp(command, "mtllib", 6) == 0)))
+        return OBJ_IGNORED;
+    return OBJ_UNKNOWN;
+}
+
+//
+// Parse a decimal integer at p, moving p past it.
+//
+static inline bool ParseInt(const char*& p, const char* end, int& value)
+{
+    const char* s = p;
+    bool negative = false;
+    if (s < end && (*s == '-' || *s == '+'))
+        negative = (*s++ == '-');
+    long long magnitude = 0;
+    const char* digits = s;
+    while (s < end && (unsigned)(*s - '0') < 10) {
+        if (magnitude < INT_MAX)
+            magnitude = magnitude * 10 + (*s - '0');
+        ++s;
+    }
+    if (s == digits)
+        return false;
+    value = (int)STMin(magnitude, (long long)INT_MAX);
+    if (negative)
+        value = -value;
+    p = s;
+    return true;
+}
+
+//
+// Parse the float token at p, moving p past it. The digits are
+// gathered into a 64-bit integer and scaled by an exact power of ten
+// in double precision, which agrees with strtof to within a unit in
+// the last place; spellings that need more (like "inf") go to strtod.
+//
+static bool ParseFloat(const char*& p, const char* end, float& value)
+{
+    static const double kPowersOf10[] = {
+        1e0, 1e1, 1e2, 1e3, 1e4, 1e5, 1e6, 1e7, 1e8, 1e9, 1e10, 1e11,
+        1e12, 1e13, 1e14, 1e15, 1e16, 1e17, 1e18, 1e19, 1e20, 1e21, 1e22
+    };
+    static const unsigned long long kMaxMantissa = 1000000000000000000ULL;
+
+    const char* s = p;
+    bool negative = false;
+    if (s < end && (*s == '-' || *s == '+'))
+        negative = (*s++ == '-');
+
+    unsigned long long mantissa = 0;
+    int exponent = 0;
+    bool sawDigit = false;
+    while (s < end && (unsigned)(*s - '0') < 10) {
+        if (mantissa < kMaxMantissa)
+            mantissa = mantissa * 10 + (*s - '0');
+        else
+            ++exponent;
+        ++s;
+        sawDigit = true;
+    }
+    if (s < end && *s == '.') {
+        ++s;
+        while (s < end && (unsigned)(*s - '0') < 10) {
+            if (mantissa < kMaxMantissa) {
+                mantissa = mantissa * 10 + (*s - '0');
+                --exponent;
+            }
+            ++s;
+            sawDigit = true;
+        }
+    }
+    if (sawDigit && s < end && (*s == 'e' || *s == 'E')) {
+        const char* e = s + 1;
+        int power;
+        if (ParseInt(e, end, power)) {
+            exponent += STMax(STMin(power, 1000), -1000);
+            s = e;
+        }
+    }
+
+    if (!sawDigit || (s < end && !IsBlank(*s))) {
+        const char* tokenEnd = p;
+        while (tokenEnd < end && !IsBlank(*tokenEnd))
+            ++tokenEnd;
+        char buffer[64];
+        size_t length = STMin((size_t)(tokenEnd - p), sizeof(buffer) - 1);
+        memcpy(buffer, p, length);
+        buffer[length] = '\0';
+        char* stop;
+        double parsed = strtod(buffer, &stop);
+        if (stop == buffer)
+            return false;
+        value = (float)parsed;
+        p = tokenEnd;
+        return true;
+    }
+
+    double result = (double)mantissa;
+    if (exponent < 0 && exponent >= -22)
+        result /= kPowersOf10[-exponent];
+    else if (exponent > 0 && exponent <= 22)
+        result *= kPowersOf10[exponent];
+    else if (exponent != 0)
+        result *= pow(10.0, exponent);
+    value = (float)(negative ? -result : result);
+    p = s;
+    return true;
+}
+
+//
+// Parse up to count floats from the rest of a line, leaving zeros for
+// missing ones. Returns the number parsed.
+//
+static int ParseFloats(const char* p, const char* end, float* values, int count)
+{
+    int numParsed = 0;
+    while (numParsed < count) {
+        while (p < end && IsBlank(*p))
+            ++p;
+        if (p == end || *p == '#' || !ParseFloat(p, end, values[numParsed]))
+            break;
+        ++numParsed;
+    }
+    for (int ii = numParsed; ii < count; ++ii)
+        values[ii] = 0.0f;
+    return numParsed;
+}
+
+//
+// Turn an OBJ index into one from 0. OBJ indices count from 1, and
+// negative ones count back from the last element defined so far.
+//
+static inline bool ResolveOBJIndex(int input, size_t numDefined, size_t numTotal, int& index)
+{
+    long long result = (input > 0) ? (long long)input - 1 : (long long)numDefined + input;
+    if (input == 0 || result < 0 || result >= (long long)numTotal)
+        return false;
+    index = (int)result;
+    return true;
+}
+
+//
+// Parse the face corner token at p, moving p past it: p, p/t, p//n or
+// p/t/n.
+//
+static bool ParseCorner(const char*& p, const char* end,
+                        const size_t numDefined[3], const size_t numTotal[3],
+                        OBJCorner& corner)
+{
+    int raw;
+    bool ok = ParseInt(p, end, raw) &&
+              ResolveOBJIndex(raw, numDefined[0], numTotal[0], corner.position);
+    corner.texCoord = corner.normal = -1;
+    if (ok && p < end && *p == '/') {
+        ++p;
+        if (p < end && *p != '/') {
+            ok = ParseInt(p, end, raw) &&
+                 ResolveOBJIndex(raw, numDefined[1], numTotal[1], corner.texCoord);
+        }
+        if (ok && p < end && *p == '/') {
+            ++p;
+            ok = ParseInt(p, end, raw) &&
+                 ResolveOBJIndex(raw, numDefined[2], numTotal[2], corner.normal);
+        }
+    }
+    if (ok && (p == end || IsBlank(*p)))
+        return true;
+
+    // skip the rest of a bad token
+    while (p < end && !IsBlank(*p))
+        ++p;
+    corner.position = -1;
+    return false;
+}
+
+//
+// First pass: count what a chunk holds.
+//
+static void CountOBJChunk(OBJChunk& chunk)
+{
+    chunk.numLines = chunk.numPositions = chunk.numTexCoords = chunk.numNormals = 0;
+    chunk.numFaces = chunk.numCorners = 0;
+
+    const char* p = chunk.begin;
+    while (p < chunk.end) {
+        const char* eol = (const char*)memchr(p, '\n', chunk.end - p);
+        if (!eol)
+            eol = chunk.end;
+        ++chunk.numLines;
+
+        switch (ReadCommand(p, eol)) {
+        case OBJ_POSITION: ++chunk.numPositions; break;
+        case OBJ_TEXCOORD: ++chunk.numTexCoords; break;
+        case OBJ_NORMAL:   ++chunk.numNormals; break;
+        case OBJ_FACE: {
+            const char* tokenEnd;
+            ++chunk.numFaces;
+            while (NextToken(p, eol, tokenEnd)) {
+                ++chunk.numCorners;
+                p = tokenEnd;
+            }
+            break;
+        }
+        default:
+            break;
+        }
+        p = eol + 1;
+    }
+}
+
+//
+// Second pass: parse a chunk into its place in the arrays.
+//
+static void ParseOBJChunk(OBJChunk& chunk, const size_t numTotal[3],
+                          std::vector<STPoint3>& positions,
+                          std::vector<STPoint2>& texCoords,
+                          std::vector<STVector3>& normals,
+                          std::vector<OBJCorner>& corners,
+                          std::vector<unsigned int>& faceSizes)
+{
+    chunk.numBadLines = chunk.numBadCorners = 0;
+
+    size_t numDefined[3] = { chunk.firstPosition, chunk.firstTexCoord, chunk.firstNormal };
+    size_t face = chunk.firstFace;
+    size_t corner = chunk.firstCorner;
+    size_t line = chunk.firstLine;
+
+    const char* p = chunk.begin;
+    while (p < chunk.end) {
+        const char* start = p;
+        const char* eol = (const char*)memchr(p, '\n', chunk.end - p);
+        if (!eol)
+            eol = chunk.end;
+        ++line;
+
+        bool bad = false;
+        switch (ReadCommand(p, eol)) {
+        case OBJ_POSITION: {
+            STPoint3& position = positions[numDefined[0]++];
+            bad = ParseFloats(p, eol, &position.x, 3) < 3;
+            break;
+        }
+        case OBJ_TEXCOORD: {
+            STPoint2& texCoord = texCoords[numDefined[1]++];
+            bad = ParseFloats(p, eol, &texCoord.x, 2) < 1;
+            break;
+        }
+        case OBJ_NORMAL: {
+            STVector3& normal = normals[numDefined[2]++];
+            bad = ParseFloats(p, eol, &normal.x, 3) < 3;
+            break;
+        }
+        case OBJ_FACE: {
+            unsigned int size = 0;
+            for (;;) {
+                while (p < eol && IsBlank(*p))
+                    ++p;
+                if (p == eol || *p == '#')
+                    break;
+                if (!ParseCorner(p, eol, numDefined, numTotal, corners[corner])) {
+                    ++chunk.numBadCorners;
+                    bad = true;
+                }
+                ++corner;
+                ++size;
+            }
+            faceSizes[face++] = size;
+            break;
+        }
+        case OBJ_UNKNOWN:
+            bad = true;
+            break;
+        default:
+            break;
+        }
+
+        if (bad && chunk.numBadLines++ == 0) {
+            chunk.firstBadLine = line;
+            chunk.firstBadText.assign(start, STMin((size_t)(eol - start), (size_t)80));
+        }
+        p = eol + 1;
+    }
+}
+
+//
+// A flat hash table from (position, texCoord, normal) corners to the
+// vertices made for them, hashed on the position alone: every position
+// starts a chain through the vertices that use it, which are rarely
+// more than a few (one per distinct texCoord/normal seam). Neighbouring
+// faces use neighbouring positions, so the lookups stay in cache far
+// better than with a scattering hash function.
+//
+static const STShape::Index kOBJNoVertex = ~0u;
+
+class OBJVertexMap
+{
+public:
+    OBJVertexMap(size_t numPositions)
+        : mFirst(numPositions, kOBJNoVertex)
+    {
+    }
+
+    //
+    // Get the vertex of a corner, counting from 0 in the order the
+    // corners were first seen, adding it if it's new. Returns true if
+    // the corner was new.
+    //
+    bool Insert(const OBJCorner& corner, STShape::Index& vertex)
+    {
+        STShape::Index* link = &mFirst[corner.position];
+        while (*link != kOBJNoVertex) {
+            const Node& node = mNodes[*link];
+            if (node.texCoord == corner.texCoord && node.normal == corner.normal) {
+                vertex = *link;
+                return false;
+            }
+            link = &mNodes[*link].next;
+        }
+        vertex = *link = (STShape::Index)mNodes.size();
+        Node node = { corner.texCoord, corner.normal, kOBJNoVertex };
+        mNodes.push_back(node);
+        return true;
+    }
+
+private:
+    struct Node
+    {
+        int texCoord;
+        int normal;
+        STShape::Index next;
+    };
+
+    std::vector<STShape::Index> mFirst;
+    std::vector<Node> mNodes;
+};
+
 // Load the shape with vertices and faces from the OBJ file.
 // Returns ST_ERROR on failure, ST_OK on success.
 STStatus STShape::LoadOBJ(const std::string& filename)
 {
-    static const int kMaxLine = 256;
-
     // The subset of the OBJ format that we handle has
     // the following commands:
     //
@@ -197,226 +731,524 @@ STStatus STShape::LoadOBJ(const std::string& filename)
     //
 
     //
-    // Open the file.
+    // Map the file.
     //
-    FILE* file = fopen(filename.c_str(), "r");
-    if (!file) {
+    STMappedFile file;
+    if (!file.Open(filename)) {
         fprintf(stderr,
                 "STShape::LoadOBJ() - Could not open shape file '%s'.\n", filename.c_str());
         return ST_ERROR;
     }
+    const char* data = file.GetData();
+    const char* dataEnd = data + file.GetSize();
 
-    char lineBuffer[kMaxLine];
-    int lineIndex = 0; // for printing error messages
+    //
+    // Cut it into chunks at line ends.
+    //
+    std::vector<OBJChunk> chunks;
+    for (const char* p = data; p < dataEnd; ) {
+        OBJChunk chunk;
+        chunk.begin = p;
+        chunk.end = dataEnd;
+        if ((size_t)(dataEnd - p) > kOBJChunkSize) {
+            const char* eol = (const char*)memchr(p + kOBJChunkSize, '\n',
+                                                  dataEnd - (p + kOBJChunkSize));
+            if (eol)
+                chunk.end = eol + 1;
+        }
+        chunks.push_back(chunk);
+        p = chunk.end;
+    }
+    int numChunks = (int)chunks.size();
+
+    #pragma omp parallel for schedule(dynamic)
+    for (int ii = 0; ii < numChunks; ++ii)
+        CountOBJChunk(chunks[ii]);
+
+    size_t numLines = 0, numPositions = 0, numTexCoords = 0, numNormals = 0;
+    size_t numFaces = 0, numCorners = 0;
+    for (int ii = 0; ii < numChunks; ++ii) {
+        OBJChunk& chunk = chunks[ii];
+        chunk.firstLine = numLines;
+        chunk.firstPosition = numPositions;
+        chunk.firstTexCoord = numTexCoords;
+        chunk.firstNormal = numNormals;
+        chunk.firstFace = numFaces;
+        chunk.firstCorner = numCorners;
+        numLines += chunk.numLines;
+        numPositions += chunk.numPositions;
+        numTexCoords += chunk.numTexCoords;
+        numNormals += chunk.numNormals;
+        numFaces += chunk.numFaces;
+        numCorners += chunk.numCorners;
+    }
 
     // Arrays to collect the positions, normals and texture
-    // coordinates that we encounter.
-    std::vector<STPoint3> positions;
-    std::vector<STPoint2> texCoords;
-    std::vector<STVector3> normals;
-
-    // Map to point us to previously-created vertices. This maps
-    // triples of indices (a position, texcoord and normal index)
-    // to a single index in the new shape.
-    typedef std::pair<int,int> IntPair;
-    typedef std::pair<int, IntPair> IntTriple;
-    typedef std::map<IntTriple, size_t> IndexMap;
-    IndexMap indexMap;
+    // coordinates, and the corners of the faces.
+    std::vector<STPoint3> positions(numPositions);
+    std::vector<STPoint2> texCoords(numTexCoords);
+    std::vector<STVector3> normals(numNormals);
+    std::vector<OBJCorner> corners(numCorners);
+    std::vector<unsigned int> faceSizes(numFaces);
+    size_t numTotal[3] = { numPositions, numTexCoords, numNormals };
+
+    #pragma omp parallel for schedule(dynamic)
+    for (int ii = 0; ii < numChunks; ++ii)
+        ParseOBJChunk(chunks[ii], numTotal, positions, texCoords, normals, corners, faceSizes);
+
+    size_t numBadLines = 0, numBadCorners = 0;
+    for (int ii = 0; ii < numChunks; ++ii) {
+        const OBJChunk& chunk = chunks[ii];
+        if (chunk.numBadLines > 0 && numBadLines == 0) {
+            fprintf(stderr, "STShape::LoadOBJ() - "
+                    "Unable to parse line %d: %s (continuing)\n",
+                    (int)chunk.firstBadLine, chunk.firstBadText.c_str());
+        }
+        numBadLines += chunk.numBadLines;
+        numBadCorners += chunk.numBadCorners;
+    }
+    if (numBadLines > 1) {
+        fprintf(stderr, "STShape::LoadOBJ() - "
+                "%d lines could not be parsed fully (%d bad face corners)\n",
+                (int)numBadLines, (int)numBadCorners);
+    }
+
+    //
+    // We look to see if we have already created a vertex based on
+    // each corner's position/texCoord/normal, and reuse it if
+    // possible. Otherwise we add a new vertex. Faces with more than
+    // three corners are split into a fan of triangles.
+    //
+    OBJVertexMap indexMap(numPositions);
+    Index firstVertex = (Index)mVertices.size();
+    mVertices.reserve(mVertices.size() + numPositions);
+    mFaces.reserve(mFaces.size() + (numCorners > 2 * numFaces ? numCorners - 2 * numFaces : 0));
 
     // Keep track of whether the file contained normals...
     bool needsNormals = false;
 
+    const OBJCorner* corner = corners.empty() ? NULL : &corners[0];
+    for (size_t ii = 0; ii < numFaces; ++ii) {
+        Index indices[3];
+        int curIndex = 0;
+        for (unsigned int jj = 0; jj < faceSizes[ii]; ++jj, ++corner) {
+            if (corner->position < 0)
+                continue;
+
+            Index newIndex;
+            bool isNew = indexMap.Insert(*corner, newIndex);
+            newIndex += firstVertex;
+            if (isNew) {
+                // Construct a new vertex from the indices given.
+                const STPoint3& position = positions[corner->position];
+                STVector3 normal = (corner->normal >= 0) ? normals[corner->normal] : STVector3::Zero;
+                STPoint2 texCoord = (corner->texCoord >= 0) ? texCoords[corner->texCoord] : STPoint2::Origin;
+
+                // If the vertex has no normal, then remember
+                // to create normals later...
+                if (corner->normal < 0)
+                    needsNormals = true;
+
+                mVertices.push_back(Vertex(position, normal, texCoord));
+            }
+
+            indices[curIndex++] = newIndex;
+            // Keep triangle fanning
+            if (curIndex == 3) {
+                mFaces.push_back(Face(indices[0], indices[1], indices[2]));
+                indices[1] = indices[2];
+                curIndex = 2;
+            }
+        }
+    }
+
     //
-    // Read the file line-by-line
+    // If the file didn't already have normals, then generate them.
     //
-    while (fgets(lineBuffer, kMaxLine, file)) {
-        ++lineIndex;
-        char* str = strtok(lineBuffer, " \t\n\r");
+    GenerateNormals();
 
-        //
-        // Skip empty or comment lines.
-        //
-        if (!str || str[0] == '\0' || str[0] == '#')
-            continue;
-        if (str[0] == 'g' || str[0] == 's' || strcmp(str, "usemtl") == 0 || strcmp(str, "mtllib") == 0)
-          continue;
-        //
-        // Process other lines based on their commands.
-        //
-        if (strcmp(str, "v") == 0) {
-            // Vertex position line. Read the position data (x, y, z).
-            str = strtok(NULL, "");
-            STPoint3 position;
-            sscanf(str, "%f %f %f\n", &position.x, &position.y, &position.z);
-            positions.push_back(position);
-        }
-        else if (strcmp(str, "vt") == 0) {
-            // Vertex texture coordinate line. Read the texture coord data.
-            str = strtok(NULL, "");
-            STPoint2 texCoord;
-            sscanf(str, "%f %f\n", &texCoord.x, &texCoord.y);
-            texCoords.push_back(texCoord);
-        }
-        else if (strcmp(str, "vn") == 0) {
-            // Vertex normal line. Read the normal data.
-            str = strtok(NULL, "");
-            STVector3 normal;
-            sscanf(str, "%f %f %f\n", &normal.x, &normal.y, &normal.z);
-            normals.push_back(normal);
-        }
-        else if (strcmp(str, "f") == 0) {
-            // Face command. Each vertex in the face will be defined by
-            // the indices of its position, texture coordinate and
-            // normal.
-            std::vector<Index> faceIndices;
-
-            // Read each vertex entry.
-            int curIndex = 0;
-            Index indices[3];
-            enum FaceFormat {
-              PosTexNorm, // %d/%d/%d
-              PosTex,     // %d/%d
-              PosNorm,    // %d//%d
-              Pos,         // %d
-              LAST_FACE_FORMAT
-            };
-
-            const char* FaceFormatToString[LAST_FACE_FORMAT] = {
-              "Position/Texture/Normal",
-              "Position/Texture",
-              "Position//Normal",
-              "Position",
-            };
-
-            bool set_format = false;
-            FaceFormat format;
-
-            const int kNoTextureIndex = -1;
-            const int kNoNormalIndex = -1;
-
-            int positionIdx;
-            int texCoordIdx;
-            int normalIdx;
-
-            while ((str = strtok(NULL, " \t\n\r")) != NULL) {
-
-                if (sscanf(str, "%d/%d/%d", &positionIdx, &texCoordIdx, &normalIdx) == 3) {
-                  if (!set_format) {
-                    format = PosTexNorm;
-                    set_format = true;
-                  } else {
-                    if (format != PosTexNorm) {
-                      fprintf(stderr, "STShape::LoadOBJ() - "
-                              "Line %d: Current face format is %s, but received another vertex in format %s\n",
-                              lineIndex, FaceFormatToString[format], FaceFormatToString[PosTexNorm]);
-                    }
-                  }
-                } else if (sscanf(str, "%d/%d", &positionIdx, &texCoordIdx) == 2) {
-                  if (!set_format) {
-                    format = PosTex;
-                    set_format = true;
-                  } else {
-                    if (format != PosTex) {
-                      fprintf(stderr, "STShape::LoadOBJ() - "
-                              "Line %d: Current face format is %s, but received another vertex in format %s\n",
-                              lineIndex, FaceFormatToString[format], FaceFormatToString[PosTex]);
-                    }
-                  }
-                } else if (sscanf(str, "%d//%d", &positionIdx, &normalIdx) == 2) {
-                  if (!set_format) {
-                    format = PosNorm;
-                    set_format = true;
-                  } else {
-                    if (format != PosNorm) {
-                      fprintf(stderr, "STShape::LoadOBJ() - "
-                              "Line %d: Current face format is %s, but received another vertex in format %s\n",
-                              lineIndex, FaceFormatToString[format], FaceFormatToString[PosNorm]);
-                    }
-                  }
-                  // Pass
-                } else if (sscanf(str, "%d", &positionIdx) == 1) {
-                  if (!set_format) {
-                    format = Pos;
-                    set_format = true;
-                  } else {
-                    if (format != Pos) {
-                      fprintf(stderr, "STShape::LoadOBJ() - "
-                              "Line %d: Current face format is %s, but received another vertex in format %s\n",
-                              lineIndex, FaceFormatToString[format], FaceFormatToString[Pos]);
-                    }
-                  }
-                } else {
-                  // TODO(boulos): Print out line #?
-                  fprintf(stderr, "STShape::LoadOBJ() - "
-                          "Line %d: Bad face format given %s\n", lineIndex, str);
-                  continue;
-                }
+    return ST_OK;
+}
 
-                //
-                // We look to see if we have already created a vertex
-                // based on this position/texCoord/normal, and reuse it
-                // if possible. Otherwise we add a new vertex.
-                //
-                positionIdx = OBJIndexing(positionIdx, positions.size());
-                texCoordIdx = (format == PosTexNorm ||
-                               format == PosTex)
-                                    ? OBJIndexing(texCoordIdx,
-                                                  texCoords.size())
-                                    : kNoTextureIndex;
-                normalIdx   = (format == PosTexNorm ||
-                               format == PosNorm)
-                                    ? OBJIndexing(normalIdx,
-                                                  texCoords.size())
-                                    : kNoNormalIndex;
-                size_t newIndex;
-
-                IntTriple key(positionIdx, IntPair(texCoordIdx, normalIdx));
-                IndexMap::const_iterator ii = indexMap.find(key);
-                if (ii != indexMap.end()) {
-                    newIndex = ii->second;
-                }
-                else {
-                  // Construct a new vertex from the indices given.
-                  STPoint3 position = positions[positionIdx];
-                  STVector3 normal = (normalIdx != kNoNormalIndex) ? normals[normalIdx] : STVector3::Zero;
-                  STPoint2 texCoord = (texCoordIdx != kNoTextureIndex) ? texCoords[texCoordIdx] : STPoint2::Origin;
-
-                  // If the vertex has no normal, then remember
-                  // to create normals later...
-                  if (normalIdx == kNoNormalIndex) {
-                    needsNormals = true;
-                  }
+//
+// An .stm file is the shape as it is laid out in memory, so loading one
+// maps the file and copies the arrays out without parsing anything:
+//
+//   STMHeader           kSTMHeaderSize bytes
+//   vertices            numVertices * vertexSize bytes
+//   (padding)           up to a multiple of kSTMAlignment
+//   faces               numFaces * faceSize bytes
+//
+// The header records the sizes of both structures and the byte order
+// of the machine that wrote the file, and a file that doesn't match
+// this build is rejected rather than converted. Sidecar files also
+// record the modification time (see GetFileStamp) and size of the OBJ
+// file they were made from; all zero in files written by Save().
+//
+// Quantized files store an STMQuantizedVertex per vertex instead,
+// with positions and texture coordinates as 16-bit fractions of the
+// bounding boxes in the header and normals in [-1, 1] as 16-bit
+// fixed point.
+//
+static const char kSTMMagic[4] = { 'S', 'T', 'M', '\0' };
+static const unsigned int kSTMVersion = 1;
+static const unsigned int kSTMByteOrder = 0x01020304;
+static const unsigned int kSTMQuantized = 1;
+static const size_t kSTMHeaderSize = 128;
+static const size_t kSTMAlignment = 64;
+
+struct STMHeader
+{
+    char magic[4];
+    unsigned int version;
+    unsigned int byteOrder;
+    unsigned int flags;
+    unsigned int vertexSize;
+    unsigned int faceSize;
+    unsigned long long numVertices;
+    unsigned long long numFaces;
+    long long sourceTime;
+    unsigned long long sourceSize;
+    float positionMin[3];
+    float positionMax[3];
+    float texCoordMin[2];
+    float texCoordMax[2];
+    char reserved[kSTMHeaderSize - 96];
+};
+
+struct STMQuantizedVertex
+{
+    unsigned short position[3];
+    short normal[3];
+    unsigned short texCoord[2];
+};
 
-                  Vertex newVertex(position, normal, texCoord);
-                  newIndex = AddVertex(newVertex);
-                  indexMap[key] = newIndex;
-                }
+static size_t AlignSTM(size_t offset)
+{
+    return (offset + kSTMAlignment - 1) & ~(kSTMAlignment - 1);
+}
 
-                indices[curIndex++] = newIndex;
-                // Keep triangle fanning
-                if (curIndex == 3) {
-                  AddFace(Face(indices[0], indices[1], indices[2]));
-                  indices[1] = indices[2];
-                  curIndex = 2;
-                }
+// Quantize x in [lo, lo + range] to 16 bits, and back.
+static unsigned short QuantizeSTM(float x, float lo, float range)
+{
+    if (range <= 0.f)
+        return 0;
+    float t = (x - lo) / range * 65535.f + 0.5f;
+    return (unsigned short)(t < 0.f ? 0.f : (t > 65535.f ? 65535.f : t));
+}
+
+static float DequantizeSTM(unsigned short q, float lo, float range)
+{
+    return lo + range * (float)q / 65535.f;
+}
+
+static short QuantizeNormalSTM(float x)
+{
+    float t = x * 32767.f;
+    t = t < -32767.f ? -32767.f : (t > 32767.f ? 32767.f : t);
+    return (short)(t < 0.f ? t - 0.5f : t + 0.5f);
+}
+
+// Get the stamp of a file, returning false if it can't be found.
+// The time is in nanoseconds where the system keeps them, so that
+// an edit in the same second as the last one still changes it.
+static bool GetFileStamp(const std::string& filename, long long& time,
+                         unsigned long long& size)
+{
+    struct stat st;
+    if (stat(filename.c_str(), &st) != 0)
+        return false;
+#if defined(__APPLE__)
+    time = (long long)st.st_mtimespec.tv_sec * 1000000000LL + st.st_mtimespec.tv_nsec;
+#elif !defined(_WIN32)
+    time = (long long)st.st_mtim.tv_sec * 1000000000LL + st.st_mtim.tv_nsec;
+#else
+    time = (long long)st.st_mtime * 1000000000LL;
+#endif
+    size = (unsigned long long)st.st_size;
+    return true;
+}
+
+// Save the shape to a file.
+// Returns ST_ERROR on failure, ST_OK on success.
+STStatus STShape::Save(const std::string& filename, bool quantize) const
+{
+    std::string ext = STGetExtension(filename);
+
+    if (ext.compare("STM") == 0) {
+        return SaveSTM(filename, quantize);
+    }
+    else {
+        fprintf(stderr,
+                "STShape::Save() - Unknown shape file type \"%s\".\n",
+                filename.c_str());
+        assert(false);
+        return ST_ERROR;
+    }
+}
+
+// Write the shape to a binary .stm file, tagged with the stamp of
+// its source file if it is a sidecar. A sidecar that can't be opened
+// (say, in a read-only directory) fails without complaint, since the
+// shape is already loaded.
+// Returns ST_ERROR on failure, ST_OK on success.
+STStatus STShape::SaveSTM(const std::string& filename, bool quantize,
+                          const FileStamp* source) const
+{
+    size_t numVertices = mVertices.size();
+    size_t numFaces = mFaces.size();
+
+    STMHeader header;
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, kSTMMagic, sizeof(header.magic));
+    header.version = kSTMVersion;
+    header.byteOrder = kSTMByteOrder;
+    header.flags = quantize ? kSTMQuantized : 0;
+    header.vertexSize = quantize ? sizeof(STMQuantizedVertex) : sizeof(Vertex);
+    header.faceSize = sizeof(Face);
+    header.numVertices = numVertices;
+    header.numFaces = numFaces;
+    if (source) {
+        header.sourceTime = source->time;
+        header.sourceSize = source->size;
+    }
+
+    //
+    // Quantize the vertices over their bounding boxes.
+    //
+    std::vector<STMQuantizedVertex> quantized;
+    if (quantize && numVertices > 0) {
+        const Vertex& first = mVertices[0];
+        float lo[5] = { first.position.x, first.position.y, first.position.z,
+                        first.texCoord.x, first.texCoord.y };
+        float hi[5] = { lo[0], lo[1], lo[2], lo[3], lo[4] };
+        for (size_t ii = 1; ii < numVertices; ++ii) {
+            const Vertex& v = mVertices[ii];
+            float values[5] = { v.position.x, v.position.y, v.position.z,
+                                v.texCoord.x, v.texCoord.y };
+            for (int jj = 0; jj < 5; ++jj) {
+                lo[jj] = std::min(lo[jj], values[jj]);
+                hi[jj] = std::max(hi[jj], values[jj]);
             }
         }
-        else {
-            //
-            // Unknown line - ignore and print a warning.
-            //
-            fprintf(stderr, "STShape::LoadOBJ() - "
-                    "Unable to parse line %d: %s (continuing)\n",
-                    lineIndex, lineBuffer);
+        for (int jj = 0; jj < 3; ++jj) {
+            header.positionMin[jj] = lo[jj];
+            header.positionMax[jj] = hi[jj];
+        }
+        for (int jj = 0; jj < 2; ++jj) {
+            header.texCoordMin[jj] = lo[3 + jj];
+            header.texCoordMax[jj] = hi[3 + jj];
+        }
+
+        float range[5];
+        for (int jj = 0; jj < 5; ++jj)
+            range[jj] = hi[jj] - lo[jj];
+
+        quantized.resize(numVertices);
+        int count = (int)numVertices;
+        #pragma omp parallel for
+        for (int ii = 0; ii < count; ++ii) {
+            const Vertex& v = mVertices[ii];
+            STMQuantizedVertex& q = quantized[ii];
+            q.position[0] = QuantizeSTM(v.position.x, lo[0], range[0]);
+            q.position[1] = QuantizeSTM(v.position.y, lo[1], range[1]);
+            q.position[2] = QuantizeSTM(v.position.z, lo[2], range[2]);
+            q.normal[0] = QuantizeNormalSTM(v.normal.x);
+            q.normal[1] = QuantizeNormalSTM(v.normal.y);
+            q.normal[2] = QuantizeNormalSTM(v.normal.z);
+            q.texCoord[0] = QuantizeSTM(v.texCoord.x, lo[3], range[3]);
+            q.texCoord[1] = QuantizeSTM(v.texCoord.y, lo[4], range[4]);
         }
     }
-    fclose(file);
+
+    FILE* file = fopen(filename.c_str(), "wb");
+    if (!file) {
+        if (!source) {
+            fprintf(stderr,
+                    "STShape::SaveSTM() - Could not open shape file '%s' for writing.\n",
+                    filename.c_str());
+        }
+        return ST_ERROR;
+    }
+
+    size_t vertexBytes = numVertices * header.vertexSize;
+    const void* vertexData = NULL;
+    if (numVertices > 0)
+        vertexData = quantize ? (const void*)&quantized[0] : (const void*)&mVertices[0];
+    static const char padding[kSTMAlignment] = { 0 };
+    size_t paddingBytes = AlignSTM(kSTMHeaderSize + vertexBytes) - (kSTMHeaderSize + vertexBytes);
+
+    bool ok = fwrite(&header, sizeof(header), 1, file) == 1;
+    if (ok && vertexBytes > 0)
+        ok = fwrite(vertexData, vertexBytes, 1, file) == 1;
+    if (ok && paddingBytes > 0)
+        ok = fwrite(padding, paddingBytes, 1, file) == 1;
+    if (ok && numFaces > 0)
+        ok = fwrite(&mFaces[0], numFaces * sizeof(Face), 1, file) == 1;
+    if (fclose(file) != 0)
+        ok = false;
+
+    if (!ok) {
+        fprintf(stderr,
+                "STShape::SaveSTM() - Could not write shape file '%s'.\n",
+                filename.c_str());
+        remove(filename.c_str());
+        return ST_ERROR;
+    }
+    return ST_OK;
+}
+
+// Load the shape from a binary .stm file. A sidecar file that wasn't
+// made from a file with the given stamp is turned down without
+// complaint, so the caller can rebuild it.
+// Returns ST_ERROR on failure, ST_OK on success.
+STStatus STShape::LoadSTM(const std::string& filename, const FileStamp* source)
+{
+    STMappedFile file;
+    if (!file.Open(filename)) {
+        if (!source) {
+            fprintf(stderr,
+                    "STShape::LoadSTM() - Could not open shape file '%s'.\n",
+                    filename.c_str());
+        }
+        return ST_ERROR;
+    }
+    const char* data = file.GetData();
+    size_t size = file.GetSize();
 
     //
-    // If the file didn't already have normals, then generate them.
+    // Check that the header describes this build's structures and
+    // that the arrays it describes fit in the file.
     //
-    GenerateNormals();
+    STMHeader header;
+    bool valid = size >= kSTMHeaderSize;
+    if (valid) {
+        memcpy(&header, data, sizeof(header));
+        bool quantized = (header.flags & kSTMQuantized) != 0;
+        valid = memcmp(header.magic, kSTMMagic, sizeof(header.magic)) == 0 &&
+                header.version == kSTMVersion &&
+                header.byteOrder == kSTMByteOrder &&
+                (header.flags & ~kSTMQuantized) == 0 &&
+                header.vertexSize == (quantized ? sizeof(STMQuantizedVertex)
+                                                : sizeof(Vertex)) &&
+                header.faceSize == sizeof(Face);
+    }
+    size_t facesOffset = 0;
+    if (valid) {
+        unsigned long long room = size - kSTMHeaderSize;
+        valid = header.numVertices <= room / header.vertexSize;
+        if (valid) {
+            facesOffset = AlignSTM(kSTMHeaderSize + (size_t)header.numVertices * header.vertexSize);
+            valid = facesOffset <= size &&
+                    header.numFaces <= (size - facesOffset) / header.faceSize;
+        }
+    }
+    if (!valid) {
+        if (!source) {
+            fprintf(stderr,
+                    "STShape::LoadSTM() - '%s' is not a valid shape file for this build.\n",
+                    filename.c_str());
+        }
+        return ST_ERROR;
+    }
+    if (source && (header.sourceTime != source->time ||
+                   header.sourceSize != source->size)) {
+        return ST_ERROR;
+    }
+
+    //
+    // Copy out the faces and check their indices.
+    //
+    size_t numVertices = (size_t)header.numVertices;
+    size_t numFaces = (size_t)header.numFaces;
+    const Face* faces = (const Face*)(data + facesOffset);
+    Index badIndex = 0;
+    for (size_t ii = 0; ii < numFaces; ++ii) {
+        for (int jj = 0; jj < 3; ++jj)
+            badIndex |= faces[ii].GetIndex(jj) >= numVertices;
+    }
+    if (badIndex) {
+        fprintf(stderr,
+                "STShape::LoadSTM() - Face index out of range in '%s'.\n",
+                filename.c_str());
+        return ST_ERROR;
+    }
+
+    //
+    // Copy out or decode the vertices.
+    //
+    const char* vertexData = data + kSTMHeaderSize;
+    if (!(header.flags & kSTMQuantized)) {
+        const Vertex* vertices = (const Vertex*)vertexData;
+        mVertices.assign(vertices, vertices + numVertices);
+    }
+    else {
+        const STMQuantizedVertex* quantized = (const STMQuantizedVertex*)vertexData;
+        float lo[5] = { header.positionMin[0], header.positionMin[1], header.positionMin[2],
+                        header.texCoordMin[0], header.texCoordMin[1] };
+        float range[5] = { header.positionMax[0] - lo[0], header.positionMax[1] - lo[1],
+                           header.positionMax[2] - lo[2], header.texCoordMax[0] - lo[3],
+                           header.texCoordMax[1] - lo[4] };
+
+        mVertices.resize(numVertices);
+        int count = (int)numVertices;
+        #pragma omp parallel for
+        for (int ii = 0; ii < count; ++ii) {
+            const STMQuantizedVertex& q = quantized[ii];
+            Vertex& v = mVertices[ii];
+            v.position.x = DequantizeSTM(q.position[0], lo[0], range[0]);
+            v.position.y = DequantizeSTM(q.position[1], lo[1], range[1]);
+            v.position.z = DequantizeSTM(q.position[2], lo[2], range[2]);
+            v.normal.x = q.normal[0] / 32767.f;
+            v.normal.y = q.normal[1] / 32767.f;
+            v.normal.z = q.normal[2] / 32767.f;
+            v.texCoord.x = DequantizeSTM(q.texCoord[0], lo[3], range[3]);
+            v.texCoord.y = DequantizeSTM(q.texCoord[1], lo[4], range[4]);
+        }
+    }
+    mFaces.assign(faces, faces + numFaces);
+
+    return ST_OK;
+}
+
+// Load the shape from an OBJ file through its sidecar .stm file,
+// writing a new one if it is missing or stale.
+// Returns ST_ERROR on failure, ST_OK on success.
+STStatus STShape::LoadCachedOBJ(const std::string& filename)
+{
+    FileStamp stamp;
+    if (!GetFileStamp(filename, stamp.time, stamp.size))
+        return LoadOBJ(filename);
+
+    std::string cacheName = filename + ".stm";
+    if (LoadSTM(cacheName, &stamp) == ST_OK)
+        return ST_OK;
+
+    if (LoadOBJ(filename) != ST_OK)
+        return ST_ERROR;
 
+    //
+    // Write the cache under a temporary name and move it into place,
+    // so that a reader never sees half of one. The name is unique to
+    // this process, so processes loading the same file at once each
+    // write their own. Failing to write it (say, to a read-only
+    // directory) only costs the next load time, so SaveSTM doesn't
+    // report a sidecar it can't open.
+    //
+    char pid[32];
+#ifndef _WIN32
+    sprintf(pid, ".%ld.tmp", (long)getpid());
+#else
+    sprintf(pid, ".%ld.tmp", (long)_getpid());
+#endif
+    std::string tempName = cacheName + pid;
+    if (SaveSTM(tempName, false, &stamp) == ST_OK) {
+#ifdef _WIN32
+        remove(cacheName.c_str());
+#endif
+        if (rename(tempName.c_str(), cacheName.c_str()) != 0)
+            remove(tempName.c_str());
+    }
     return ST_OK;
 }
 
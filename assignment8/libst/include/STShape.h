@@ -20,6 +20,13 @@
 * An STShape can be constructed from an OBJ model file:
 *   STShape* shape = new STShape("elephant.obj");
 *
+* The first load of an OBJ file leaves a binary copy of the shape
+* next to it (elephant.obj.stm), which later loads map straight into
+* memory as long as the OBJ file keeps its modification time and size.
+* A shape can also be saved to and loaded from an .stm file directly:
+*   shape->Save("elephant.stm");
+*   shape = new STShape("elephant.stm");
+*
 * or with one of the functions in the STShapes:: namespace.
 * These helper functions define simple primitive shapes:
 *   shape = STShapes::CreateCylinder(1.0, 2.0);
@@ -135,10 +142,12 @@ public:
     STShape(const VertexArray& vertices, const FaceArray& faces);
 
     //
-    // Create an STShape from a geometric model file.
-    // Currently only supports the OBJ file format.
+    // Create an STShape from a geometric model file, either
+    // an OBJ file or a binary .stm file written by Save().
+    // OBJ files are cached in a sidecar .stm file unless
+    // useCache is false.
     //
-    STShape(const std::string& filname);
+    STShape(const std::string& filname, bool useCache = true);
 
     //
     // Delete an existing shape and free the memory for its vertices
@@ -205,13 +214,54 @@ public:
     //
     void GenerateNormals();
 
+    //
+    // Save the shape to a file. Only the binary .stm format is
+    // supported. With quantize, positions and texture coordinates
+    // are stored as 16-bit fractions of their bounding boxes and
+    // normals as 16-bit fixed point, which halves the size of the
+    // vertices. Returns ST_ERROR on failure, ST_OK on success.
+    //
+    STStatus Save(const std::string& filename, bool quantize = false) const;
+
 private:
+    //
+    // The modification time (in nanoseconds) and size of a file,
+    // which tie a sidecar .stm file to the OBJ file it was made from.
+    //
+    struct FileStamp
+    {
+        long long time;
+        unsigned long long size;
+    };
+
     //
     // Load the shape with vertices and faces from the OBJ file.
     // Returns ST_ERROR on failure, ST_OK on success.
     //
+    // The file is memory-mapped and parsed in parallel chunks with
+    // a hand-written number parser. Corners that share a position,
+    // texture coordinate and normal share a vertex, looked up in a
+    // flat hash table. Faces with more than three corners become
+    // fans of triangles. Any normals in the file are discarded, and
+    // area-weighted ones are generated for every vertex.
+    //
     STStatus LoadOBJ(const std::string& filename);
 
+    //
+    // Load the shape from the OBJ file, or from its sidecar .stm
+    // file if that is up to date, writing one if not.
+    //
+    STStatus LoadCachedOBJ(const std::string& filename);
+
+    //
+    // Load or save a binary .stm file. A sidecar file only loads
+    // if it was made from a file with the given stamp; otherwise
+    // it fails quietly, as does saving one that can't be opened.
+    //
+    STStatus LoadSTM(const std::string& filename, const FileStamp* source = NULL);
+    STStatus SaveSTM(const std::string& filename, bool quantize,
+                     const FileStamp* source = NULL) const;
+
     // The vertices of this shape.
     VertexArray mVertices;
 